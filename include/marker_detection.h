@@ -0,0 +1,68 @@
+#ifndef __MARKER_DETECTION_H
+#define __MARKER_DETECTION_H
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/aruco.hpp>
+
+/* ArUco detection with an optional decimated candidate search.
+   With decimation > 1 the markers are searched in the image downsampled by that factor and the corners are scaled back
+   to full resolution. With refineWindow > 0 every corner is then refined with cv::cornerSubPix on the full resolution
+   image, converted to gray only inside the bounding box of each detected marker. The window has to cover the error of
+   the scaled corners, i.e. refineWindow >= decimation. */
+class MarkerDetector
+{
+public:
+    MarkerDetector(const cv::aruco::Dictionary & dictionary_) : dictionary(dictionary_), decimation(1), refineWindow(0) {}
+
+    void configure(int decimation_, int refineWindow_); // decimation 1 = search at full resolution, refineWindow 0 = no refinement
+    void detect(const cv::Mat & image, std::vector<std::vector<cv::Point2f> > & markerCorners, std::vector<int> & markerIds);
+
+private:
+    cv::aruco::Dictionary dictionary;
+    int decimation;
+    int refineWindow; // half size of the cornerSubPix search window [px]
+    cv::Mat decimated;  // reused between the frames
+    cv::Mat gray;
+
+    void refineCorners(const cv::Mat & image, std::vector<cv::Point2f> & corners);
+};
+
+/* Tracking-assisted marker detection.
+   The markers move only a few pixels between two frames, so instead of scanning the full frame the detector searches a
+   region around the predicted corners of every marker found in the previous frame. The prediction extrapolates the
+   image motion of the marker center, which only needs the detections themselves - the particle set is owned by the
+   filter thread. A full-frame scan is made every fullScanInterval frames, to pick up markers entering the view, and
+   in the frame after a tracked marker was lost. Markers found inside a region are reported with their own ID, so the
+   measurements are the same as from a full-frame scan. */
+#define MARKER_TRACK_MIN_MARGIN    8   // [px] around the predicted corners, covers the quiet zone of small markers
+
+typedef struct marker_track
+{
+    int ID;
+    std::vector<cv::Point2f> corners;
+    cv::Point2f velocity;   // [px/frame] of the marker center
+    unsigned int lastSeen;  // frame number
+} marker_track;
+
+class MarkerTracker
+{
+public:
+    MarkerTracker(const cv::aruco::Dictionary & dictionary) : detector(dictionary), fullScanInterval(30), marginScale(0.5f), frameCount(0), lastFullScan(0), trackLost(true) {}
+
+    // fullScanInterval <= 1 scans every frame, marginScale is the search margin relative to the marker size
+    void configure(unsigned int fullScanInterval_, float marginScale_);
+    void configureDetector(int decimation, int refineWindow) { detector.configure(decimation, refineWindow); }
+    void detect(const cv::Mat & image, std::vector<std::vector<cv::Point2f> > & markerCorners, std::vector<int> & markerIds);
+
+private:
+    MarkerDetector detector;
+    unsigned int fullScanInterval;
+    float marginScale;
+    unsigned int frameCount;
+    unsigned int lastFullScan;
+    bool trackLost;
+    std::vector<marker_track> tracks;
+
+    void updateTracks(const std::vector<std::vector<cv::Point2f> > & markerCorners, const std::vector<int> & markerIds, bool fullScan);
+};
+#endif
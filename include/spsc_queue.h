@@ -0,0 +1,52 @@
+#ifndef __SPSC_QUEUE_H
+#define __SPSC_QUEUE_H
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+// push() and pop() never block, they return false when the queue is full or empty.
+template<typename T>
+class SPSCQueue
+{
+public:
+    explicit SPSCQueue(size_t capacity) : buffer(capacity + 1), head(0), tail(0) {}
+
+    bool push(T &item) // producer only - the item is moved into the queue on success
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % buffer.size();
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        buffer[t] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) // consumer only
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(buffer[h]);
+        buffer[h] = T(); // do not keep e.g. image buffers alive in the free slot
+        head.store((h + 1) % buffer.size(), std::memory_order_release);
+        return true;
+    }
+
+    size_t size() // approximate when called concurrently
+    {
+        size_t h = head.load(std::memory_order_acquire);
+        size_t t = tail.load(std::memory_order_acquire);
+        return (t + buffer.size() - h) % buffer.size();
+    }
+
+private:
+    std::vector<T> buffer; // one slot is always free to tell a full queue from an empty one
+    alignas(64) std::atomic<size_t> head; // next slot to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail; // next slot to push, written by the producer
+};
+#endif
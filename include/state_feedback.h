@@ -0,0 +1,30 @@
+#ifndef __STATE_FEEDBACK_H
+#define __STATE_FEEDBACK_H
+#include <array>
+#include <cstddef>
+
+// State feedback u = K*x of an LQR design with N states, taken in place from the EKF estimate. The first state is the
+// tracked position, its error to the reference is saturated to 1 meter. Designs are compile-time tables, e.g.
+//   constexpr StateFeedback<3> zDesign = { {{ -0.2335, -0.1838, -0.1367 }}, {{ 13, 14, 15 }} };
+// and feedback() allocates nothing.
+template<std::size_t N>
+struct StateFeedback
+{
+    std::array<double, N> K;
+    std::array<unsigned char, N> states; // indices in the EKF state vector
+
+    double feedback(const double *est, double reference) const
+    {
+        double error = est[states[0]] - reference;
+        if (error > 1) { error = 1; } // NaN passes, the controllers check the output
+        if (error < -1) { error = -1; }
+
+        double u = K[0] * error;
+        for (std::size_t i = 1; i < N; i++) {
+            u += K[i] * est[states[i]];
+        }
+        return u;
+    }
+};
+
+#endif
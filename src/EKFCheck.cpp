@@ -0,0 +1,164 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+
+#include "ekf.h"
+#include "ekf_initialize.h"
+#include "ekf_terminate.h"
+
+using namespace std;
+
+// Regression check of ekf() on recorded flights. Every sample of a Mocap log (time, x, y, z, roll, pitch, yaw) is fed to
+// ekf() as the FastSLAM and PX4 measurement and as the references, the estimates are written to a csv file and compared
+// to a reference file written by an earlier build. EKFCheckDense is the same tool built with the generated dense
+// covariance propagation and inv() update (EKF_DENSE_PROPAGATION, EKF_SEQUENTIAL_UPDATE 0), so the current ekf() is
+// checked with
+//   EKFCheckDense src/FastSLAM/DataForPlotting/VerticalBox20s/170622_123426_Mocap.txt dense.csv
+//   EKFCheck src/FastSLAM/DataForPlotting/VerticalBox20s/170622_123426_Mocap.txt ekf.csv dense.csv 1e-9
+// The tolerance is relative to max(|reference|, 1e-3), 0 requires bit-identical results.
+// With threads > 1 as many independent filters (ekf_create) run the log concurrently, all of them have to reproduce the
+// outputs of the single filter exactly.
+// Usage: EKFCheck <Mocap log> <output.csv> [reference.csv] [tolerance] [repetitions] [threads]
+
+#define EKF_CHECK_OUTPUTS (19 + 9 + 1) // est, Pout, VarYaw
+
+static vector<vector<double> > loadCSV(const string &path)
+{
+    ifstream in(path.c_str());
+    string line;
+    vector<vector<double> > rows;
+    while (getline(in, line)) {
+        stringstream lineStream(line);
+        string cell;
+        vector<double> values;
+        while (getline(lineStream, cell, ',')) {
+            values.push_back(atof(cell.c_str()));
+        }
+        if (!values.empty()) {
+            rows.push_back(values);
+        }
+    }
+    return rows;
+}
+
+// runs the filter from its initial state over the whole log, returns the outputs of every step
+static void runEKF(ekf_state_t *state, const vector<vector<double> > &mocap, vector<vector<double> > &outputs)
+{
+    static const double C_fs[16] = { 0.01, 0, 0, 0, 0, 0.01, 0, 0, 0, 0, 0.01, 0, 0, 0, 0, 0.01 };
+    outputs.assign(mocap.size(), vector<double>(EKF_CHECK_OUTPUTS));
+
+    ekf_reset(state);
+    for (int k = 0; k < mocap.size(); k++) {
+        const vector<double> &m = mocap[k];
+        double fastslam[4] = { m[1], m[2], m[3], m[6] };
+        double PX4[3] = { m[5], m[4], m[6] }; // pitch, roll, yaw
+        double *est = &outputs[k][0], *Pout = &outputs[k][19], *VarYaw = &outputs[k][28];
+        ekf_step(state, 1, fastslam, C_fs, PX4, m[4], m[5], m[6], 0.587 + 0.1*sin(m[0]), est, Pout, VarYaw);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <Mocap log> <output.csv> [reference.csv] [tolerance] [repetitions] [threads]"
+             << endl;
+        return -1;
+    }
+    double tolerance = (argc > 4) ? atof(argv[4]) : 0;
+    int repetitions = (argc > 5) ? atoi(argv[5]) : 100;
+    int threads = (argc > 6) ? atoi(argv[6]) : 1;
+
+    vector<vector<double> > mocap = loadCSV(argv[1]);
+    for (int k = mocap.size() - 1; k >= 0; k--) {
+        if (mocap[k].size() < 7) {
+            mocap.erase(mocap.begin() + k);
+        }
+    }
+    if (mocap.empty()) {
+        cout << "No samples in " << argv[1] << endl;
+        return -1;
+    }
+
+    ekf_initialize();
+    ekf_state_t *state = ekf_create();
+    vector<vector<double> > outputs;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < repetitions; r++) {
+        runEKF(state, mocap, outputs);
+    }
+    double time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << mocap.size() << " steps, " << 1e6 * time / (repetitions * mocap.size()) << " us per ekf() call" << endl;
+    ekf_destroy(state);
+
+    if (threads > 1) {
+        vector<vector<vector<double> > > bank(threads);
+        vector<thread> workers;
+        start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(thread([&mocap, &bank, repetitions, t]() {
+                ekf_state_t *filter = ekf_create();
+                for (int r = 0; r < repetitions; r++) {
+                    runEKF(filter, mocap, bank[t]);
+                }
+                ekf_destroy(filter);
+            }));
+        }
+        for (int t = 0; t < threads; t++) {
+            workers[t].join();
+        }
+        time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        int differing = 0;
+        for (int t = 0; t < threads; t++) {
+            differing += (bank[t] != outputs) ? 1 : 0;
+        }
+        cout << threads << " filters in parallel, " << 1e6 * time / (repetitions * mocap.size()) << " us per step of all "
+             << "filters, " << differing << " differ from the single filter" << endl;
+        if (differing) {
+            return 1;
+        }
+    }
+    ekf_terminate();
+
+    ofstream out(argv[2]);
+    out.precision(17);
+    for (int k = 0; k < outputs.size(); k++) {
+        for (int i = 0; i < EKF_CHECK_OUTPUTS; i++) {
+            out << (i ? "," : "") << outputs[k][i];
+        }
+        out << "\n";
+    }
+
+    if (argc > 3) {
+        vector<vector<double> > reference = loadCSV(argv[3]);
+        if (reference.size() != outputs.size()) {
+            cout << "Reference has " << reference.size() << " steps, expected " << outputs.size() << endl;
+            return -1;
+        }
+        unsigned int differing = 0, exceeding = 0;
+        double maxError = 0, maxRelativeError = 0;
+        for (int k = 0; k < outputs.size(); k++) {
+            for (int i = 0; i < EKF_CHECK_OUTPUTS && i < reference[k].size(); i++) {
+                // the reference is printed with 17 digits, which is exact for doubles
+                if (outputs[k][i] != reference[k][i]) {
+                    double error = fabs(outputs[k][i] - reference[k][i]);
+                    double relativeError = error / max(fabs(reference[k][i]), 1e-3);
+                    differing++;
+                    exceeding += (relativeError > tolerance) ? 1 : 0;
+                    maxError = max(maxError, error);
+                    maxRelativeError = max(maxRelativeError, relativeError);
+                }
+            }
+        }
+        cout << "Compared to " << argv[3] << ": " << differing << " differing values, max error " << maxError
+             << " (relative " << maxRelativeError << "), " << exceeding << " above the tolerance " << tolerance << endl;
+        return (exceeding == 0) ? 0 : 1;
+    }
+
+    return 0;
+}
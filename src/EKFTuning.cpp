@@ -0,0 +1,404 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <cmath>
+#include <cstdlib>
+
+#include "ekf.h"
+#include "ekf_initialize.h"
+#include "ekf_terminate.h"
+
+using namespace std;
+
+// Offline tuning of the EKF noise parameters on recorded flights. The motion capture pose of the log is the ground truth,
+// every Monte-Carlo run feeds it to the filter with Gaussian noise added to the FastSLAM and PX4 measurements. For every
+// configuration of the grid (scale of the process noise Q, PX4 variance R_PX4, FastSLAM variance C_fs given to the filter)
+// the RMSE of the estimated pose and the average NEES of the pose (4 for a consistent filter) are reported. All runs use
+// the same noise sequences, run r of one configuration sees the same noise as run r of any other, and are spread over
+// all cores with one filter instance (ekf_create) per thread.
+// Logs:
+//   Mocap log of FastSLAM_node:     time, x, y, z, roll, pitch, yaw (references from the pose, hover thrust)
+//   controller flight log:          the 39 columns written by logToFile in controller.cpp
+//   rostopic echo -p /controllerLog csv with the field names of controllerLog.msg in the header
+// Results (no header line, like the other logs): Q scale, R_PX4, C_fs, RMSE x, y, z [m], yaw [rad], position [m],
+// average NEES, diverged runs
+// Usage: EKFTuning <log> <results.csv> [Q scales] [PX4 variances] [FastSLAM variances] [runs] [FastSLAM noise] [PX4 noise]
+//                  [threads]
+//   EKFTuning src/FastSLAM/DataForPlotting/VerticalBox20s/170622_123426_Mocap.txt tuning.csv 0.1,1,10 0.001,0.01 0.001,0.01 20
+
+#define EKF_TUNING_SETTLE_STEPS 50 // steps from the zero initial state that are not evaluated
+#define EKF_TUNING_HOVER_THRUST 0.587
+#define EKF_TUNING_NEES_DOF     4
+
+typedef struct flight_sample
+{
+    double pose[4]; // x, y, z, yaw of the motion capture, the ground truth
+    double PX4[3];  // pitch, roll, yaw
+    double roll_ref, pitch_ref, yaw_ref, thrust_ref;
+} flight_sample;
+
+typedef struct tuning_config
+{
+    double Qscale; // factor on the process noise of the flight configuration
+    double R_PX4;
+    double C_fs;
+} tuning_config;
+
+typedef struct tuning_result
+{
+    double squaredError[4]; // sums over the evaluated steps
+    double nees;
+    unsigned int steps;
+    unsigned int diverged;  // runs
+} tuning_result;
+
+static vector<double> parseList(const string &list)
+{
+    stringstream listStream(list);
+    string value;
+    vector<double> values;
+    while (getline(listStream, value, ',')) {
+        values.push_back(atof(value.c_str()));
+    }
+    return values;
+}
+
+static double wrapAngle(double angle)
+{
+    return atan2(sin(angle), cos(angle));
+}
+
+/* ############################## Logs ##############################  */
+static vector<string> splitLine(const string &line)
+{
+    string cells = line;
+    replace(cells.begin(), cells.end(), ',', ' ');
+    stringstream lineStream(cells);
+    string cell;
+    vector<string> values;
+    while (lineStream >> cell) {
+        values.push_back(cell);
+    }
+    return values;
+}
+
+// columns of logToFile in controller.cpp: sec, ms, estimatedStates[0..15], x, y, z, pitch, roll, yaw,
+// xyController.output[0..1], thrust, setpoints[0..2], twist[0..2], imuPitch, imuRoll, yawRef, estimatedStates[16..18]
+static flight_sample flightLogSample(const vector<double> &v)
+{
+    flight_sample s = { { v[18], v[19], v[20], v[23] }, { v[33], v[34], v[23] },
+                        v[25] - v[38], v[24] - v[37], v[35], v[26] }; // references as given to ekf() in flight
+    return s;
+}
+
+static flight_sample mocapSample(const vector<double> &v)
+{
+    flight_sample s = { { v[1], v[2], v[3], v[6] }, { v[5], v[4], v[6] }, v[4], v[5], v[6], EKF_TUNING_HOVER_THRUST };
+    return s;
+}
+
+// prints the reason and returns false if the log is not recognized
+static bool loadFlightLog(const string &path, vector<flight_sample> &samples)
+{
+    ifstream in(path.c_str());
+    if (!in) {
+        cout << "Cannot open " << path << endl;
+        return false;
+    }
+    string line;
+    vector<string> names;
+    int x = -1, y = -1, z = -1, roll = -1, pitch = -1, yaw = -1, refroll = -1, refpitch = -1, thrust = -1;
+    while (getline(in, line)) {
+        vector<string> cells = splitLine(line);
+        if (cells.empty()) {
+            continue;
+        }
+        char *end;
+        strtod(cells[0].c_str(), &end);
+        if (*end != '\0') {
+            // header of rostopic echo -p, e.g. %time,field.timestamp,field.x,...
+            names = cells;
+            for (int i = 0; i < names.size(); i++) {
+                string name = names[i].substr(names[i].compare(0, 6, "field.") == 0 ? 6 : 0);
+                x = (name == "x") ? i : x;
+                y = (name == "y") ? i : y;
+                z = (name == "z") ? i : z;
+                roll = (name == "roll") ? i : roll;
+                pitch = (name == "pitch") ? i : pitch;
+                yaw = (name == "yaw") ? i : yaw;
+                refroll = (name == "refroll") ? i : refroll;
+                refpitch = (name == "refpitch") ? i : refpitch;
+                thrust = (name == "thrust") ? i : thrust;
+            }
+            if (x < 0 || y < 0 || z < 0 || roll < 0 || pitch < 0 || yaw < 0) {
+                cout << path << " has no x, y, z, roll, pitch and yaw columns" << endl;
+                return false;
+            }
+            continue;
+        }
+
+        vector<double> v(cells.size());
+        for (int i = 0; i < cells.size(); i++) {
+            v[i] = atof(cells[i].c_str());
+        }
+        if (!names.empty() && v.size() == names.size()) {
+            flight_sample s = { { v[x], v[y], v[z], v[yaw] }, { v[pitch], v[roll], v[yaw] },
+                                refroll < 0 ? v[roll] : v[refroll], refpitch < 0 ? v[pitch] : v[refpitch], v[yaw],
+                                thrust < 0 ? EKF_TUNING_HOVER_THRUST : v[thrust] };
+            samples.push_back(s);
+        } else if (names.empty() && v.size() == 39) {
+            samples.push_back(flightLogSample(v));
+        } else if (names.empty() && v.size() == 7) {
+            samples.push_back(mocapSample(v));
+        }
+    }
+    if (samples.size() <= EKF_TUNING_SETTLE_STEPS) {
+        cout << "Not enough samples in " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+/* ############################## Monte-Carlo runs ##############################  */
+// e'*S^-1*e with the Cholesky factor of S, false if S is not positive definite
+static bool mahalanobis4(const double S[4][4], const double e[4], double &distance)
+{
+    double L[4][4] = { { 0 } }, w[4];
+    for (int j = 0; j < 4; j++) {
+        double d = S[j][j];
+        for (int k = 0; k < j; k++) {
+            d -= L[j][k] * L[j][k];
+        }
+        if (!(d > 0)) {
+            return false;
+        }
+        L[j][j] = sqrt(d);
+        for (int i = j + 1; i < 4; i++) {
+            double s = S[i][j];
+            for (int k = 0; k < j; k++) {
+                s -= L[i][k] * L[j][k];
+            }
+            L[i][j] = s / L[j][j];
+        }
+    }
+    distance = 0;
+    for (int i = 0; i < 4; i++) {
+        w[i] = e[i];
+        for (int k = 0; k < i; k++) {
+            w[i] -= L[i][k] * w[k];
+        }
+        w[i] /= L[i][i];
+        distance += w[i] * w[i];
+    }
+    return true;
+}
+
+// pose error and NEES of the estimate, with the measurement model of the FastSLAM pose in ekf_step
+static bool evaluatePose(const ekf_state_t *state, const double est[19], const double truth[4], tuning_result &result)
+{
+    double c = cos(est[12]), s = sin(est[12]);
+    double pose[4] = { c*est[0] - s*est[1], s*est[0] + c*est[1], est[13], est[12] };
+    double e[4];
+    for (int i = 0; i < 4; i++) {
+        e[i] = (i == 3) ? wrapAngle(pose[i] - truth[i]) : pose[i] - truth[i];
+    }
+
+    // S = H*P*H' with the nonzero columns of H: 0, 1, 12 for x and y, 13 for z and 12 for yaw
+    static const int cols[4] = { 0, 1, 12, 13 };
+    double H[4][4] = { { c, -s, -s*est[0] - c*est[1], 0 },
+                       { s, c, c*est[0] - s*est[1], 0 },
+                       { 0, 0, 0, 1 },
+                       { 0, 0, 1, 0 } };
+    double S[4][4];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            S[i][j] = 0;
+            for (int a = 0; a < 4; a++) {
+                for (int b = 0; b < 4; b++) {
+                    S[i][j] += H[i][a] * state->P[cols[a] + 19 * cols[b]] * H[j][b];
+                }
+            }
+        }
+    }
+
+    double nees;
+    if (!mahalanobis4(S, e, nees) || !isfinite(nees)) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        result.squaredError[i] += e[i] * e[i];
+    }
+    result.nees += nees;
+    result.steps++;
+    return true;
+}
+
+static void runMonteCarlo(ekf_state_t *state, const vector<flight_sample> &samples, const tuning_config &config,
+                          unsigned int run, double fsNoise, double px4Noise, tuning_result &result)
+{
+    mt19937 rng(run + 1);
+    normal_distribution<double> gauss(0.0, 1.0);
+    double C_fs[16] = { 0 };
+    for (int i = 0; i < 4; i++) {
+        C_fs[5 * i] = config.C_fs;
+    }
+
+    tuning_result run_result = { { 0, 0, 0, 0 }, 0, 0, 0 };
+    ekf_reset(state);
+    for (int i = 0; i < 19; i++) {
+        state->Q[i] *= config.Qscale;
+    }
+    for (int i = 0; i < 3; i++) {
+        state->R_PX4[i] = config.R_PX4;
+    }
+
+    for (int k = 0; k < samples.size(); k++) {
+        const flight_sample &s = samples[k];
+        double fastslam[4], PX4[3], est[19], Pout[9], VarYaw;
+        for (int i = 0; i < 4; i++) {
+            fastslam[i] = s.pose[i] + fsNoise * gauss(rng);
+        }
+        for (int i = 0; i < 3; i++) {
+            PX4[i] = s.PX4[i] + px4Noise * gauss(rng);
+        }
+        ekf_step(state, 1, fastslam, C_fs, PX4, s.roll_ref, s.pitch_ref, s.yaw_ref, s.thrust_ref, est, Pout, &VarYaw);
+        if (k >= EKF_TUNING_SETTLE_STEPS && !evaluatePose(state, est, s.pose, run_result)) {
+            result.diverged++;
+            return;
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        result.squaredError[i] += run_result.squaredError[i];
+    }
+    result.nees += run_result.nees;
+    result.steps += run_result.steps;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        cout << "Usage: " << argv[0] << " <log> <results.csv> [Q scales] [PX4 variances] [FastSLAM variances] [runs]"
+             << " [FastSLAM noise] [PX4 noise] [threads]" << endl;
+        return -1;
+    }
+    vector<double> Qscales = parseList((argc > 3) ? argv[3] : "0.1,0.3,1,3,10");
+    vector<double> R_PX4s = parseList((argc > 4) ? argv[4] : "0.001,0.01,0.1");
+    vector<double> C_fss = parseList((argc > 5) ? argv[5] : "0.001,0.01,0.1");
+    unsigned int runs = (argc > 6) ? atoi(argv[6]) : 10;
+    double fsNoise = (argc > 7) ? atof(argv[7]) : 0.02;  // [m], [rad] for the yaw
+    double px4Noise = (argc > 8) ? atof(argv[8]) : 0.01; // [rad]
+    unsigned int threads = (argc > 9) ? atoi(argv[9]) : 0;
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+
+    vector<flight_sample> samples;
+    if (!loadFlightLog(argv[1], samples)) {
+        return -1;
+    }
+
+    vector<tuning_config> configs;
+    for (int q = 0; q < Qscales.size(); q++) {
+        for (int r = 0; r < R_PX4s.size(); r++) {
+            for (int f = 0; f < C_fss.size(); f++) {
+                tuning_config config = { Qscales[q], R_PX4s[r], C_fss[f] };
+                configs.push_back(config);
+            }
+        }
+    }
+    if (configs.empty() || runs == 0) {
+        cout << "Nothing to run" << endl;
+        return -1;
+    }
+    cout << samples.size() << " samples, " << configs.size() << " configurations x " << runs << " runs on " << threads
+         << " threads" << endl;
+
+    // one job per run, the results are summed in job order so they do not depend on the number of threads
+    unsigned int jobs = configs.size() * runs;
+    vector<tuning_result> jobResults(jobs);
+    atomic<unsigned int> nextJob(0);
+    vector<thread> workers;
+    ekf_initialize();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.push_back(thread([&]() {
+            ekf_state_t *state = ekf_create();
+            for (unsigned int job = nextJob++; job < jobs; job = nextJob++) {
+                tuning_result &result = jobResults[job];
+                result = tuning_result();
+                runMonteCarlo(state, samples, configs[job / runs], job % runs, fsNoise, px4Noise, result);
+            }
+            ekf_destroy(state);
+        }));
+    }
+    for (unsigned int t = 0; t < threads; t++) {
+        workers[t].join();
+    }
+    double time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ekf_terminate();
+    cout << jobs << " runs in " << time << " s (" << 1e6 * time / ((double)jobs * samples.size()) * threads
+         << " us per ekf_step on one thread)" << endl;
+
+    ofstream out(argv[2]);
+    if (!out) {
+        cout << "Cannot write " << argv[2] << endl;
+        return -1;
+    }
+    vector<double> positionRMSE(configs.size()), anees(configs.size());
+    vector<unsigned int> diverged(configs.size());
+    for (int c = 0; c < configs.size(); c++) {
+        tuning_result result = { { 0, 0, 0, 0 }, 0, 0, 0 };
+        for (unsigned int r = 0; r < runs; r++) {
+            const tuning_result &run = jobResults[c * runs + r];
+            for (int i = 0; i < 4; i++) {
+                result.squaredError[i] += run.squaredError[i];
+            }
+            result.nees += run.nees;
+            result.steps += run.steps;
+            result.diverged += run.diverged;
+        }
+        double n = max(1u, result.steps);
+        positionRMSE[c] = sqrt((result.squaredError[0] + result.squaredError[1] + result.squaredError[2]) / n);
+        anees[c] = result.nees / (EKF_TUNING_NEES_DOF * n); // 1 for a consistent filter
+        diverged[c] = result.diverged;
+        out << configs[c].Qscale << "," << configs[c].R_PX4 << "," << configs[c].C_fs;
+        for (int i = 0; i < 4; i++) {
+            out << "," << sqrt(result.squaredError[i] / n);
+        }
+        out << "," << positionRMSE[c] << "," << EKF_TUNING_NEES_DOF * anees[c] << "," << diverged[c] << "\n";
+    }
+
+    // best position RMSE and the most consistent configuration, among the ones that never diverged
+    int best = -1, consistent = -1;
+    for (int c = 0; c < configs.size(); c++) {
+        if (diverged[c] > 0) {
+            continue;
+        }
+        if (best < 0 || positionRMSE[c] < positionRMSE[best]) {
+            best = c;
+        }
+        if (consistent < 0 || fabs(log(anees[c])) < fabs(log(anees[consistent]))) {
+            consistent = c;
+        }
+    }
+    if (best < 0) {
+        cout << "All configurations diverged" << endl;
+        return 1;
+    }
+    cout << "Lowest position RMSE " << positionRMSE[best] << " m (NEES " << EKF_TUNING_NEES_DOF * anees[best]
+         << "): Q scale " << configs[best].Qscale << ", R_PX4 " << configs[best].R_PX4 << ", C_fs "
+         << configs[best].C_fs << endl;
+    cout << "Most consistent NEES " << EKF_TUNING_NEES_DOF * anees[consistent] << " (position RMSE "
+         << positionRMSE[consistent] << " m): Q scale " << configs[consistent].Qscale << ", R_PX4 "
+         << configs[consistent].R_PX4 << ", C_fs " << configs[consistent].C_fs << endl;
+    cout << "Wrote " << argv[2] << endl;
+    return 0;
+}
@@ -1,11 +1,7 @@
 #include "FastSLAM.h"
+#include "Snapshot.h"
 
 #include <iostream>
-#include <ros/ros.h>
-#include <geometry_msgs/PoseStamped.h>
-#include <mavros_msgs/CommandBool.h>
-#include <mavros_msgs/SetMode.h>
-#include <mavros_msgs/State.h>
 
 // Boost is needed for Gaussian random number generation
 #include <boost/random/mersenne_twister.hpp>
@@ -22,6 +18,7 @@
 #include <string>
 #include <cstdlib>
 #include <random>
+#include <limits>
 #include <boost/filesystem.hpp>
 
 // Default marked in paranthesis
@@ -64,23 +61,25 @@ float pi_to_pi2(float ang)
     return ang;
 }
 
-void KF_cholesky_update(Eigen::VectorXf &x, Eigen::MatrixXf &P, Eigen::VectorXf &v, Eigen::MatrixXf &R, Eigen::MatrixXf &H)
+/* sizes are template arguments such that every temporary is a fixed-size matrix on the stack */
+template <int StateDim, int MeasDim>
+void KF_cholesky_update(Eigen::Matrix<float, StateDim, 1> &x, Eigen::Matrix<float, StateDim, StateDim> &P, const Eigen::Matrix<float, MeasDim, 1> &v, const Eigen::Matrix<float, MeasDim, MeasDim> &R, const Eigen::Matrix<float, MeasDim, StateDim> &H)
 {
-    Eigen::MatrixXf PHt = P*H.transpose();
-    Eigen::MatrixXf S = H*PHt + R;
+    Eigen::Matrix<float, StateDim, MeasDim> PHt = P*H.transpose();
+    Eigen::Matrix<float, MeasDim, MeasDim> S = H*PHt + R;
 
     // FIXME: why use conjugate()?
 #if FORCE_COVARIANCE_SYMMETRY
     S = (S+S.transpose()) * 0.5; //make symmetric
 #endif
-    Eigen::MatrixXf SChol = S.llt().matrixU();
+    Eigen::Matrix<float, MeasDim, MeasDim> SChol = S.llt().matrixU();
     //SChol.transpose();
     //SChol.conjugate();
 
 
-    Eigen::MatrixXf SCholInv = SChol.inverse(); //tri matrix
-    Eigen::MatrixXf W1 = PHt * SCholInv;
-    Eigen::MatrixXf W = W1 * SCholInv.transpose();
+    Eigen::Matrix<float, MeasDim, MeasDim> SCholInv = SChol.inverse(); //tri matrix
+    Eigen::Matrix<float, StateDim, MeasDim> W1 = PHt * SCholInv;
+    Eigen::Matrix<float, StateDim, MeasDim> W = W1 * SCholInv.transpose();
 
     x = x + W*v;
     P = P - W1*W1.transpose();
@@ -94,10 +93,10 @@ GOTMeasurement::GOTMeasurement(unsigned int i, Eigen::Vector3f GOT_meas)
 {
     c = i;
     z = GOT_meas;
-    timestamp = ros::Time::now();
+    timestamp = std::chrono::steady_clock::now();
 }
 
-Eigen::VectorXf GOTMeasurement::MeasurementModel(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+GOTMeasurement::VectorZ GOTMeasurement::MeasurementModel(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
     Eigen::Vector3f z;
     z << pose(0), pose(1), pose(2);
@@ -105,7 +104,7 @@ Eigen::VectorXf GOTMeasurement::MeasurementModel(VectorChiFastSLAMf pose, Eigen:
     return z;
 }
 
-Eigen::VectorXf GOTMeasurement::inverseMeasurementModel(VectorChiFastSLAMf pose)
+Eigen::Vector3f GOTMeasurement::inverseMeasurementModel(const VectorChiFastSLAMf &pose)
 {
     VectorChiFastSLAMf s = pose; // temp variable to make it look like equations    
     Eigen::Vector3f l;
@@ -114,26 +113,26 @@ Eigen::VectorXf GOTMeasurement::inverseMeasurementModel(VectorChiFastSLAMf pose)
     return l;
 }
 
-Eigen::MatrixXf GOTMeasurement::calculateHs(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+GOTMeasurement::MatrixHs GOTMeasurement::calculateHs(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
-    Eigen::MatrixXf Hs(3, 4);
-    Hs << Eigen::Matrix3f::Identity(3,3), Eigen::MatrixXf::Zero(3,1);
+    MatrixHs Hs;
+    Hs << Eigen::Matrix3f::Identity(), Eigen::Vector3f::Zero();
     //cout << " Hs" << Hs << endl;
     return Hs;
 }
 
-Eigen::MatrixXf GOTMeasurement::calculateHl(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+GOTMeasurement::MatrixHl GOTMeasurement::calculateHl(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
     //s = pose; // temp variable to make it look like equations
     Eigen::Matrix3f Hl = -1.0*Eigen::Matrix3f::Identity();
     return Hl;
 };
 
-Eigen::MatrixXf GOTMeasurement::getzCov(){
+const GOTMeasurement::MatrixZ& GOTMeasurement::getzCov(){
     return zCov;
 }
 
-Eigen::MatrixXf GOTMeasurement::zCov = 0.05*Eigen::Matrix3f::Identity(); // static variable - has to be declared outside class!
+Eigen::Matrix3f GOTMeasurement::zCov = 0.05*Eigen::Matrix3f::Identity(); // static variable - has to be declared outside class!
 
 
 /* ############################## Defines ImgMeasurement class ##############################  */
@@ -146,7 +145,7 @@ float ImgMeasurement::y0 = 0; // also known as ppy
     roll = 0;
     c = i;
     z = img_meas;
-    timestamp = ros::Time::now();
+    timestamp = std::chrono::steady_clock::now();
 }*/
 
 ImgMeasurement::ImgMeasurement(unsigned int i, Eigen::Vector3f img_meas,float roll_, float pitch_){
@@ -154,10 +153,10 @@ ImgMeasurement::ImgMeasurement(unsigned int i, Eigen::Vector3f img_meas,float ro
     roll = roll_;
     c = i;
     z = img_meas;
-    timestamp = ros::Time::now();
+    timestamp = std::chrono::steady_clock::now();
 }
 
-Eigen::VectorXf ImgMeasurement::MeasurementModel(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+ImgMeasurement::VectorZ ImgMeasurement::MeasurementModel(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
     Eigen::Vector3f z;
 
@@ -200,7 +199,7 @@ Eigen::VectorXf ImgMeasurement::MeasurementModel(VectorChiFastSLAMf pose, Eigen:
     return z;
 }
 
-Eigen::VectorXf ImgMeasurement::inverseMeasurementModel(VectorChiFastSLAMf pose)
+Eigen::Vector3f ImgMeasurement::inverseMeasurementModel(const VectorChiFastSLAMf &pose)
 {
     float c_psi = cos(pose(3));
     float s_psi = sin(pose(3));
@@ -236,9 +235,9 @@ Eigen::VectorXf ImgMeasurement::inverseMeasurementModel(VectorChiFastSLAMf pose)
     return WorldLandmark;
 }
 
-Eigen::MatrixXf ImgMeasurement::calculateHs(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+ImgMeasurement::MatrixHs ImgMeasurement::calculateHs(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
-    Eigen::MatrixXf Hs(3, 4);
+    MatrixHs Hs;
 
     float c_psi = cos(pose(3));
     float s_psi = sin(pose(3));
@@ -309,7 +308,7 @@ Eigen::MatrixXf ImgMeasurement::calculateHs(VectorChiFastSLAMf pose, Eigen::Vect
     return Hs;
 }
 
-Eigen::MatrixXf ImgMeasurement::calculateHl(VectorChiFastSLAMf pose, Eigen::Vector3f l)
+ImgMeasurement::MatrixHl ImgMeasurement::calculateHl(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l)
 {
     float c_psi = cos(pose(3));
     float s_psi = sin(pose(3));
@@ -366,7 +365,7 @@ Eigen::MatrixXf ImgMeasurement::calculateHl(VectorChiFastSLAMf pose, Eigen::Vect
     return Hl;
 }
 
-Eigen::MatrixXf ImgMeasurement::getzCov(){
+const ImgMeasurement::MatrixZ& ImgMeasurement::getzCov(){
     /*Eigen::Matrix3f cov;
     cov << 5, 0, 0,
             0, 5, 0,
@@ -374,7 +373,7 @@ Eigen::MatrixXf ImgMeasurement::getzCov(){
     return zCov;
 }
 
-Eigen::MatrixXf ImgMeasurement::zCov = 0.1*Eigen::Matrix3f::Identity(); // static variable - has to be declared outside class!
+Eigen::Matrix3f ImgMeasurement::zCov = 0.1*Eigen::Matrix3f::Identity(); // static variable - has to be declared outside class!
 Eigen::Vector3f ImgMeasurement::CameraOffset = Eigen::Vector3f::Zero(); // static variable - has to be declared outside class!
 
 
@@ -382,100 +381,67 @@ Eigen::Vector3f ImgMeasurement::CameraOffset = Eigen::Vector3f::Zero(); // stati
 
 /* ############################## Defines measurement set class ##############################  */
 MeasurementSet::MeasurementSet(){
-    firstMeasNode = NULL;
     nMeas = 0;
-    //cout << "n0: " << nMeas << endl;
 }
 
 MeasurementSet::MeasurementSet(Measurement *meas){
-    firstMeasNode = new Node_MeasurementSet;
-    firstMeasNode->meas = meas;
-    firstMeasNode->nextNode = NULL;
-    nMeas = 1;
-    firstMeasNode->measIdentifier = nMeas;
-    //cout << "n1: " << nMeas << endl;
+    nMeas = 0;
+    addMeasurement(meas);
 }
 
 MeasurementSet::~MeasurementSet(){
-    //deleteMeasurementSet();
+    // the measurements are deleted by emptyMeasurementSet of the owner
 }
 
 void MeasurementSet::emptyMeasurementSet(){
-    if(firstMeasNode != NULL){
-        if(firstMeasNode->nextNode != NULL){
-            emptyMeasurementSet(firstMeasNode->nextNode);
-        }
-        if (firstMeasNode->meas != NULL)
-            delete firstMeasNode->meas;
-        delete firstMeasNode;
-        nMeas = 0;
-        firstMeasNode = NULL;
+    for (int i = 0; i < nMeas; i++){
+        delete measurements[i];
     }
+    clear();
 }
 
-void MeasurementSet::emptyMeasurementSet(Node_MeasurementSet *MeasNode){
-    if(MeasNode->nextNode != NULL){
-        emptyMeasurementSet(MeasNode->nextNode);
-    }
-    delete MeasNode->meas;
-    delete MeasNode;
-    nMeas--;
+void MeasurementSet::clear(){
+    measurements.clear(); // keeps the capacity
+    nMeas = 0;
 }
 
 void MeasurementSet::addMeasurement(Measurement *meas){
-    if (firstMeasNode == NULL){
-        //cout << "Adding measurement to empty set (firstMeasNode)" << endl;
-        firstMeasNode = new Node_MeasurementSet;
-        firstMeasNode->meas = meas;
-        firstMeasNode->nextNode = NULL;
-        nMeas = 1;
-        firstMeasNode->measIdentifier = nMeas;
-    }
-    else{
-        //cout << "Adding measurement to set" << endl;
-        Node_MeasurementSet* tmp_pointer = firstMeasNode;
-        while(tmp_pointer->nextNode != NULL){
-            tmp_pointer = tmp_pointer->nextNode;
-        }
-        tmp_pointer->nextNode = new Node_MeasurementSet;
-        tmp_pointer->nextNode->meas = meas;
-        tmp_pointer->nextNode->nextNode = NULL;
-        nMeas++;
-        tmp_pointer->nextNode->measIdentifier = nMeas;
-    }
+    measurements.push_back(meas);
+    nMeas = measurements.size();
 }
 
 int MeasurementSet::countNumberOfMeasurements(){
-
-    if (firstMeasNode==NULL){
-        nMeas = 0;
-        return 0;
-    }
-    else{
-        int i = 1;
-        Node_MeasurementSet* tmp_pointer = firstMeasNode;
-        while(tmp_pointer->nextNode != NULL){
-            tmp_pointer = tmp_pointer->nextNode;
-            i++;
-        }
-        nMeas = i;
-        return i;
-    }
-
+    nMeas = measurements.size();
+    return nMeas;
 }
 
 int MeasurementSet::getNumberOfMeasurements(){
     return nMeas;
 }
 
-Measurement* MeasurementSet::getMeasurement(int i){
-    Node_MeasurementSet* tmp_measNodePointer = firstMeasNode;
 
-    while (tmp_measNodePointer->measIdentifier != i){
-        tmp_measNodePointer = tmp_measNodePointer->nextNode;
+bool LandmarkRegistry::contains(unsigned int ID) const{
+    if (ID < LANDMARK_REGISTRY_TABLE_SIZE){
+        return ID < table.size() && table[ID];
     }
+    return largeIDs.count(ID) != 0;
+}
 
-    return tmp_measNodePointer->meas;
+bool LandmarkRegistry::insert(unsigned int ID){
+    if (ID < LANDMARK_REGISTRY_TABLE_SIZE){
+        if (ID >= table.size()){
+            table.resize(ID+1, 0);
+        }
+        if (table[ID]){
+            return false;
+        }
+        table[ID] = 1;
+    }
+    else if (!largeIDs.insert(ID).second){
+        return false;
+    }
+    IDs.push_back(ID);
+    return true;
 }
 
 
@@ -484,16 +450,23 @@ Measurement* MeasurementSet::getMeasurement(int i){
 
 /* ############################## Defines Maps class ##############################  */
 
-unsigned int landmark::globalLandmarkCounter; // can be used to check if number of landmarks does not grow without bound
-unsigned int mapNode::globalMapNodeCounter; // can be used to check if number of MapNodes does not grow without bound
+std::atomic<unsigned int> landmark::globalLandmarkCounter(0); // can be used to check if number of landmarks does not grow without bound
+std::atomic<unsigned int> mapNode::globalMapNodeCounter(0); // can be used to check if number of MapNodes does not grow without bound
 int MapTree::mapTreeIdentifierCounter = 1;
 
+unsigned int objectPoolThreadIndex(){
+    static std::atomic<unsigned int> threadCounter(0);
+    static thread_local unsigned int threadIndex = threadCounter++;
+    return threadIndex;
+}
+
 MapTree::MapTree(const MapTree &MapToCopy)
 {
     mapTreeIdentifier = mapTreeIdentifierCounter;
 
     mapTreeIdentifierCounter++;
     root = MapToCopy.root;
+    memoryPool = MapToCopy.memoryPool;
     // we add new reference for a mapNode and have to increment its reference counter
     if (MapToCopy.root != NULL){
         MapToCopy.root->referenced++;
@@ -503,10 +476,11 @@ MapTree::MapTree(const MapTree &MapToCopy)
     N_nodes = MapToCopy.N_nodes;
 }
 
-MapTree::MapTree()
+MapTree::MapTree(MapMemoryPool* memoryPool_)
 {
     mapTreeIdentifier = mapTreeIdentifierCounter;
     mapTreeIdentifierCounter++;
+    memoryPool = memoryPool_;
   root=NULL;
   N_Landmarks = 0;
   N_layers = 0;
@@ -522,11 +496,44 @@ MapTree::~MapTree()
     }
 }
 
+mapNode* MapTree::newMapNode(){
+    if (memoryPool != NULL){
+        return memoryPool->nodes.allocate();
+    }
+    return new mapNode;
+}
+
+void MapTree::deleteMapNode(mapNode* node){
+    if (memoryPool != NULL){
+        memoryPool->nodes.release(node);
+    }
+    else{
+        delete node;
+    }
+}
+
+landmark* MapTree::newLandmark(){
+    if (memoryPool != NULL){
+        return memoryPool->landmarks.allocate();
+    }
+    return new landmark;
+}
+
+void MapTree::deleteLandmark(landmark* oldLandmark){
+    if (memoryPool != NULL){
+        memoryPool->landmarks.release(oldLandmark);
+    }
+    else{
+        delete oldLandmark;
+    }
+}
+
 void MapTree::removeReferenceToSubTree(mapNode* nodeToStartFrom){
-    if ((nodeToStartFrom != NULL) && nodeToStartFrom->referenced != 0){
-        nodeToStartFrom->referenced--;
+    unsigned int referencesLeft = nodeToStartFrom->referenced;
+    if (referencesLeft != 0){
+        referencesLeft = --(nodeToStartFrom->referenced); // decrement and read in one atomic operation, as other particles may release the same node concurrently
     }
-    if(nodeToStartFrom->referenced < 1){ // we have to delete the node! since the nodeToStartFrom
+    if(referencesLeft < 1){ // we have to delete the node! since the nodeToStartFrom
         //cout << "D50 ";
         //if( (nodeToStartFrom->left != NULL) && (nodeToStartFrom->left->referenced <= 1)){
         if(nodeToStartFrom->left != NULL){
@@ -540,10 +547,10 @@ void MapTree::removeReferenceToSubTree(mapNode* nodeToStartFrom){
         }
         if (nodeToStartFrom->key_value == 0){ // we are at a leaf node and have to delete the landmark
             //cout << "D53 ";
-            delete nodeToStartFrom->l;
+            deleteLandmark(nodeToStartFrom->l);
         }
         //cout << "D55 ";
-        delete nodeToStartFrom;
+        deleteMapNode(nodeToStartFrom);
         nodeToStartFrom = NULL;
     }
     else{ // we should not delete the node!
@@ -553,7 +560,7 @@ void MapTree::removeReferenceToSubTree(mapNode* nodeToStartFrom){
 
 void MapTree::insertLandmark(landmark* newLandmark){
  /*   if(N_Landmarks==0){
-        root = new mapNode;
+        root = newMapNode();
         root->key_value = 0;
         root->left=NULL;
         root->right=NULL;
@@ -580,6 +587,7 @@ void MapTree::insertLandmark(landmark* newLandmark){
             }
         }
 
+        root = makeNodeExclusive(root); // nodes shared with other particles are copied before they are modified
         mapNode* tmpMapNodePointer = root;
         int i = N_layers;
         unsigned int i2 = (tmpMapNodePointer->key_value)/2;
@@ -587,11 +595,12 @@ void MapTree::insertLandmark(landmark* newLandmark){
         while (i>1){ //when i = 1 we have reached the bottom of the tree
             if(newLandmark->c > tmpMapNodePointer->key_value){ // we go to the right
                 if(tmpMapNodePointer->right != NULL){
+                    tmpMapNodePointer->right = makeNodeExclusive(tmpMapNodePointer->right);
                     tmpMapNodePointer=tmpMapNodePointer->right;
                     //cout << "D:R" << endl;
                 }
                 else{ //tmpMapNodePointer->right != NULL does not point to anything we have to creat a new node!
-                    tmpMapNodePointer->right = new mapNode;
+                    tmpMapNodePointer->right = newMapNode();
                     tmpMapNodePointer->right->key_value = tmpMapNodePointer->key_value + i2;
                     tmpMapNodePointer->right->left = NULL;
                     tmpMapNodePointer->right->right = NULL;
@@ -605,11 +614,12 @@ void MapTree::insertLandmark(landmark* newLandmark){
             }
             else if(newLandmark->c <= tmpMapNodePointer->key_value){
                 if(tmpMapNodePointer->left != NULL){
+                    tmpMapNodePointer->left = makeNodeExclusive(tmpMapNodePointer->left);
                     tmpMapNodePointer=tmpMapNodePointer->left;
                     //cout << "D:L" << endl;
                 }
                 else{ //tmpMapNodePointer->right != NULL does not point to anything we have to creat a new node!
-                    tmpMapNodePointer->left = new mapNode;
+                    tmpMapNodePointer->left = newMapNode();
                     tmpMapNodePointer->left->key_value = tmpMapNodePointer->key_value - i2;
                     tmpMapNodePointer->left->left = NULL;
                     tmpMapNodePointer->left->right = NULL;
@@ -629,7 +639,7 @@ void MapTree::insertLandmark(landmark* newLandmark){
         // we are now at layer one at the bottom of the tree, and have to create a new leaf node to hold a pointer for the measurement!
         tmpMapNodePointer->l=newLandmark;
 
-        mapNode* pointerForNewLeafNode = new mapNode;
+        mapNode* pointerForNewLeafNode = newMapNode();
         pointerForNewLeafNode->key_value = 0;
         pointerForNewLeafNode->left = NULL;
         pointerForNewLeafNode->right = NULL;
@@ -650,11 +660,34 @@ N_Landmarks++;
 }
 
 
+mapNode* MapTree::makeNodeExclusive(mapNode* node){
+    // returns a node only referenced by this tree - if the node is shared with other particles a copy is made, which takes over our reference
+    if (node->referenced <= 1){
+        return node;
+    }
+
+    mapNode* copyOfNode = newMapNode();
+    copyOfNode->key_value = node->key_value;
+    copyOfNode->left = node->left;
+    copyOfNode->right = node->right;
+    copyOfNode->l = node->l;
+    copyOfNode->referenced = 1;
+    if (copyOfNode->left != NULL){
+        copyOfNode->left->referenced++;
+    }
+    if (copyOfNode->right != NULL){
+        copyOfNode->right->referenced++;
+    }
+
+    removeReferenceToSubTree(node); // deletes the node if the other particles released it in the meantime
+    return copyOfNode;
+}
+
 void MapTree::creatNewLayers(int Needed_N_layers){
      int missinLayers = Needed_N_layers-N_layers;
      int i = 1;
      while (i <= missinLayers){
-         mapNode* newRootNode = new mapNode;
+         mapNode* newRootNode = newMapNode();
          newRootNode->key_value = (int)pow(2,(N_layers+i)-1);
          newRootNode->left=root;
          newRootNode->right=NULL;
@@ -711,7 +744,7 @@ mapNode* MapTree::makeNewPath(landmark* newLandmarkData, mapNode* startNode){
     //cout << "D210 - keyvalue: " << startNode->key_value << endl;
     if(startNode->key_value > 0){
         // we need to make a new MapNode
-        mapNode* pointerForNewMapNode = new mapNode;
+        mapNode* pointerForNewMapNode = newMapNode();
         pointerForNewMapNode->l = NULL;
         pointerForNewMapNode->referenced = 1;
 
@@ -740,7 +773,7 @@ mapNode* MapTree::makeNewPath(landmark* newLandmarkData, mapNode* startNode){
     }
     else{ // we have reached the bottom of the tree and should make a new mapNode to hold the pointer for the updated landmark data
         //cout << "D26 ";
-        mapNode* pointerForNewLeafNode = new mapNode;
+        mapNode* pointerForNewLeafNode = newMapNode();
         pointerForNewLeafNode->key_value = 0;
         pointerForNewLeafNode->left = NULL;
         pointerForNewLeafNode->right = NULL;
@@ -773,30 +806,170 @@ void MapTree::printAllLandmarkPositions(){
 
 
 
+/* ############################## Defines IndexedMapTree class ##############################  */
+IndexedMapTree::IndexedMapTree(IndexedMapArena* arena_)
+{
+    static IndexedMapArena defaultArena; // used by maps created outside a particle set
+    arena = (arena_ != NULL) ? arena_ : &defaultArena;
+    root = 0;
+    N_Landmarks = 0;
+    N_layers = 0;
+}
+
+IndexedMapTree::IndexedMapTree(const IndexedMapTree &MapToCopy)
+{
+    arena = MapToCopy.arena;
+    root = MapToCopy.root;
+    if (root != 0){
+        arena->nodes.at(root)->referenced++;
+    }
+    N_Landmarks = MapToCopy.N_Landmarks;
+    N_layers = MapToCopy.N_layers;
+}
+
+IndexedMapTree::~IndexedMapTree()
+{
+    if (root != 0){
+        removeReferenceToSubTree(root, N_layers);
+    }
+}
+
+landmark* IndexedMapTree::newLandmark(){
+    unsigned int index = arena->landmarks.allocate();
+    landmark* newLandmarkData = arena->landmarks.at(index);
+    newLandmarkData->arenaIndex = index;
+    return newLandmarkData;
+}
+
+unsigned int IndexedMapTree::newNode(unsigned int left, unsigned int right){
+    unsigned int index = arena->nodes.allocate();
+    IndexedMapNode* node = arena->nodes.at(index);
+    node->child[0] = left;
+    node->child[1] = right;
+    node->referenced = 1;
+    return index;
+}
+
+void IndexedMapTree::removeReferenceToSubTree(unsigned int nodeToStartFrom, int layer){
+    IndexedMapNode* node = arena->nodes.at(nodeToStartFrom);
+    if (--(node->referenced) != 0){
+        return; // still used by other maps
+    }
+
+    if (layer == 0){ // leaf node owns the landmark
+        arena->landmarks.release(node->child[0]);
+    }
+    else{
+        for(int side = 0; side < 2; side++){
+            if (node->child[side] != 0){
+                removeReferenceToSubTree(node->child[side], layer-1);
+            }
+        }
+    }
+    arena->nodes.release(nodeToStartFrom);
+}
+
+void IndexedMapTree::creatNewLayers(int Needed_N_layers){
+    while (N_layers < Needed_N_layers){
+        if (root != 0){
+            root = newNode(root, 0); // the old tree becomes the left half of the new root, and our reference moves with it
+        }
+        N_layers++;
+    }
+}
+
+unsigned int IndexedMapTree::makeNewPath(landmark* newLandmarkData, unsigned int startNode, int layer){
+    if (layer == 0){ // bottom of the tree - new leaf holding the updated landmark
+        return newNode(newLandmarkData->arenaIndex, 0);
+    }
+
+    unsigned int side = (newLandmarkData->c >> (layer-1)) & 1; // 0 = left, 1 = right
+    unsigned int oldChild = 0;
+    unsigned int sharedChild = 0;
+    if (startNode != 0){
+        IndexedMapNode* node = arena->nodes.at(startNode);
+        oldChild = node->child[side];
+        sharedChild = node->child[1-side];
+        if (sharedChild != 0){
+            arena->nodes.at(sharedChild)->referenced++;
+        }
+    }
+
+    unsigned int newChild = makeNewPath(newLandmarkData, oldChild, layer-1);
+    return (side == 0) ? newNode(newChild, sharedChild) : newNode(sharedChild, newChild);
+}
+
+void IndexedMapTree::insertLandmark(landmark* newLandmark){
+    int Needed_N_layers = 1;
+    while ((newLandmark->c >> Needed_N_layers) != 0){
+        Needed_N_layers++;
+    }
+    creatNewLayers(Needed_N_layers);
+
+    if (extractLandmarkNodePointer(newLandmark->c) == NULL){
+        N_Landmarks++;
+    }
+    correctLandmark(newLandmark);
+}
+
+void IndexedMapTree::correctLandmark(landmark* newLandmarkData){
+    unsigned int newRoot = makeNewPath(newLandmarkData, root, N_layers);
+    if (root != 0){
+        removeReferenceToSubTree(root, N_layers);
+    }
+    root = newRoot;
+}
+
+landmark* IndexedMapTree::extractLandmarkNodePointer(unsigned int Landmark_identifier){
+    if ((Landmark_identifier >> N_layers) != 0 || root == 0){
+        return NULL;
+    }
+
+    unsigned int nodeIndex = root;
+    for(int layer = N_layers; layer > 0; layer--){
+        nodeIndex = arena->nodes.at(nodeIndex)->child[(Landmark_identifier >> (layer-1)) & 1];
+        if (nodeIndex == 0){
+            return NULL;
+        }
+    }
+    return arena->landmarks.at(arena->nodes.at(nodeIndex)->child[0]);
+}
+
+void IndexedMapTree::printAllLandmarkPositions(){
+    for(unsigned int i = 1;i<=N_Landmarks;i++){
+        if (extractLandmarkNodePointer(i) == NULL){
+            cout<<"Error: NULL pointer!";
+        }
+    }
+}
+
+
+
 /* ############################## Defines Path class ##############################  */
 Eigen::IOFormat Path::OctaveFmt(Eigen::FullPrecision, 0, ", ", ";\n", "", "", "[", "]");
 std::ofstream Path::dataFileStream;
 
-Path::Path(VectorChiFastSLAMf S, unsigned int k){
-    Node_Path* firstPathNode = new Node_Path;
-    firstPathNode->S = S;
-    firstPathNode->k = k;
-    firstPathNode->Ts = 0;
-    firstPathNode->nextNode = NULL;
-
-    PathRoot = new Node_Path;
-    PathRoot->nextNode = firstPathNode;
-    firstPathNode->referenced = 1;
-
+Path::Path(VectorChiFastSLAMf S, unsigned int k, unsigned int horizon_){
+    head = new PathChunk;
+    head->S[0] = S;
+    head->k[0] = k;
+    head->Ts[0] = 0;
+    head->nPoses = 1;
+    head->previous = NULL;
+    head->referenced = 1;
+    headCount = 1;
+
+    horizon = horizon_;
     PathLength = 1;
 }
 
 Path::Path(const Path &PathToCopy){
-    PathRoot = new Node_Path;
-    PathRoot->nextNode = PathToCopy.PathRoot->nextNode;
-    PathToCopy.PathRoot->nextNode->referenced++;
+    head = PathToCopy.head;
+    head->referenced++;
+    headCount = PathToCopy.headCount;
 
-    PathLength = 1;
+    horizon = PathToCopy.horizon;
+    PathLength = PathToCopy.PathLength;
 }
 
 Path::~Path(){
@@ -804,50 +977,101 @@ Path::~Path(){
 }
 
 void Path::deletePath(){
-    if(PathRoot->nextNode != NULL){
-        deletePath(PathRoot->nextNode);
-    }
-    PathRoot=NULL;
+    releaseChunk(head);
+    head = NULL;
+    headCount = 0;
+    PathLength = 0;
 }
 
-void Path::deletePath(Node_Path *PathNode){
-    if(PathNode->referenced > 1){
-        PathNode->referenced--;
-    }
-    else if (PathNode->nextNode != NULL){
-        deletePath(PathNode->nextNode);
-        delete PathNode;
+void Path::releaseChunk(PathChunk* chunk){
+    // iterative instead of recursive - a long path would otherwise overflow the stack
+    while (chunk != NULL && --(chunk->referenced) == 0){
+        PathChunk* previous = chunk->previous;
+        delete chunk;
+        chunk = previous;
     }
-    PathLength--;
 }
 
 void Path::addPose(VectorChiFastSLAMf S, unsigned int k, float Ts){
+    float TsTotal = Ts + head->Ts[headCount-1];
 
-    Node_Path* tmpPathNode = new Node_Path;
-    tmpPathNode->S = S;
-    tmpPathNode->k = k;
-    tmpPathNode->Ts = Ts + PathRoot->nextNode->Ts;
-    tmpPathNode->referenced = 0;
-    tmpPathNode->nextNode = PathRoot->nextNode;
+    // claim the next slot of the head chunk - fails if the chunk is full or a path sharing it has already appended there
+    unsigned int lastClaimed = headCount;
+    if (headCount == PATH_CHUNK_SIZE || !head->nPoses.compare_exchange_strong(lastClaimed, headCount+1)){
+        PathChunk* chunk = new PathChunk;
+        chunk->referenced = 1;
 
-    PathRoot->nextNode = tmpPathNode;
-    tmpPathNode->referenced++;
+        if (headCount == PATH_CHUNK_SIZE){
+            chunk->previous = head; // takes over our reference to head
+            headCount = 0;
+        }
+        else{
+            // copy our part of the shared head chunk
+            for(unsigned int i = 0; i < headCount; i++){
+                chunk->S[i] = head->S[i];
+                chunk->k[i] = head->k[i];
+                chunk->Ts[i] = head->Ts[i];
+            }
+            PathChunk* previous = head->previous;
+            if (previous != NULL){
+                previous->referenced++;
+            }
+            chunk->previous = previous;
+            releaseChunk(head);
+        }
+        chunk->nPoses = headCount+1;
+        head = chunk;
+
+        cutHistory();
+    }
+
+    head->S[headCount] = S;
+    head->k[headCount] = k;
+    head->Ts[headCount] = TsTotal;
+    headCount++;
 
     PathLength++;
 }
 
+void Path::cutHistory(){
+    // Drops all chunks behind the horizon. The extra chunk kept on top of the horizon guarantees that a path sharing our
+    // head is never cut below its own head chunk, even when it is one chunk behind us.
+    if (horizon == 0){
+        return;
+    }
+    unsigned int keepChunks = (horizon + PATH_CHUNK_SIZE - 1)/PATH_CHUNK_SIZE + 2;
+
+    PathChunk* chunk = head;
+    for(unsigned int i = 1; i < keepChunks && chunk != NULL; i++){
+        chunk = chunk->previous;
+    }
+    if (chunk != NULL){
+        PathChunk* dropped = chunk->previous.exchange(NULL);
+        if (dropped != NULL){
+            releaseChunk(dropped);
+            countLengthOfPath();
+        }
+    }
+}
+
+void Path::setHorizon(unsigned int horizon_){
+    horizon = horizon_;
+    cutHistory();
+}
+
 unsigned int Path::countLengthOfPath(){
 
-    if (PathRoot==NULL){
+    if (head==NULL){
         PathLength = 0;
         return PathLength;
     }
     else{
-        unsigned int i = 1;
-        Node_Path* tmp_pointer = PathRoot->nextNode;
-        while(tmp_pointer->nextNode != NULL){
-            tmp_pointer = tmp_pointer->nextNode;
-            i++;
+        // all chunks behind the head are full
+        unsigned int i = headCount;
+        PathChunk* chunk = head->previous;
+        while(chunk != NULL){
+            i = i + PATH_CHUNK_SIZE;
+            chunk = chunk->previous;
         }
         PathLength = i;
         return PathLength;
@@ -856,44 +1080,45 @@ unsigned int Path::countLengthOfPath(){
 
 VectorChiFastSLAMf* Path::getPose(){
     // return latest pose!
-    return &(PathRoot->nextNode->S);
+    return &(head->S[headCount-1]);
 }
 
 VectorChiFastSLAMf* Path::getPose(unsigned int k){
-    // returns specific pose!
-    //cout << "D10" << endl;
-    if (PathRoot==NULL){
-        //cout << "D11" << endl;
-        return NULL;
-    }
-    else{
-        //cout << "D12" << endl;
-
-        Node_Path* tmp_pointer = PathRoot->nextNode;
-
-        while(tmp_pointer->k != k){
-            //cout << tmp_pointer->k << ","; // for debugging
-            if (tmp_pointer->nextNode != NULL){
-                tmp_pointer = tmp_pointer->nextNode;
+    // returns specific pose! Poses are normally added with consecutive k, in which case the slot is computed directly and
+    // only one chunk per PATH_CHUNK_SIZE poses is visited
+    PathChunk* chunk = head;
+    unsigned int n = headCount;
+
+    while (chunk != NULL){
+        if (k >= chunk->k[0] && k <= chunk->k[n-1]){
+            unsigned int j = k - chunk->k[0];
+            if (j < n && chunk->k[j] == k){
+                return &(chunk->S[j]);
             }
-            else{
-                return NULL;
+            for(j = 0; j < n; j++){ // k is not consecutive in this chunk
+                if (chunk->k[j] == k){
+                    return &(chunk->S[j]);
+                }
             }
+            return NULL;
         }
-        return &(tmp_pointer->S);
+        chunk = chunk->previous;
+        n = PATH_CHUNK_SIZE;
     }
+    return NULL;
 }
 
 
 /* ############################## Defines particle class ##############################  */
-Particle::Particle(unsigned int GOT_ID, VectorChiFastSLAMf s0, MatrixChiFastSLAMf s_0_Cov, unsigned int k)   // default Constructor definition
+Particle::Particle(unsigned int GOT_ID, VectorChiFastSLAMf s0, MatrixChiFastSLAMf s_0_Cov, unsigned int k, ParticleMapMemory* mapPool)   // default Constructor definition
 {
     s = new Path(s0,k); // makes new path!
-    map = new MapTree; // makes new mapTree
-    w = 1;
+    map = new ParticleMap(mapPool); // makes new mapTree
+    logw = 0;
     s_k_Cov = s_0_Cov; // zero covariance
+    rngStream = NULL;
 
-    landmark* li = new landmark;
+    landmark* li = map->newLandmark();
     li->c = GOT_ID;
     li->lhat = Eigen::Vector3f::Zero();
     li->lCov = Eigen::Matrix3f::Zero();
@@ -904,9 +1129,10 @@ Particle::Particle(const Particle &ParticleToCopy)   // Copy Constructor
 {
     //cout << "Copying particle" << endl;
     s = new Path(*(ParticleToCopy.s)); //makes copy of s on the heap
-    map = new MapTree(*(ParticleToCopy.map));
-    w = ParticleToCopy.w;
+    map = new ParticleMap(*(ParticleToCopy.map));
+    logw = ParticleToCopy.logw;
     s_k_Cov = ParticleToCopy.s_k_Cov;
+    rngStream = NULL;
 }
 
 Particle::~Particle()
@@ -916,32 +1142,18 @@ Particle::~Particle()
     delete map; // call destructor of map
 }
 
-void Particle::updateParticle(MeasurementSet* z_Ex,MeasurementSet* z_New,VectorUFastSLAMf* u, unsigned int k, float Ts)
+void Particle::updateParticle(MeasurementSet* z_Ex,MeasurementSet* z_New,VectorUFastSLAMf* u, unsigned int k, float Ts, RandomStream* rngStream_)
 {
+    rngStream = rngStream_;
     VectorChiFastSLAMf s_proposale;
     VectorChiFastSLAMf* s_old = s->getPose();
 
 #if SLOW_INIT
     if (k > 5){
-#endif
-#if USE_MOTION_MODEL_JACOBIAN
-    MatrixChiFastSLAMf Fs = calculateFs(s_old,u,Ts);
-    MatrixChiFastSLAMf Fw = calculateFw(s_old,u,Ts);
-#else
-    MatrixChiFastSLAMf Fs = MatrixChiFastSLAMf::Zero();
-    MatrixChiFastSLAMf Fw = MatrixChiFastSLAMf::Identity();
 #endif
         s_proposale = drawSampleFromProposaleDistribution(s_old,u,z_Ex,Ts);
 
-        s->addPose(s_proposale,k, Ts); // we are done estimating our pose and add it to the path!
-
-        // OBS. In this code the importance weight is calculated differently and before the landmark corrections are done: https://github.com/bushuhui/fastslam/blob/master/src/fastslam_2.cpp#L593-L602
-        if (z_Ex != NULL && z_Ex->nMeas != 0 ){
-            calculateImportanceWeight(z_Ex,s_proposale,Fw);
-            s_k_Cov = MatrixChiFastSLAMf::Zero();
-        }
-
-        updateLandmarkEstimates(s_proposale,z_Ex,z_New);
+        completeUpdate(z_Ex,z_New,s_proposale,u,k,Ts);
 
 #if SLOW_INIT
     }
@@ -957,6 +1169,31 @@ void Particle::updateParticle(MeasurementSet* z_Ex,MeasurementSet* z_New,VectorU
 
 }
 
+// Everything after the pose has been sampled: add it to the path, weight the particle and correct the landmarks
+void Particle::completeUpdate(MeasurementSet* z_Ex, MeasurementSet* z_New, const VectorChiFastSLAMf &s_proposale, VectorUFastSLAMf* u, unsigned int k, float Ts)
+{
+    addPoseAndWeight(z_Ex,s_proposale,u,k,Ts);
+
+    updateLandmarkEstimates(s_proposale,z_Ex,z_New);
+}
+
+void Particle::addPoseAndWeight(MeasurementSet* z_Ex, const VectorChiFastSLAMf &s_proposale, VectorUFastSLAMf* u, unsigned int k, float Ts)
+{
+#if USE_MOTION_MODEL_JACOBIAN
+    MatrixChiFastSLAMf Fw = calculateFw(s->getPose(),u,Ts);
+#else
+    MatrixChiFastSLAMf Fw = MatrixChiFastSLAMf::Identity();
+#endif
+
+    s->addPose(s_proposale,k, Ts); // we are done estimating our pose and add it to the path!
+
+    // OBS. In this code the importance weight is calculated differently and before the landmark corrections are done: https://github.com/bushuhui/fastslam/blob/master/src/fastslam_2.cpp#L593-L602
+    if (z_Ex != NULL && z_Ex->nMeas != 0 ){
+        calculateImportanceWeight(z_Ex,s_proposale,Fw);
+        s_k_Cov = MatrixChiFastSLAMf::Zero();
+    }
+}
+
 void Particle::updateLandmarkEstimates(VectorChiFastSLAMf s_proposale, MeasurementSet* z_Ex, MeasurementSet* z_New){
 
     handleExMeas(z_Ex,s_proposale);
@@ -976,42 +1213,40 @@ void Particle::handleExMeas(MeasurementSet* z_Ex, VectorChiFastSLAMf s_proposale
             Measurement* z_tmp = z_Ex->getMeasurement(i);
             landmark* li_old = map->extractLandmarkNodePointer(z_tmp->c);
 
-            Eigen::VectorXf z_hat = z_tmp->MeasurementModel(s_proposale,li_old->lhat); // (3.33)
-            Eigen::VectorXf v = z_tmp->z - z_hat;
+            Measurement::VectorZ z_hat = z_tmp->MeasurementModel(s_proposale,li_old->lhat); // (3.33)
 
-            Eigen::MatrixXf Hl;
+            Measurement::MatrixHl Hl;
             Hl = z_tmp->calculateHl(s_proposale,li_old->lhat);  // (3.34)
 
             //li_old->lhat = xfi
             //li_old->lCov = Pfi
 
 #if USE_NUMERICAL_STABILIZED_KALMAN_FILTERS
-            Eigen::VectorXf x = li_old->lhat;
-            Eigen::MatrixXf P = li_old->lCov;
-            Eigen::MatrixXf H = Hl;
-            Eigen::MatrixXf R = z_tmp->getzCov();
+            Measurement::VectorZ v = z_tmp->z - z_hat;
+            Eigen::Vector3f x = li_old->lhat;
+            Eigen::Matrix3f P = li_old->lCov;
 
-            KF_cholesky_update(x, P, v, R, H);
+            KF_cholesky_update(x, P, v, z_tmp->getzCov(), Hl);
 
-            landmark* li_update = new landmark;
+            landmark* li_update = map->newLandmark();
             li_update->c = z_tmp->c;
             li_update->lhat = x;
             li_update->lCov = P;
 #endif
 
 #if !USE_NUMERICAL_STABILIZED_KALMAN_FILTERS
-            Eigen::MatrixXf Zk;
+            Measurement::MatrixZ Zk;
             Zk = z_tmp->getzCov() + Hl*li_old->lCov*Hl.transpose(); // (3.35)
-            Eigen::MatrixXf Kk;
+            Eigen::Matrix<float, 3, Measurement::Dim> Kk;
             Kk = li_old->lCov*Hl.transpose()*Zk.inverse(); // (3.36) - Kalman gain
 
-            landmark* li_update = new landmark;
+            landmark* li_update = map->newLandmark();
             li_update->c = z_tmp->c;
             li_update->lhat = li_old->lhat + Kk*(z_tmp->z - z_hat); // (3.37)            
 
-            Eigen::MatrixXf tmpMatrix;
+            Eigen::Matrix3f tmpMatrix;
             tmpMatrix = Kk*Hl;
-            li_update->lCov = (Eigen::MatrixXf::Identity(tmpMatrix.rows(),tmpMatrix.cols())-tmpMatrix)*li_old->lCov;// (3.38)*/
+            li_update->lCov = (Eigen::Matrix3f::Identity()-tmpMatrix)*li_old->lCov;// (3.38)*/
 #endif
 
 #if FORCE_COVARIANCE_SYMMETRY
@@ -1030,6 +1265,28 @@ void Particle::handleExMeas(MeasurementSet* z_Ex, VectorChiFastSLAMf s_proposale
 }
 
 
+void Particle::loadLandmarkCorrection(Measurement* z, const VectorChiFastSLAMf &s_proposale, LandmarkUpdateBatch &landmarks, int i){
+    landmark* li_old = map->extractLandmarkNodePointer(z->c);
+
+    Measurement::VectorZ v = z->z - z->MeasurementModel(s_proposale,li_old->lhat); // (3.33)
+    Measurement::MatrixHl Hl = z->calculateHl(s_proposale,li_old->lhat);  // (3.34)
+
+    landmarks.setLandmark(i, li_old->lhat, li_old->lCov, Hl, v);
+}
+
+void Particle::storeLandmarkCorrection(Measurement* z, const LandmarkUpdateBatch &landmarks, int i){
+    landmark* li_update = map->newLandmark();
+    li_update->c = z->c;
+    li_update->lhat = landmarks.getMean(i); // (3.37)
+    li_update->lCov = landmarks.getCov(i);  // (3.38) - symmetric by construction
+
+    if (li_update->lhat != li_update->lhat) {
+        cout << "landmark update NaN err, ID: " << z->c << endl;
+    }
+
+    map->correctLandmark(li_update);
+}
+
 void Particle::handleNewMeas(MeasurementSet* z_New, VectorChiFastSLAMf s_proposale){
 
     if (z_New != NULL && z_New->nMeas != 0 ){
@@ -1038,7 +1295,7 @@ void Particle::handleNewMeas(MeasurementSet* z_New, VectorChiFastSLAMf s_proposa
 
             Measurement* z_tmp = z_New->getMeasurement(i);
 
-            landmark* li = new landmark;
+            landmark* li = map->newLandmark();
 
             li->c = z_tmp->c;
 
@@ -1046,10 +1303,10 @@ void Particle::handleNewMeas(MeasurementSet* z_New, VectorChiFastSLAMf s_proposa
 
             //cout << "lhat" << li->lhat << endl;
 
-            Eigen::MatrixXf Hl;
+            Measurement::MatrixHl Hl;
             Hl = z_tmp->calculateHl(s_proposale,li->lhat);
 
-            Eigen::MatrixXf zCov_tmp = z_tmp->getzCov();
+            const Measurement::MatrixZ& zCov_tmp = z_tmp->getzCov();
 
             li->lCov = (Hl.transpose()*zCov_tmp.inverse()*Hl).inverse(); // this is different from this line: https://github.com/bushuhui/fastslam/blob/master/src/fastslam_core.cpp#L567
 
@@ -1062,29 +1319,9 @@ void Particle::handleNewMeas(MeasurementSet* z_New, VectorChiFastSLAMf s_proposa
     }
 }
 
-VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSLAMf* s_old, VectorUFastSLAMf* u,MeasurementSet* z_Ex, float Ts)
+// Conditions the proposal distribution on the measurements of known landmarks, eq (3.30) and (3.31). The Jacobians are evaluated at the predicted pose s_bar
+void Particle::conditionProposal(MeasurementSet* z_Ex, const VectorChiFastSLAMf &s_bar, VectorChiFastSLAMf &sMean_proposale, MatrixChiFastSLAMf &sCov_proposale)
 {
-    //cout << "D10" << endl;
-
-    VectorChiFastSLAMf s_bar = motionModel(s_old,u,Ts);
-    //cout << endl << "s_bar" << endl << s_bar << endl;
-
-    //MatrixChiFastSLAMf sCov_proposale= sCov; // eq (3.28)
-    VectorChiFastSLAMf sMean_proposale = s_bar; // eq (3.29)
-
-#if RESET_PARTICLE_PROPOSAL_COVARIANCE_ALWAYS
-    s_k_Cov = MatrixChiFastSLAMf::Zero();
-#endif
-
-#if USE_MOTION_MODEL_JACOBIAN
-    MatrixChiFastSLAMf Fs = calculateFs(s_old,u,Ts);
-    MatrixChiFastSLAMf Fw = calculateFw(s_old,u,Ts);
-#else
-    MatrixChiFastSLAMf Fs = MatrixChiFastSLAMf::Zero();
-    MatrixChiFastSLAMf Fw = MatrixChiFastSLAMf::Identity();
-#endif
-    MatrixChiFastSLAMf sCov_proposale = Fs.transpose()*s_k_Cov*Fs + Fw.transpose()*sCov*Fw; // sCovPrev should be reset if resampling has occured
-
     if (z_Ex != NULL){
 
         for(int i = 1; i <= z_Ex->nMeas; i = i + 1 ) {
@@ -1094,16 +1331,16 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSL
             landmark* li_old = map->extractLandmarkNodePointer(z_tmp->c);
             //cout << "landmark in map: " << li_old->lhat << endl;
 
-            Eigen::MatrixXf Hli;
-            Hli = z_tmp->calculateHl(s_bar,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHl Hli;
+            Hli = z_tmp->calculateHl(s_bar,li_old->lhat);
 
             //cout << "prop Hli" << endl << Hli << endl;
 
-            Eigen::MatrixXf Hsi;
-            Hsi = z_tmp->calculateHs(s_bar,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHs Hsi;
+            Hsi = z_tmp->calculateHs(s_bar,li_old->lhat);
 
-            Eigen::MatrixXf Zki;
-            Eigen::MatrixXf zCov_tmp = z_tmp->getzCov();
+            Measurement::MatrixZ Zki;
+            const Measurement::MatrixZ& zCov_tmp = z_tmp->getzCov();
 
 /*
             if(li_old->c == 55){
@@ -1113,11 +1350,11 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSL
 */
             Zki = zCov_tmp + Hli*(li_old->lCov)*Hli.transpose();
 
-            Eigen::VectorXf zhat;
+            Measurement::VectorZ zhat;
             zhat = z_tmp->MeasurementModel(s_bar,li_old->lhat);
 
 #if !USE_NUMERICAL_STABILIZED_KALMAN_FILTERS
-            Eigen::MatrixXf Kk;
+            Eigen::Matrix<float, 4, Measurement::Dim> Kk;
             Kk = sCov_proposale*Hsi.transpose() * (Hsi*sCov_proposale*Hsi.transpose() + Zki).inverse();
 
             sCov_proposale = (Hsi.transpose()*Zki.inverse()*Hsi + sCov_proposale.inverse()).inverse();  // eq (3.30)
@@ -1139,11 +1376,11 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSL
             rows = tmp.rows();
             cols = tmp.cols();*/
 
-            Eigen::VectorXf x = sMean_proposale;
-            Eigen::MatrixXf P = sCov_proposale;
-            Eigen::VectorXf v = (z_tmp->z - zhat);
-            Eigen::MatrixXf R = Zki;
-            Eigen::MatrixXf H = Hsi;
+            VectorChiFastSLAMf x = sMean_proposale;
+            MatrixChiFastSLAMf P = sCov_proposale;
+            Measurement::VectorZ v = (z_tmp->z - zhat);
+            const Measurement::MatrixZ& R = Zki;
+            const Measurement::MatrixHs& H = Hsi;
 
             /*cout << "################## proposale ##################" << endl;
             cout << "z: " << endl << z_tmp->z << endl << endl;
@@ -1197,6 +1434,33 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSL
         }
     }
 
+}
+
+VectorChiFastSLAMf Particle::drawSampleFromProposaleDistribution(VectorChiFastSLAMf* s_old, VectorUFastSLAMf* u,MeasurementSet* z_Ex, float Ts)
+{
+    //cout << "D10" << endl;
+
+    VectorChiFastSLAMf s_bar = motionModel(s_old,u,Ts);
+    //cout << endl << "s_bar" << endl << s_bar << endl;
+
+    //MatrixChiFastSLAMf sCov_proposale= sCov; // eq (3.28)
+    VectorChiFastSLAMf sMean_proposale = s_bar; // eq (3.29)
+
+#if RESET_PARTICLE_PROPOSAL_COVARIANCE_ALWAYS
+    s_k_Cov = MatrixChiFastSLAMf::Zero();
+#endif
+
+#if USE_MOTION_MODEL_JACOBIAN
+    MatrixChiFastSLAMf Fs = calculateFs(s_old,u,Ts);
+    MatrixChiFastSLAMf Fw = calculateFw(s_old,u,Ts);
+#else
+    MatrixChiFastSLAMf Fs = MatrixChiFastSLAMf::Zero();
+    MatrixChiFastSLAMf Fw = MatrixChiFastSLAMf::Identity();
+#endif
+    MatrixChiFastSLAMf sCov_proposale = Fs.transpose()*s_k_Cov*Fs + Fw.transpose()*sCov*Fw; // sCovPrev should be reset if resampling has occured
+
+    conditionProposal(z_Ex, s_bar, sMean_proposale, sCov_proposale);
+
     //cout << endl << "##############################" << endl;
     //cout << endl << "sMean_proposale" << endl << sMean_proposale << endl;
     //cout << endl << "sCov_proposale" << endl << sCov_proposale << endl;
@@ -1238,16 +1502,16 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistributionNEW(VectorChiFas
             landmark* li_old = map->extractLandmarkNodePointer(z_tmp->c);
             //cout << "landmark in map: " << li_old->lhat << endl;
 
-            Eigen::MatrixXf Hli;
-            Hli = z_tmp->calculateHl(s_bar,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHl Hli;
+            Hli = z_tmp->calculateHl(s_bar,li_old->lhat);
 
             //cout << "prop Hli" << endl << Hli << endl;
 
-            Eigen::MatrixXf Hsi;
-            Hsi = z_tmp->calculateHs(s_bar,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHs Hsi;
+            Hsi = z_tmp->calculateHs(s_bar,li_old->lhat);
 
-            Eigen::MatrixXf Zki;
-            Eigen::MatrixXf zCov_tmp = z_tmp->getzCov();
+            Measurement::MatrixZ Zki;
+            const Measurement::MatrixZ& zCov_tmp = z_tmp->getzCov();
 /*
             if(li_old->c == 55){
                 cout << endl << "li_55->lCov" << endl << li_old->lCov << endl;
@@ -1260,10 +1524,10 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistributionNEW(VectorChiFas
             // Rk = Zki
             // Hk = Hsi
             // Pk = sCov_proposale
-            Eigen::MatrixXf Kk;
+            Eigen::Matrix<float, 4, Measurement::Dim> Kk;
             Kk = sCov_proposale*Hsi.transpose() * (Hsi*sCov_proposale*Hsi.transpose() + Zki).inverse();
 
-            Eigen::VectorXf zhat;
+            Measurement::VectorZ zhat;
             zhat = z_tmp->MeasurementModel(s_bar,li_old->lhat);
 
             //cout << "i: " << i << "     z_tmp->c: " << z_tmp->c << endl;
@@ -1271,44 +1535,34 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistributionNEW(VectorChiFas
             //cout << "li_old->lhat: " << endl << li_old->lhat << endl << endl;
             //cout << "z_tmp->MeasurementModel: " << endl << zhat << endl << endl;
 
-            Eigen::MatrixXf tmp;
-            tmp = Kk * Hsi;
-            int rows, cols;
-            rows = tmp.rows();
-            cols = tmp.cols();
-
-            Eigen::VectorXf x = sMean_proposale;
-            Eigen::MatrixXf P = sCov_proposale;
-            Eigen::VectorXf v = (z_tmp->z - zhat);
-            Eigen::MatrixXf R = Zki;
-            Eigen::MatrixXf H = Hsi;
+            VectorChiFastSLAMf x = sMean_proposale;
+            MatrixChiFastSLAMf P = sCov_proposale;
+            Measurement::VectorZ v = (z_tmp->z - zhat);
+            const Measurement::MatrixZ& R = Zki;
+            const Measurement::MatrixHs& H = Hsi;
 
             KF_cholesky_update(x, P, v, R, H);
 
             //sCov_proposale = (Hsi.transpose()*Zki.inverse()*Hsi + sCov_proposale.inverse()).inverse();  // eq (3.30)
             //sMean_proposale = sMean_proposale + sCov_proposale*Hsi.transpose()*Zki.inverse()*(z_tmp->z - zhat); // eq (3.31)
             sMean_proposale = sMean_proposale + Kk*(z_tmp->z - zhat); // eq (3.31)
-            sCov_proposale = (Eigen::MatrixXf::Identity(rows,cols) - Kk*Hsi) * sCov_proposale * (Eigen::MatrixXf::Identity(rows,cols) - Kk*Hsi).transpose() + Kk*Zki*Kk.transpose();  // eq (3.30)
+            sCov_proposale = (MatrixChiFastSLAMf::Identity() - Kk*Hsi) * sCov_proposale * (MatrixChiFastSLAMf::Identity() - Kk*Hsi).transpose() + Kk*Zki*Kk.transpose();  // eq (3.30)
             //cout << endl << "--sCov_proposale (method 1)" << endl << sCov_proposale << endl;
 
             // ==== Implementation according to  https://github.com/bushuhui/fastslam/blob/master/src/fastslam_2.cpp#L575-L577
-            Eigen::VectorXf xv = sMean_proposale;
-            Eigen::MatrixXf Pv = sCov_proposale;
-
-            Eigen::MatrixXf Hvi = Hsi;
-            Eigen::MatrixXf Hfi = Hli;
-            Eigen::MatrixXf Sf = Zki;
-            Eigen::MatrixXf Sfi = Sf.inverse();
+            VectorChiFastSLAMf xv = sMean_proposale;
+            MatrixChiFastSLAMf Pv = sCov_proposale;
 
-            Eigen::VectorXf vi = v;
+            const Measurement::MatrixHs& Hvi = Hsi;
+            Measurement::MatrixZ Sfi = Zki.inverse();
 
             //proposal covariance
-            Eigen::MatrixXf Pv_inv = Pv.llt().solve(Eigen::MatrixXf::Identity(Pv.rows(), Pv.cols()));
+            MatrixChiFastSLAMf Pv_inv = Pv.llt().solve(MatrixChiFastSLAMf::Identity());
             Pv = Hvi.transpose() * Sfi * Hvi + Pv_inv; //Pv.inverse();
-            Pv = Pv.llt().solve(Eigen::MatrixXf::Identity(Pv.rows(), Pv.cols()));//Pv.inverse();
+            Pv = Pv.llt().solve(MatrixChiFastSLAMf::Identity());//Pv.inverse();
 
             //proposal mean
-            xv = xv + Pv * Hvi.transpose() * Sfi *vi;
+            xv = xv + Pv * Hvi.transpose() * Sfi *v;
 
             // =================
 
@@ -1332,55 +1586,107 @@ VectorChiFastSLAMf Particle::drawSampleFromProposaleDistributionNEW(VectorChiFas
 }
 
 
-//http://moby.ihme.washington.edu/bradbell/mat2cpp/randn.cpp.xml
-Eigen::MatrixXf randn(int m, int n)
-{
-    // use formula 30.3 of Statistical Distributions (3rd ed)
-    // Merran Evans, Nicholas Hastings, and Brian Peacock
-    int urows = m * n + 1;
-    Eigen::VectorXf u(urows);
-
-    //u is a random matrix
-#if 1
-    for (int r=0; r<urows; r++) {
-        // FIXME: better way?
-        u(r) = std::rand() * 1.0/RAND_MAX;
-    }
-#else
-    u = ( (VectorXf::Random(urows).array() + 1.0)/2.0 ).matrix();
-#endif
+/* ############################## Defines RandomStream class ##############################  */
+RandomStream::RandomStream(uint32_t seed, uint32_t streamId){
+    this->seed(seed, streamId);
+}
 
+void RandomStream::seed(uint32_t seed, uint32_t streamId){
+    key[0] = seed;
+    key[1] = streamId;
+    counter[0] = counter[1] = counter[2] = counter[3] = 0;
+    blockUsed = 4; // no block generated yet
+}
 
-    Eigen::MatrixXf x(m,n);
+void RandomStream::nextBlock(){
+    // Philox4x32-10, see Salmon et al. "Parallel random numbers: as easy as 1, 2, 3"
+    const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;
+    const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
 
-    int     i, j, k;
-    float   square, amp, angle;
+    for(int round = 0; round < 10; round++){
+        uint64_t p0 = (uint64_t)M0 * c0;
+        uint64_t p1 = (uint64_t)M1 * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += W0;
+        k1 += W1;
+    }
+    block[0] = c0; block[1] = c1; block[2] = c2; block[3] = c3;
+    blockUsed = 0;
 
-    k = 0;
-    for(i = 0; i < m; i++) {
-        for(j = 0; j < n; j++) {
-            if( k % 2 == 0 ) {
-                square = - 2. * std::log( u(k) );
-                if( square < 0. )
-                    square = 0.;
-                amp = sqrt(square);
-                angle = 2. * M_PI * u(k+1);
-                x(i, j) = amp * std::sin( angle );
-            }
-            else
-                x(i, j) = amp * std::cos( angle );
+    // 128 bit counter
+    if (++counter[0] == 0 && ++counter[1] == 0 && ++counter[2] == 0){
+        ++counter[3];
+    }
+}
 
-            k++;
+void RandomStream::fillUniform(float* out, int n){
+    for(int i = 0; i < n; i++){
+        if (blockUsed == 4){
+            nextBlock();
         }
+        // upper 24 bits centered in their interval - never exactly 0 or 1, so log() is safe
+        out[i] = ((block[blockUsed++] >> 8) + 0.5f) * (1.0f/16777216.0f);
     }
+}
 
-    return x;
+float RandomStream::uniform(){
+    float u;
+    fillUniform(&u, 1);
+    return u;
 }
 
-Eigen::MatrixXf rand(int m, int n)
-{
-    Eigen::MatrixXf x(m,n);
-    int i, j;
+void RandomStream::fillNormal(float* out, int n){
+    // Box-Muller on pairs of uniforms. The uniforms are generated first, so the transform is a branch free loop the
+    // compiler can vectorize
+    int nPairs = (n+1)/2;
+    if ((int)scratch.size() < 2*nPairs){
+        scratch.resize(2*nPairs);
+    }
+    fillUniform(scratch.data(), 2*nPairs);
+
+    const float* u1 = scratch.data();
+    const float* u2 = scratch.data() + nPairs;
+    int nFull = n/2;
+    for(int i = 0; i < nFull; i++){
+        float amp = sqrt(-2.0f*log(u1[i]));
+        float angle = 2.0f*(float)M_PI*u2[i];
+        out[2*i] = amp*sin(angle);
+        out[2*i+1] = amp*cos(angle);
+    }
+    if (nFull < nPairs){ // odd n - the second variate of the last pair is dropped
+        out[n-1] = sqrt(-2.0f*log(u1[nFull]))*sin(2.0f*(float)M_PI*u2[nFull]);
+    }
+}
+
+static RandomStream defaultRandomStream(1495718309);
+
+void seedDefaultRandomStream(uint32_t seed){
+    defaultRandomStream.seed(seed, 0);
+}
+
+Eigen::MatrixXf randn(int m, int n)
+{
+    return randn(m, n, defaultRandomStream);
+}
+
+Eigen::MatrixXf randn(int m, int n, RandomStream &stream)
+{
+    Eigen::MatrixXf x(m,n);
+    stream.fillNormal(x.data(), m*n);
+    return x;
+}
+
+Eigen::MatrixXf rand(int m, int n)
+{
+    Eigen::MatrixXf x(m,n);
+    int i, j;
     float rand_max = float(RAND_MAX);
 
     for(i = 0; i < m; i++) {
@@ -1392,15 +1698,21 @@ Eigen::MatrixXf rand(int m, int n)
 
 VectorChiFastSLAMf Particle::drawSampleRandomPose(VectorChiFastSLAMf sMean_proposale, MatrixChiFastSLAMf sCov_proposale)
 {
-    Eigen::MatrixXf Cov = sCov_proposale;
+    MatrixChiFastSLAMf Cov = sCov_proposale;
 
 #if FORCE_COVARIANCE_SYMMETRY
     Cov = (Cov+Cov.transpose()) * 0.5; //make symmetric
 #endif
 
     //choleksy decomposition
-    Eigen::MatrixXf S = Cov.llt().matrixL();
-    Eigen::MatrixXf X = randn(4,1);
+    MatrixChiFastSLAMf S = Cov.llt().matrixL();
+    VectorChiFastSLAMf X;
+    if (rngStream != NULL){
+        rngStream->fillNormal(X.data(), 4);
+    }
+    else{
+        X = randn(4,1);
+    }
 
     return S*X + sMean_proposale;
 }
@@ -1484,9 +1796,9 @@ MatrixChiFastSLAMf Particle::calculateFw(VectorChiFastSLAMf *s_k_old, VectorUFas
 }
 
 void Particle::calculateImportanceWeight(MeasurementSet* z_Ex, VectorChiFastSLAMf s_proposale,MatrixChiFastSLAMf Fw){
-    Eigen::MatrixXf wCov_i;
-    double wi = 1;
-    double w_tmp = 1;
+    Measurement::MatrixZ wCov_i;
+    double log_wi = 0;
+    double log_w_tmp = 0;
     //cout << "imp s_proposale: " << endl << s_proposale << endl;
 
     if (z_Ex != NULL){
@@ -1496,19 +1808,19 @@ void Particle::calculateImportanceWeight(MeasurementSet* z_Ex, VectorChiFastSLAM
 
             //cout << "imp s_proposale: " << endl << s_proposale << endl;
             //cout << "old li: " << endl << li_old->lhat << endl;
-            Eigen::MatrixXf Hli;
-            Hli = z_tmp->calculateHl(s_proposale,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHl Hli;
+            Hli = z_tmp->calculateHl(s_proposale,li_old->lhat);
             //cout << "imp Hli" << endl << Hli << endl;
 
-            Eigen::MatrixXf Hsi;
-            Hsi = z_tmp->calculateHs(s_proposale,li_old->lhat); //resizes automatically due to the "=" operator
+            Measurement::MatrixHs Hsi;
+            Hsi = z_tmp->calculateHs(s_proposale,li_old->lhat);
             //cout << "imp Hsi" << endl << Hsi << endl;
 
-            Eigen::VectorXf zhat;
+            Measurement::VectorZ zhat;
             zhat = z_tmp->MeasurementModel(s_proposale,li_old->lhat);
            // cout << "imp zhat" << endl << zhat << endl;
 
-            Eigen::VectorXf z_diff;
+            Measurement::VectorZ z_diff;
             z_diff = z_tmp->z - zhat;
             //cout << "z" << endl << z_tmp->z << endl;
 
@@ -1521,33 +1833,18 @@ void Particle::calculateImportanceWeight(MeasurementSet* z_Ex, VectorChiFastSLAM
 
 //            cout << "imp wCov_i: " << wCov_i << endl;
 
-            Eigen::MatrixXf expTerm;
-            expTerm = z_diff.transpose()*wCov_i.inverse()*z_diff;
-//            cout << "imp exp: " << expTerm << endl;
-
-            double determinant = (2*pi*wCov_i).determinant();
-
-            w_tmp = 10000000000000*1/(sqrt( determinant ))*exp( -0.5*expTerm(0,0) );// (3.46) and  (14.2) on page 459 in IPRP
-
-            if (w_tmp != w_tmp){
-                cout << "#####################################################" << endl;
-                cout << "imp calculated weight tmp: " << w_tmp << endl;
-                cout << "imp s_proposale: " << endl << s_proposale << endl;
-                cout << "z" << endl << z_tmp->z << endl;
-                cout << "old li: " << endl << li_old->lhat << endl;
-                cout << "imp Hli" << endl << Hli << endl;
-                cout << "imp Hsi" << endl << Hsi << endl;
-                cout << "imp zhat" << endl << zhat << endl;
-                cout << "imp wCov_i: " << endl << wCov_i << endl;
-                cout << "imp determinant: " << determinant << endl;
-                cout << "imp exp: " << expTerm << endl;
-            }
+            // Mahalanobis distance and log-determinant from the Cholesky factor wCov_i = L*L' - no inverse or determinant needed
+            Eigen::LLT<Measurement::MatrixZ> wCov_llt(wCov_i);
+            Measurement::MatrixZ L = wCov_llt.matrixL();
+            Measurement::VectorZ y = L.triangularView<Eigen::Lower>().solve(z_diff);
+            double expTerm = y.squaredNorm();
+            double logDeterminant = 2*L.diagonal().array().log().sum();
 
+            log_w_tmp = -0.5*(expTerm + logDeterminant + Measurement::Dim*log(2*pi));// log of (3.46) and  (14.2) on page 459 in IPRP
 
-            if (w_tmp == 0) {
+            if (log_w_tmp != log_w_tmp || wCov_llt.info() != Eigen::Success){
                 cout << "#####################################################" << endl;
-                cout << "imp Weight = 0!" << endl;
-                cout << "imp calculated weight tmp: " << w_tmp << endl;
+                cout << "imp calculated log weight tmp: " << log_w_tmp << endl;
                 cout << "imp s_proposale: " << endl << s_proposale << endl;
                 cout << "z" << endl << z_tmp->z << endl;
                 cout << "old li: " << endl << li_old->lhat << endl;
@@ -1555,21 +1852,15 @@ void Particle::calculateImportanceWeight(MeasurementSet* z_Ex, VectorChiFastSLAM
                 cout << "imp Hsi" << endl << Hsi << endl;
                 cout << "imp zhat" << endl << zhat << endl;
                 cout << "imp wCov_i: " << endl << wCov_i << endl;
-                cout << "imp determinant: " << determinant << endl;
+                cout << "imp log determinant: " << logDeterminant << endl;
                 cout << "imp exp: " << expTerm << endl;
             }
 
-
-            if (i==1){
-                wi = w_tmp;
-            }
-            else{
-                wi = wi*w_tmp;
-            }
+            log_wi = log_wi + log_w_tmp;
         }
         //cout << "wCov" << endl << wCov_i << endl << endl;
-        //cout << "calculated weigth: " << wi << endl;
-        w = wi; // (non-normalized) importance weight
+        //cout << "calculated log weigth: " << log_wi << endl;
+        logw = logw + log_wi; // (non-normalized) log importance weight - accumulates until the next resampling resets it
     }
     else{ cout << "Error in calculation of importance weight! You should not have reached this point!" << endl; }
 }
@@ -1577,7 +1868,7 @@ void Particle::calculateImportanceWeight(MeasurementSet* z_Ex, VectorChiFastSLAM
 
 double Particle::getWeigth()
 {
-    return w;
+    return exp(logw);
 }
 
 MatrixChiFastSLAMf Particle::sCov = 0.1*MatrixChiFastSLAMf::Identity(); // static variable - has to be declared outside class!
@@ -1595,30 +1886,483 @@ boost::mt19937 Particle::rng; // Creating a new random number generator every ti
 
 
 
+/* ############################## Defines ParticleUpdatePool class ##############################  */
+ParticleUpdatePool::ParticleUpdatePool(int nThreads, int nParticles){
+    this->nThreads = nThreads;
+    this->nParticles = nParticles;
+
+    jobGeneration = 0;
+    workersBusy = 0;
+    stopWorkers = false;
+    job = NULL;
+
+    // the calling thread handles the first partition, so only nThreads-1 workers are started
+    for(int t = 1; t<nThreads; t++){
+        workers.push_back(std::thread(&ParticleUpdatePool::workerLoop, this, t));
+    }
+}
+
+ParticleUpdatePool::~ParticleUpdatePool(){
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        stopWorkers = true;
+    }
+    jobStart.notify_all();
+    for(unsigned int t = 0; t<workers.size(); t++){
+        workers[t].join();
+    }
+}
+
+int ParticleUpdatePool::getNThreads(){
+    return nThreads;
+}
+
+void ParticleUpdatePool::forEachParticle(const std::function<void(int)> &job_){
+    {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        job = &job_;
+        workersBusy = workers.size();
+        jobGeneration++;
+    }
+    jobStart.notify_all();
+
+    updateRange(0);
+
+    std::unique_lock<std::mutex> lock(jobMutex);
+    jobDone.wait(lock, [this]{ return workersBusy == 0; });
+}
+
+void ParticleUpdatePool::workerLoop(int threadIndex){
+    unsigned int handledGeneration = 0;
+
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(jobMutex);
+            jobStart.wait(lock, [this, handledGeneration]{ return stopWorkers || jobGeneration != handledGeneration; });
+            if (stopWorkers){
+                return;
+            }
+            handledGeneration = jobGeneration;
+        }
+
+        updateRange(threadIndex);
+
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            workersBusy--;
+        }
+        jobDone.notify_one();
+    }
+}
+
+void ParticleUpdatePool::updateRange(int threadIndex){
+    // contiguous partition of the particles 1..nParticles
+    int first = 1 + (threadIndex*nParticles)/nThreads;
+    int last = ((threadIndex+1)*nParticles)/nThreads;
+
+    for(int i = first; i<=last; i++){
+        (*job)(i);
+    }
+}
+
+
+
+/* ############################## Defines ParticleStateBatch class ##############################  */
+// index of element (r,c) in the upper triangle arrays - symmetric in r and c
+static inline int symIndex(int r, int c){
+    static const int index[4][4] = {{0,1,2,3},{1,4,5,6},{2,5,7,8},{3,6,8,9}};
+    return index[r][c];
+}
+
+typedef float ParticleLanes[PARTICLE_BATCH_LANES];
+
+// out (+)= F' * P * F in every lane of a block - F row by row, P and out upper triangles
+static inline void congruenceLanes(const ParticleLanes* __restrict F, const ParticleLanes* __restrict P, ParticleLanes* __restrict out, bool accumulate){
+    for(int r = 0; r<4; r++){
+        for(int c = r; c<4; c++){
+            float sum[PARTICLE_BATCH_LANES];
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                sum[i] = accumulate ? out[symIndex(r,c)][i] : 0;
+            }
+            for(int a = 0; a<4; a++){
+                for(int b = 0; b<4; b++){
+                    for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                        sum[i] += F[a*4+r][i]*P[symIndex(a,b)][i]*F[b*4+c][i];
+                    }
+                }
+            }
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                out[symIndex(r,c)][i] = sum[i];
+            }
+        }
+    }
+}
+
+ParticleStateBatch::ParticleStateBatch(int nParticles_){
+    nParticles = nParticles_;
+    ParticleStateBlock empty = {}; // unused lanes of the last block hold a zero pose and covariance, which stay finite
+    blocks.assign((nParticles + PARTICLE_BATCH_LANES - 1) / PARTICLE_BATCH_LANES, empty);
+}
+
+void ParticleStateBatch::predict(VectorUFastSLAMf* u, float Ts, const MatrixChiFastSLAMf &motionCov){
+    // Same motion model and Jacobians as Particle::motionModel, calculateFs and calculateFw
+    const float ux = (*u)(0), uy = (*u)(1), uz = (*u)(2), uyaw = (*u)(3);
+    const bool sampleRateError = Ts > 3;
+    if (sampleRateError) {
+        cout << "Motion model: Sample rate error" << endl;
+    }
+
+    float Q[10];
+    for(int r = 0; r<4; r++){
+        for(int c = r; c<4; c++){
+            Q[symIndex(r,c)] = motionCov(r,c);
+        }
+    }
+
+    for(int b = 0; b<(int)blocks.size(); b++){
+        const ParticleLanes* __restrict s = blocks[b].s;
+        ParticleLanes* __restrict mean = blocks[b].mean;
+        ParticleLanes* __restrict cov = blocks[b].cov;
+
+        // the only scalar part - the rest of the block works on whole lanes
+        float c_psi[PARTICLE_BATCH_LANES], s_psi[PARTICLE_BATCH_LANES];
+        for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+            c_psi[i] = cos(s[3][i]);
+            s_psi[i] = sin(s[3][i]);
+        }
+
+        if (sampleRateError) {
+            for(int j = 0; j<4; j++){
+                for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                    mean[j][i] = s[j][i]; // error with the sampling time, just use old pose estimate
+                }
+            }
+        }
+        else{
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                mean[0][i] = s[0][i] + Ts * (c_psi[i]*ux - s_psi[i]*uy);
+                mean[1][i] = s[1][i] + Ts * (s_psi[i]*ux + c_psi[i]*uy);
+                mean[2][i] = s[2][i] + Ts * uz;
+                mean[3][i] = s[3][i] + uyaw;
+            }
+        }
+
+        // sCov_proposale = Fs'*s_k_Cov*Fs + Fw'*sCov*Fw
+        float F[16][PARTICLE_BATCH_LANES];
+        float P[10][PARTICLE_BATCH_LANES];
+        bool accumulate = false;
+#if USE_MOTION_MODEL_JACOBIAN && !RESET_PARTICLE_PROPOSAL_COVARIANCE_ALWAYS
+        for(int j = 0; j<16; j++){
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                F[j][i] = (j % 5 == 0) ? 1 : 0; // identity
+            }
+        }
+        for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+            F[3][i] = Ts * (-s_psi[i]*ux - c_psi[i]*uy);
+            F[7][i] = Ts * (c_psi[i]*ux - s_psi[i]*uy);
+        }
+        for(int j = 0; j<10; j++){
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                P[j][i] = cov[j][i];
+            }
+        }
+        congruenceLanes(F, P, cov, false);
+        accumulate = true;
+#endif
+
+        for(int j = 0; j<10; j++){
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                P[j][i] = Q[j];
+            }
+        }
+#if USE_MOTION_MODEL_JACOBIAN
+        for(int j = 0; j<16; j++){
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                F[j][i] = 0;
+            }
+        }
+        for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+            F[0][i] = Ts * c_psi[i];
+            F[1][i] = -Ts * s_psi[i];
+            F[4][i] = Ts * s_psi[i];
+            F[5][i] = Ts * c_psi[i];
+            F[10][i] = Ts;
+            F[15][i] = 1;
+        }
+#else
+        for(int j = 0; j<16; j++){
+            for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+                F[j][i] = (j % 5 == 0) ? 1 : 0; // identity
+            }
+        }
+#endif
+        congruenceLanes(F, P, cov, accumulate);
+    }
+}
+
+void ParticleStateBatch::cholesky(){
+    // Unrolled 4x4 Cholesky factorization of every particle. Pivots are clamped at zero, so a semi-definite covariance gives
+    // zero noise in the degenerate directions instead of NaNs
+    for(int b = 0; b<(int)blocks.size(); b++){
+        const ParticleLanes* __restrict P = blocks[b].cov;
+        ParticleLanes* __restrict L = blocks[b].chol;
+
+        for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+            float l00 = sqrt(max(P[0][i], 0.0f));
+            float inv0 = (l00 > 0) ? 1/l00 : 0;
+            float l10 = P[1][i]*inv0;
+            float l20 = P[2][i]*inv0;
+            float l30 = P[3][i]*inv0;
+
+            float l11 = sqrt(max(P[4][i] - l10*l10, 0.0f));
+            float inv1 = (l11 > 0) ? 1/l11 : 0;
+            float l21 = (P[5][i] - l20*l10)*inv1;
+            float l31 = (P[6][i] - l30*l10)*inv1;
+
+            float l22 = sqrt(max(P[7][i] - l20*l20 - l21*l21, 0.0f));
+            float inv2 = (l22 > 0) ? 1/l22 : 0;
+            float l32 = (P[8][i] - l30*l20 - l31*l21)*inv2;
+
+            float l33 = sqrt(max(P[9][i] - l30*l30 - l31*l31 - l32*l32, 0.0f));
+
+            L[0][i] = l00; L[1][i] = l10; L[2][i] = l20; L[3][i] = l30;
+            L[4][i] = l11; L[5][i] = l21; L[6][i] = l31;
+            L[7][i] = l22; L[8][i] = l32;
+            L[9][i] = l33;
+        }
+    }
+}
+
+void ParticleStateBatch::sample(){
+    for(int b = 0; b<(int)blocks.size(); b++){
+        const ParticleLanes* __restrict L = blocks[b].chol;
+        const ParticleLanes* __restrict n = blocks[b].noise;
+        const ParticleLanes* __restrict m = blocks[b].mean;
+        ParticleLanes* __restrict s = blocks[b].s;
+
+        for(int i = 0; i<PARTICLE_BATCH_LANES; i++){
+            s[0][i] = m[0][i] + L[0][i]*n[0][i];
+            s[1][i] = m[1][i] + L[1][i]*n[0][i] + L[4][i]*n[1][i];
+            s[2][i] = m[2][i] + L[2][i]*n[0][i] + L[5][i]*n[1][i] + L[7][i]*n[2][i];
+            s[3][i] = m[3][i] + L[3][i]*n[0][i] + L[6][i]*n[1][i] + L[8][i]*n[2][i] + L[9][i]*n[3][i];
+        }
+    }
+}
+
+VectorChiFastSLAMf ParticleStateBatch::getMean(int i){
+    const ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    VectorChiFastSLAMf m;
+    m << block.mean[0][lane], block.mean[1][lane], block.mean[2][lane], block.mean[3][lane];
+    return m;
+}
+
+void ParticleStateBatch::setMean(int i, const VectorChiFastSLAMf &m){
+    ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    for(int j = 0; j<4; j++){
+        block.mean[j][lane] = m(j);
+    }
+}
+
+VectorChiFastSLAMf ParticleStateBatch::getPose(int i){
+    const ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    VectorChiFastSLAMf pose;
+    pose << block.s[0][lane], block.s[1][lane], block.s[2][lane], block.s[3][lane];
+    return pose;
+}
+
+void ParticleStateBatch::setPose(int i, const VectorChiFastSLAMf &pose){
+    ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    for(int j = 0; j<4; j++){
+        block.s[j][lane] = pose(j);
+    }
+}
+
+void ParticleStateBatch::setNoise(int i, const float X[4]){
+    ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    for(int j = 0; j<4; j++){
+        block.noise[j][lane] = X[j];
+    }
+}
+
+MatrixChiFastSLAMf ParticleStateBatch::getCov(int i){
+    const ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    MatrixChiFastSLAMf P;
+    for(int r = 0; r<4; r++){
+        for(int c = 0; c<4; c++){
+            P(r,c) = block.cov[symIndex(r,c)][lane];
+        }
+    }
+    return P;
+}
+
+void ParticleStateBatch::setCov(int i, const MatrixChiFastSLAMf &P){
+    ParticleStateBlock &block = blocks[(i-1) / PARTICLE_BATCH_LANES];
+    int lane = (i-1) % PARTICLE_BATCH_LANES;
+    for(int r = 0; r<4; r++){
+        for(int c = r; c<4; c++){
+            block.cov[symIndex(r,c)][lane] = P(r,c);
+        }
+    }
+}
+
+
+
+/* ############################## Defines LandmarkUpdateBatch class ##############################  */
+LandmarkUpdateBatch::LandmarkUpdateBatch(int nParticles_){
+    nParticles = nParticles_;
+    LandmarkUpdateBlock empty = {}; // unused lanes of the last block are updated with zeros, which gives zeros
+    blocks.assign((nParticles + LANDMARK_BATCH_LANES - 1) / LANDMARK_BATCH_LANES, empty);
+}
+
+void LandmarkUpdateBatch::setLandmark(int i, const Eigen::Vector3f &lhat, const Eigen::Matrix3f &lCov, const Measurement::MatrixHl &H, const Measurement::VectorZ &v){
+    LandmarkUpdateBlock &block = blocks[(i-1) / LANDMARK_BATCH_LANES];
+    int lane = (i-1) % LANDMARK_BATCH_LANES;
+    for(int r = 0; r<3; r++){
+        block.lhat[r][lane] = lhat(r);
+        block.v[r][lane] = v(r);
+        for(int c = 0; c<3; c++){
+            block.H[r*3+c][lane] = H(r,c);
+        }
+    }
+    block.lCov[0][lane] = lCov(0,0);
+    block.lCov[1][lane] = lCov(0,1);
+    block.lCov[2][lane] = lCov(0,2);
+    block.lCov[3][lane] = lCov(1,1);
+    block.lCov[4][lane] = lCov(1,2);
+    block.lCov[5][lane] = lCov(2,2);
+}
+
+void LandmarkUpdateBatch::update(const Measurement::MatrixZ &R){
+    // Cholesky form of (3.35)-(3.38), as KF_cholesky_update: S = H*P*H' + R = L*L', W1 = P*H'*inv(L'),
+    // lhat += W1*inv(L)*v and P -= W1*W1'. Pivots are clamped at zero like in ParticleStateBatch::cholesky
+    const float R00 = R(0,0), R01 = R(0,1), R02 = R(0,2), R11 = R(1,1), R12 = R(1,2), R22 = R(2,2);
+
+    for(int b = 0; b<(int)blocks.size(); b++){
+        float (*x)[LANDMARK_BATCH_LANES] = blocks[b].lhat;
+        float (*P)[LANDMARK_BATCH_LANES] = blocks[b].lCov;
+        const float (*H)[LANDMARK_BATCH_LANES] = blocks[b].H;
+        const float (*v)[LANDMARK_BATCH_LANES] = blocks[b].v;
+
+        for(int i = 0; i<LANDMARK_BATCH_LANES; i++){
+            // A = H*P, row r of A is row r of H times P
+            float a00 = H[0][i]*P[0][i] + H[1][i]*P[1][i] + H[2][i]*P[2][i];
+            float a01 = H[0][i]*P[1][i] + H[1][i]*P[3][i] + H[2][i]*P[4][i];
+            float a02 = H[0][i]*P[2][i] + H[1][i]*P[4][i] + H[2][i]*P[5][i];
+            float a10 = H[3][i]*P[0][i] + H[4][i]*P[1][i] + H[5][i]*P[2][i];
+            float a11 = H[3][i]*P[1][i] + H[4][i]*P[3][i] + H[5][i]*P[4][i];
+            float a12 = H[3][i]*P[2][i] + H[4][i]*P[4][i] + H[5][i]*P[5][i];
+            float a20 = H[6][i]*P[0][i] + H[7][i]*P[1][i] + H[8][i]*P[2][i];
+            float a21 = H[6][i]*P[1][i] + H[7][i]*P[3][i] + H[8][i]*P[4][i];
+            float a22 = H[6][i]*P[2][i] + H[7][i]*P[4][i] + H[8][i]*P[5][i];
+
+            // S = A*H' + R
+            float s00 = a00*H[0][i] + a01*H[1][i] + a02*H[2][i] + R00;
+            float s01 = a00*H[3][i] + a01*H[4][i] + a02*H[5][i] + R01;
+            float s02 = a00*H[6][i] + a01*H[7][i] + a02*H[8][i] + R02;
+            float s11 = a10*H[3][i] + a11*H[4][i] + a12*H[5][i] + R11;
+            float s12 = a10*H[6][i] + a11*H[7][i] + a12*H[8][i] + R12;
+            float s22 = a20*H[6][i] + a21*H[7][i] + a22*H[8][i] + R22;
+
+            float l00 = sqrt(max(s00, 0.0f));
+            float inv0 = (l00 > 0) ? 1/l00 : 0;
+            float l10 = s01*inv0;
+            float l20 = s02*inv0;
+            float l11 = sqrt(max(s11 - l10*l10, 0.0f));
+            float inv1 = (l11 > 0) ? 1/l11 : 0;
+            float l21 = (s12 - l20*l10)*inv1;
+            float l22 = sqrt(max(s22 - l20*l20 - l21*l21, 0.0f));
+            float inv2 = (l22 > 0) ? 1/l22 : 0;
+
+            // rows of W1 solve L*w = (row of P*H') = (column of A), by forward substitution
+            float w00 = a00*inv0;
+            float w01 = (a10 - l10*w00)*inv1;
+            float w02 = (a20 - l20*w00 - l21*w01)*inv2;
+            float w10 = a01*inv0;
+            float w11 = (a11 - l10*w10)*inv1;
+            float w12 = (a21 - l20*w10 - l21*w11)*inv2;
+            float w20 = a02*inv0;
+            float w21 = (a12 - l10*w20)*inv1;
+            float w22 = (a22 - l20*w20 - l21*w21)*inv2;
+
+            // e = inv(L)*v
+            float e0 = v[0][i]*inv0;
+            float e1 = (v[1][i] - l10*e0)*inv1;
+            float e2 = (v[2][i] - l20*e0 - l21*e1)*inv2;
+
+            x[0][i] += w00*e0 + w01*e1 + w02*e2;
+            x[1][i] += w10*e0 + w11*e1 + w12*e2;
+            x[2][i] += w20*e0 + w21*e1 + w22*e2;
+
+            P[0][i] -= w00*w00 + w01*w01 + w02*w02;
+            P[1][i] -= w00*w10 + w01*w11 + w02*w12;
+            P[2][i] -= w00*w20 + w01*w21 + w02*w22;
+            P[3][i] -= w10*w10 + w11*w11 + w12*w12;
+            P[4][i] -= w10*w20 + w11*w21 + w12*w22;
+            P[5][i] -= w20*w20 + w21*w21 + w22*w22;
+        }
+    }
+}
+
+Eigen::Vector3f LandmarkUpdateBatch::getMean(int i) const{
+    const LandmarkUpdateBlock &block = blocks[(i-1) / LANDMARK_BATCH_LANES];
+    int lane = (i-1) % LANDMARK_BATCH_LANES;
+    return Eigen::Vector3f(block.lhat[0][lane], block.lhat[1][lane], block.lhat[2][lane]);
+}
+
+Eigen::Matrix3f LandmarkUpdateBatch::getCov(int i) const{
+    const LandmarkUpdateBlock &block = blocks[(i-1) / LANDMARK_BATCH_LANES];
+    int lane = (i-1) % LANDMARK_BATCH_LANES;
+    Eigen::Matrix3f P;
+    P << block.lCov[0][lane], block.lCov[1][lane], block.lCov[2][lane],
+         block.lCov[1][lane], block.lCov[3][lane], block.lCov[4][lane],
+         block.lCov[2][lane], block.lCov[4][lane], block.lCov[5][lane];
+    return P;
+}
+
+
+
 /* ############################## Defines ParticleSet class ##############################  */
-ParticleSet::ParticleSet(int Nparticles,unsigned int GOT_ID,VectorChiFastSLAMf s0,MatrixChiFastSLAMf s_0_Cov){
+ParticleSet::ParticleSet(int Nparticles,unsigned int GOT_ID,VectorChiFastSLAMf s0,MatrixChiFastSLAMf s_0_Cov) : batch(Nparticles), landmarkBatch(Nparticles) {
     k=0;
     sMean = new Path(s0,k); // makes new path to keep track of the estimated mean of the Particle filter!
 
     nParticles = Nparticles;
-    Parray.reserve(nParticles);
+    Parray.resize(nParticles+1, NULL); // particles are indexed from 1 to nParticles
+    updatePool = NULL;
+    mapPool = new ParticleMapMemory;
+    rngStreams.resize(nParticles+1);
+    setRandomSeed(0);
+    resamplingStrategy = RESAMPLING_WHEEL;
+    resamplingNeffThreshold = 1; // resample every step
+    Neff = nParticles;
 
     for(int i = 1; i<=nParticles; i++){
-        Parray[i] = new Particle(GOT_ID,s0,s_0_Cov,k);
+        Parray[i] = new Particle(GOT_ID,s0,s_0_Cov,k,mapPool);
     }
-    StartTime = ros::Time::now().toSec();
+    StartTime = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
 
-    KnownMarkers.push_back(GOT_ID); // add the GOT marker to the known list of landmark IDs
+    KnownMarkers.insert(GOT_ID); // add the GOT marker to the known list of landmark IDs
 }
 
 ParticleSet::~ParticleSet(){
-    double endTime = ros::Time::now().toSec();
+    double endTime = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
     double meanTime = (endTime - StartTime)/k;
     cout << "meanTime per particle update: " << meanTime << endl;
 
+    delete updatePool; // joins the worker threads before the particles are deleted
+
+    printMapPoolUsage();
+
     for(int i = 1; i<=nParticles; i++){
         delete Parray[i];
     }
+    delete mapPool; // after the particles, as their maps live in the pool
     delete sMean;
 }
 
@@ -1626,41 +2370,72 @@ int ParticleSet::getNParticles(){
     return nParticles;
 }
 
-void ParticleSet::updateParticleSet(MeasurementSet* z, VectorUFastSLAMf u, float Ts){
-    Node_MeasurementSet* tmp_pointer = NULL;
-    MeasurementSet z_New;
-    MeasurementSet z_Ex;
-    unsigned int markerID;
+void ParticleSet::printMapPoolUsage(){
+    cout << "map node pool - in use: " << mapPool->nodes.getNumberInUse() << ", high-water mark: " << mapPool->nodes.getHighWaterMark() << ", capacity: " << mapPool->nodes.getCapacity() << endl;
+    cout << "landmark pool - in use: " << mapPool->landmarks.getNumberInUse() << ", high-water mark: " << mapPool->landmarks.getHighWaterMark() << ", capacity: " << mapPool->landmarks.getCapacity() << endl;
+}
 
-    k++;
+void ParticleSet::enableParallelUpdate(int nThreads){
+    delete updatePool;
+    updatePool = NULL;
 
-    if (z != NULL) {
-       tmp_pointer = z->firstMeasNode;
-    }
-    if (tmp_pointer != NULL) { // if we have a non-emtpy measurement set update the particles, otherwise just do resampling
-        // Traverse all measurements in measurement set
-        do {
-            markerID = tmp_pointer->meas->c;
-            //cout << "Known landmarks: ";
-            //for (std::vector<unsigned int>::const_iterator i = KnownMarkers.begin(); i != KnownMarkers.end(); ++i)
-                //cout << *i << ' ';
-
-            //cout << endl;
-            if (find(KnownMarkers.begin(), KnownMarkers.end(), markerID) == KnownMarkers.end()) {
-                //cout << "New landmark: " << markerID << endl;
-                KnownMarkers.push_back(markerID);
-                z_New.addMeasurement(tmp_pointer->meas);
-            } else {
-                z_Ex.addMeasurement(tmp_pointer->meas);
-            }
+    if (nThreads == 0){
+        nThreads = std::thread::hardware_concurrency();
+    }
+    if (nThreads > nParticles){
+        nThreads = nParticles;
+    }
 
-            tmp_pointer = tmp_pointer->nextNode;
-        } while (tmp_pointer != NULL);
+    if (nThreads > 1){
+        updatePool = new ParticleUpdatePool(nThreads, nParticles);
     }
+    cout << "Particle update threads: " << ((updatePool != NULL) ? updatePool->getNThreads() : 1) << endl;
+}
 
-    for(int i = 1; i<=nParticles;i++){
-        //cout << endl << "updating particle: " << i << endl;
-        ((Particle*)Parray[i])->updateParticle(&z_Ex,&z_New,&u,k,Ts);
+static bool containsID(MeasurementSet &z, unsigned int c){
+    for (int i = 1; i <= z.nMeas; i++) {
+        if (z.getMeasurement(i)->c == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ParticleSet::partitionMeasurements(MeasurementSet* z){
+    measExisting.clear();
+    measNew.clear();
+    if (z == NULL) {
+        return;
+    }
+    for (int i = 1; i <= z->nMeas; i++) {
+        Measurement* z_tmp = z->getMeasurement(i);
+        if (KnownMarkers.insert(z_tmp->c)) {
+            measNew.addMeasurement(z_tmp);
+        } else if (!containsID(measNew, z_tmp->c)) {
+            measExisting.addMeasurement(z_tmp);
+        }
+        // else a second copy of a landmark first seen in this update - it is not in the maps yet, so it is dropped
+    }
+}
+
+void ParticleSet::updateParticleSet(MeasurementSet* z, VectorUFastSLAMf u, float Ts){
+    k++;
+
+    partitionMeasurements(z); // with an empty measurement set the particles are only predicted and resampled
+    MeasurementSet &z_Ex = measExisting;
+    MeasurementSet &z_New = measNew;
+
+    bool batched = true;
+#if SLOW_INIT
+    batched = (k > 5); // the first iterations only add the new landmarks
+#endif
+    if (batched){
+        updateParticlesBatched(&z_Ex,&z_New,&u,Ts);
+    }
+    else{
+        forEachParticle([&](int i, RandomStream* rngStream){
+            Parray[i]->updateParticle(&z_Ex,&z_New,&u,k,Ts,rngStream);
+        });
     }
 
     estimateDistribution(Ts);
@@ -1681,75 +2456,239 @@ void ParticleSet::updateParticleSet(MeasurementSet* z, VectorUFastSLAMf u, float
 
 }
 
-void ParticleSet::resample(){
-    // Resampling wheel
-    //cout << "resampling..." << endl;
+void ParticleSet::setRandomSeed(unsigned int seed){
+    for(int i = 0; i<=nParticles; i++){
+        rngStreams[i].seed(seed, i);
+    }
+}
 
-    vector<Particle*> Parraytmp;
-    Parraytmp.reserve(nParticles);
+void ParticleSet::setResampling(ResamplingStrategy strategy, float NeffThreshold){
+    resamplingStrategy = strategy;
+    resamplingNeffThreshold = NeffThreshold;
+    cout << "Resampling strategy: " << resamplingStrategy << ", N_eff threshold: " << resamplingNeffThreshold << endl;
+}
 
-    // Find max w
-    Particle* tmpP;
+void ParticleSet::setPathHorizon(unsigned int horizon){
+    // copies made during resampling inherit the horizon
+    for(int i = 1; i<=nParticles; i++){
+        Parray[i]->s->setHorizon(horizon);
+    }
+    cout << "Particle path horizon: " << horizon << endl;
+}
+
+double ParticleSet::getEffectiveSampleSize(){
+    return Neff;
+}
+
+double ParticleSet::logSumExpWeights(){
+    // log(sum(exp(logw))) - shifting by the largest log weight keeps exp() from underflowing
+    double logwMax = -std::numeric_limits<double>::infinity();
+    for(int i = 1; i<=nParticles; i++){
+        if (Parray[i]->logw != Parray[i]->logw) {
+            cout << "Err NaN in Particle: " << i << endl;
+        }
+        logwMax = max(logwMax, Parray[i]->logw);
+    }
+    if (logwMax == -std::numeric_limits<double>::infinity()){
+        return logwMax;
+    }
+
+    double sum = 0;
+    for(int i = 1; i<=nParticles; i++){
+        sum = sum + exp(Parray[i]->logw - logwMax);
+    }
+    return logwMax + log(sum);
+}
+
+void ParticleSet::forEachParticle(const std::function<void(int, RandomStream*)> &job){
+    // particle slot i always draws from stream i, independent of which thread updates it
+    if (updatePool != NULL){
+        updatePool->forEachParticle([&](int i){ job(i, &rngStreams[i]); });
+    }
+    else{
+        for(int i = 1; i<=nParticles; i++){
+            job(i, &rngStreams[i]);
+        }
+    }
+}
+
+// Same result as Particle::updateParticle for every particle, but motion prediction, Cholesky factorization, sampling and
+// the landmark corrections run on the structure-of-arrays batches. Only the steps that need the map of a particle are done
+// particle by particle
+void ParticleSet::updateParticlesBatched(MeasurementSet* z_Ex, MeasurementSet* z_New, VectorUFastSLAMf* u, float Ts){
+    for(int i = 1; i<=nParticles; i++){
+        batch.setPose(i, *(Parray[i]->s->getPose()));
+        batch.setCov(i, Parray[i]->s_k_Cov);
+    }
+
+    batch.predict(u, Ts, Particle::sCov);
+
+    forEachParticle([&](int i, RandomStream* rngStream){
+        VectorChiFastSLAMf s_bar = batch.getMean(i);
+        VectorChiFastSLAMf sMean_proposale = s_bar;
+        MatrixChiFastSLAMf sCov_proposale = batch.getCov(i);
+        Parray[i]->conditionProposal(z_Ex, s_bar, sMean_proposale, sCov_proposale);
+        batch.setMean(i, sMean_proposale);
+        batch.setCov(i, sCov_proposale);
+
+        // noise is drawn from the stream of the particle slot, as in Particle::drawSampleRandomPose
+        float X[4];
+        rngStream->fillNormal(X, 4);
+        batch.setNoise(i, X);
+    });
+
+    batch.cholesky();
+    batch.sample();
+
+    // The measured landmarks are corrected one measurement after the other, as in Particle::handleExMeas, which leaves
+    // out the last existing measurement. Storing the corrections of one measurement and loading the landmarks of the next
+    // one share a pass over the particles
+    int nCorrections = z_Ex->nMeas - 1;
+    forEachParticle([&](int i, RandomStream* rngStream){
+        VectorChiFastSLAMf s_proposale = batch.getPose(i);
+        Parray[i]->s_k_Cov = batch.getCov(i);
+        Parray[i]->addPoseAndWeight(z_Ex, s_proposale, u, k, Ts);
+#if !ADD_LANDMARKS_AFTER_RESAMPLING
+        Parray[i]->handleNewMeas(z_New, s_proposale); // new landmarks never have an existing measurement in the same set
+#endif
+        if (nCorrections > 0){
+            Parray[i]->loadLandmarkCorrection(z_Ex->getMeasurement(1), s_proposale, landmarkBatch, i);
+        }
+    });
+
+    for(int j = 1; j<=nCorrections; j++){
+        Measurement* z_j = z_Ex->getMeasurement(j);
+        Measurement* z_next = (j < nCorrections) ? z_Ex->getMeasurement(j+1) : NULL;
+        landmarkBatch.update(z_j->getzCov());
+
+        forEachParticle([&](int i, RandomStream* rngStream){
+            Parray[i]->storeLandmarkCorrection(z_j, landmarkBatch, i);
+            if (z_next != NULL){
+                Parray[i]->loadLandmarkCorrection(z_next, batch.getPose(i), landmarkBatch, i);
+            }
+        });
+    }
+}
 
-    double wmax = 0;
+void ParticleSet::resample(){
+    // Find particle with max w and normalize the weights
+    Particle* tmpP = Parray[1];
     for(int i = 1; i<=nParticles;i++){
-        if(i==1){
-            wmax = Parray[i]->w;
+        if(Parray[i]->logw > tmpP->logw){
             tmpP = Parray[i];
         }
-        else if(Parray[i]->w > wmax){
-            wmax = Parray[i]->w;
-            tmpP = Parray[i];
+    }
+
+    double logwSum = logSumExpWeights();
+    if (!std::isfinite(logwSum)){ // also catches NaN
+        cout << "something went wrong, all particles have 0 weight" << endl;
+        for(int i = 1; i<=nParticles; i++){
+            Parray[i]->logw = 0;
         }
+        Neff = nParticles;
+        return;
+    }
+
+    string topDir = "Data";
+    boost::filesystem::create_directories(topDir);
+    //string filename = topDir + "/l_" + to_string(k) + ".m";
+    string filename = topDir + "/landmarks.m";
+    tmpP->map->saveDataShort(filename, k, KnownMarkers.getIDs());
+
+    vector<double> wNorm(nParticles+1, 0);
+    double wSum_squared = 0;
+    for(int i = 1; i<=nParticles; i++){
+        Parray[i]->logw = Parray[i]->logw - logwSum; // keep the weights bounded while they accumulate between resampling steps
+        wNorm[i] = exp(Parray[i]->logw);
+        wSum_squared = wSum_squared + wNorm[i]*wNorm[i];
     }
+    Neff = 1/wSum_squared;
 
-    //    cout << endl << "Current best pose estimate" << endl << *(tmpP->s->getPose()) << endl;
-    if (wmax != 0){
-        // generate random index between 1 and number of particles
-        default_random_engine generator;
-        uniform_int_distribution<int> distribution(1,nParticles);
-        uniform_real_distribution<double> distribution2(0,1);
+    if (resamplingNeffThreshold < 1 && Neff >= resamplingNeffThreshold*nParticles){
+        return; // particles are not degenerated yet - keep the weights
+    }
 
-        int index = distribution(generator); // random index
+    vector<unsigned int> counts(nParticles+1, 0);
+    calculateOffspringCounts(wNorm, counts);
 
-        double beta = 0;
+    // Surviving particles stay in their slot, only the slots of particles with no offspring are refilled with copies.
+    // A copy shares path and map with its parent through their reference counters, so nothing is deep copied.
+    vector<int> freeSlots;
+    for(int i = 1; i<=nParticles; i++){
+        if (counts[i] == 0){
+            freeSlots.push_back(i);
+        }
+    }
+    for(int i = 1; i<=nParticles; i++){
+        for(unsigned int c = 1; c < counts[i]; c++){
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            delete Parray[slot];
+            Parray[slot] = new Particle(*Parray[i]);
+        }
+    }
 
-        string topDir = "Data";
-        boost::filesystem::create_directories(topDir);
-    	//string filename = topDir + "/l_" + to_string(k) + ".m";
-	string filename = topDir + "/landmarks.m";
-	tmpP->map->saveDataShort(filename, k, KnownMarkers);
+    for(int i = 1; i<=nParticles; i++){
+        Parray[i]->logw = 0;
+    }
+}
 
-        for (int z = 1; z <= nParticles; z++){
-            // generate random addition to beta
-            double rand = distribution2(generator);
-            beta = beta + rand*2*wmax;
+void ParticleSet::calculateOffspringCounts(const vector<double> &wNorm, vector<unsigned int> &counts){
+    // counts[i] is set to the number of copies of particle i in the resampled set - the counts sum to nParticles
+    RandomStream &resamplingStream = rngStreams[0];
 
-            double weight = Parray[index]->w;
-            while (beta > weight){
-                beta = beta - weight;
+    if (resamplingStrategy == RESAMPLING_WHEEL){
+        double wmax = 0;
+        for(int i = 1; i<=nParticles; i++){
+            wmax = max(wmax, wNorm[i]);
+        }
+        int index = min(1 + (int)(resamplingStream.uniform()*nParticles), nParticles); // random index
+        double beta = 0;
 
+        for (int z = 1; z <= nParticles; z++){
+            beta = beta + resamplingStream.uniform()*2*wmax;
+            while (beta > wNorm[index]){
+                beta = beta - wNorm[index];
                 index = index + 1;
                 if (index > nParticles){
                     index = 1;
                 }
-                weight = Parray[index]->w;
             }
-            //cout << "index: " << index << endl;
-            Parraytmp[z] = new Particle(*Parray[index]);
-            //cout << "Parraytmp[" << z << "]:" << endl << *(Parraytmp[z]->s->getPose()) << endl;
+            counts[index]++;
         }
+        return;
+    }
+
+    vector<double> wComb = wNorm; // weights the comb is run over
+    int nDraws = nParticles;
 
+    if (resamplingStrategy == RESAMPLING_RESIDUAL){
+        double residualSum = 0;
         for(int i = 1; i<=nParticles; i++){
-            delete Parray[i];
+            counts[i] = (unsigned int)floor(nParticles*wNorm[i]);
+            nDraws = nDraws - counts[i];
+            wComb[i] = nParticles*wNorm[i] - counts[i];
+            residualSum = residualSum + wComb[i];
+        }
+        if (nDraws == 0){
+            return;
         }
         for(int i = 1; i<=nParticles; i++){
-            Parray[i] = Parraytmp[i];
+            wComb[i] = wComb[i]/residualSum;
         }
-        //cout << "Done resampling!" << endl;
     }
-    else{
-        cout << "something went wrong, all particles have 0 weight" << endl;
+
+    // comb with nDraws teeth over the cumulative weights
+    double u0 = resamplingStream.uniform();
+    double cumulative = wComb[1];
+    int i = 1;
+    for(int j = 0; j < nDraws; j++){
+        double u = (j + ((resamplingStrategy == RESAMPLING_STRATIFIED) ? resamplingStream.uniform() : u0))/nDraws;
+        while (u > cumulative && i < nParticles){
+            i++;
+            cumulative = cumulative + wComb[i];
+        }
+        counts[i]++;
     }
 }
 
@@ -1757,13 +2696,10 @@ void ParticleSet::resample(){
 
 void ParticleSet::resampleSimple(){
     // primitiv resampling
-    double wTotal=0;
-    for(int i = 1; i<=nParticles;i++){
-        wTotal = wTotal + Parray[i]->w;
-    }
+    double logwTotal = logSumExpWeights();
 
     for(int i = 1; i<=nParticles;i++){
-        Parray[i]->w = Parray[i]->w/wTotal;
+        Parray[i]->logw = Parray[i]->logw - logwTotal;
     }
 
     Particle* tmpPointer;
@@ -1772,11 +2708,11 @@ void ParticleSet::resampleSimple(){
     // primitiv resampling
     for(int i = 1; i<=nParticles;i++){
         if(i==1){
-            wtmp = Parray[i]->w;
+            wtmp = Parray[i]->logw;
             tmpPointer = Parray[i];
         }
-        else if(Parray[i]->w > wtmp){
-            wtmp = Parray[i]->w;
+        else if(Parray[i]->logw > wtmp){
+            wtmp = Parray[i]->logw;
             tmpPointer = Parray[i];
         }
     }
@@ -1800,16 +2736,10 @@ VectorChiFastSLAMf* ParticleSet::getLatestPoseEstimate(){
 }
 
 void ParticleSet::estimateDistribution(float Ts){
-    double wSum = 0;
+    double logwSum = logSumExpWeights();
+    bool uniformWeights = !std::isfinite(logwSum); // all particles have 0 weight - fall back to the unweighted mean
     double wNorm = 0;
 
-    for(int i = 1; i<=nParticles;i++){
-        if (Parray[i]->w != Parray[i]->w) {
-            cout << "Err NaN in Particle: " << i << endl;
-        }
-        wSum = wSum + Parray[i]->w;
-    }
-
     //cout << "wSum - 1: " << wSum << endl;
 
     VectorChiFastSLAMf sTmp = VectorChiFastSLAMf::Zero();
@@ -1821,7 +2751,7 @@ void ParticleSet::estimateDistribution(float Ts){
 
         sTmp = *(Parray[i]->s->getPose());
 
-        wNorm = (Parray[i]->w)/wSum;
+        wNorm = uniformWeights ? 1.0/nParticles : exp(Parray[i]->logw - logwSum);
 
         sMean_estimate = sMean_estimate + wNorm*sTmp; // weighted mean!
 
@@ -1836,7 +2766,7 @@ void ParticleSet::estimateDistribution(float Ts){
 
         sTmp = *(Parray[i]->s->getPose());
 
-        wNorm = (Parray[i]->w)/wSum;
+        wNorm = uniformWeights ? 1.0/nParticles : exp(Parray[i]->logw - logwSum);
 
         sDiff = sTmp-sMean_estimate;
 
@@ -1866,104 +2796,131 @@ void ParticleSet::saveData(){
     string topDir = "Data";
     boost::filesystem::create_directories(topDir);
 
-    string filename = topDir + "/t_" + to_string(k) + ".m";
-
-    Path::dataFileStream.open(filename, ios::out);
-    Path::dataFileStream << "t" << to_string(k) << " = struct('Particles',[],'meanPath',[]);" << endl;
-    Path::dataFileStream.flush();
-    Path::dataFileStream.close();
-
-    sMean->saveData(filename);
+    string filename = topDir + "/t_" + to_string(k) + ".fslam";
 
-    Path::dataFileStream.open(filename,ios::in | ios::ate);
-    Path::dataFileStream << "t" << to_string(k) << ".meanPath = Path;" << endl;
-    Path::dataFileStream << "clear Path" << endl;
-    Path::dataFileStream.flush();
-    Path::dataFileStream.close();
-    int j = 1;
-    int interval = 1;
-    for(int i = 1; i<=nParticles; i = i + interval){
-        Parray[i]->saveData(filename,KnownMarkers);
+    std::vector<char> buffer(1 << 20); // large writes instead of a flush per particle
+    ofstream out;
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, ios::out | ios::binary | ios::trunc);
+    if (!out){
+        cout << "Error: cannot write " << filename << endl;
+        return;
+    }
 
-        if (i == 1){
-            Path::dataFileStream.open(filename,ios::out | ios::app);
-            Path::dataFileStream << "t" << to_string(k) << ".Particles = particle;" << endl;
-            Path::dataFileStream << "clear particle Path map" << endl;
-            Path::dataFileStream.flush();
-            Path::dataFileStream.close();
-        }
-        else {
-            Path::dataFileStream.open(filename,ios::out | ios::app);
-            Path::dataFileStream << "t" << to_string(k) << ".Particles(" << to_string(j) << ") = particle;" << endl;
-            Path::dataFileStream << "clear particle Path map" << endl;
-            Path::dataFileStream.flush();
-            Path::dataFileStream.close();
+    const std::vector<unsigned int> &IDs = KnownMarkers.getIDs();
+    snapshotWriteHeader(out, k, nParticles, IDs);
+    sMean->saveSnapshot(out);
+    for(int i = 1; i<=nParticles; i++){
+        Parray[i]->saveSnapshot(out, IDs);
+    }
+    out.close();
+    cout << "Saved " << nParticles << " particles to " << filename << endl;
+}
+
+void Particle::saveSnapshot(ostream &out, const std::vector<unsigned int> &LandmarksToSave){
+    snapshotWrite(out, logw);
+    s->saveSnapshot(out);
+    map->saveSnapshot(out, LandmarksToSave);
+}
+
+void Path::saveSnapshot(ostream &out){
+    // newest to oldest, the latest pose is not saved
+    uint32_t nPoses = 0;
+    PathChunk* chunk = head;
+    unsigned int n = headCount;
+    while (chunk != NULL){
+        nPoses += n;
+        chunk = chunk->previous;
+        n = PATH_CHUNK_SIZE;
+    }
+    nPoses = (nPoses > 0) ? nPoses - 1 : 0;
+    snapshotWrite(out, (uint32_t)PathLength);
+    snapshotWrite(out, nPoses);
+
+    unsigned int j = 0;
+    chunk = head;
+    n = headCount;
+    while (chunk != NULL){
+        for(int i = n-1; i >= 0; i--){
+            if (j > 0){
+                float pose[SNAPSHOT_POSE_SIZE] = {chunk->S[i](0), chunk->S[i](1), chunk->S[i](2), chunk->S[i](3), chunk->Ts[i]};
+                out.write(reinterpret_cast<const char*>(pose), sizeof(pose));
+            }
+            j++;
         }
-        j++;
+        chunk = chunk->previous;
+        n = PATH_CHUNK_SIZE;
     }
 }
 
-void Particle::saveData(string filename,std::vector<unsigned int> LandmarksToSave){
-    s->saveData(filename);
-    map->saveData(filename, LandmarksToSave);
-    Path::dataFileStream.open(filename,ios::out | ios::app);
-    Path::dataFileStream << "particle = struct('Path',Path,'map',map);" << endl;
-    Path::dataFileStream.flush();
-    Path::dataFileStream.close();
+// landmark records of Snapshot.h, the IDs not in the map are skipped
+static void saveLandmarkSnapshots(ostream &out, unsigned int nLandmarks, const std::vector<landmark*> &landmarks){
+    snapshotWrite(out, (uint32_t)nLandmarks);
+    snapshotWrite(out, (uint32_t)landmarks.size());
+    for(unsigned int i = 0; i < landmarks.size(); i++){
+        snapshotWrite(out, (uint32_t)landmarks[i]->c);
+        out.write(reinterpret_cast<const char*>(landmarks[i]->lhat.data()), 3*sizeof(float));
+        out.write(reinterpret_cast<const char*>(landmarks[i]->lCov.data()), 9*sizeof(float)); // column major
+    }
 }
 
-void Path::saveData(string filename){
-    Path::dataFileStream.open(filename,ios::out | ios::app);
-    Path::dataFileStream << "Path = struct('PathLength',[],'Path',[],'Ts',[]);" << endl;
-    Path::dataFileStream << "Path.PathLength = " << PathLength << ";" << endl;
-
-    unsigned int j = 1;
-    if (PathRoot!=NULL){
-        Node_Path* tmp_pointer = PathRoot->nextNode;
-        while (tmp_pointer->nextNode != NULL){
-            tmp_pointer = tmp_pointer->nextNode;
-
-            Path::dataFileStream << "Path.Path(:," << j << ") = " << tmp_pointer->S.format(Path::OctaveFmt) << ";" << endl;
-            Path::dataFileStream << "Path.Ts(:," << j << ") = " << tmp_pointer->Ts << ";" << endl;
-            j++;
+void MapTree::saveSnapshot(ostream &out, const std::vector<unsigned int> &LandmarksToSave){
+    std::vector<landmark*> landmarks;
+    landmarks.reserve(LandmarksToSave.size());
+    for(unsigned int i = 0;i<LandmarksToSave.size();i++){
+        landmark* li = extractLandmarkNodePointer(LandmarksToSave[i]);
+        if (li != NULL){
+            landmarks.push_back(li);
         }
     }
-    Path::dataFileStream.flush();
-    Path::dataFileStream.close();
+    saveLandmarkSnapshots(out, N_Landmarks, landmarks);
 }
 
-void MapTree::saveData(string filename,std::vector<unsigned int> LandmarksToSave){
+void MapTree::saveDataShort(string filename, int k, std::vector<unsigned int> LandmarksToSave){
     Path::dataFileStream.open(filename,ios::out | ios::app);
-    Path::dataFileStream << "map = struct('nLandmarks',[],'mean',[],'cov',[],'identifier',[]);" << endl;
-    Path::dataFileStream << "map.nLandmarks = " << N_Landmarks << ";" << endl;
+    Path::dataFileStream << "map(" << k << ") = struct('nLandmarks',[],'mean',[],'identifier',[]);" << endl;
+    Path::dataFileStream << "map(" << k << ").nLandmarks = " << N_Landmarks << ";" << endl;
 
-    cout << "Size of LandmarksToSave:" << LandmarksToSave.size() << endl;
+    cout << "Size of LandmarksToSave: " << LandmarksToSave.size() << endl;
     for(unsigned int i = 0;i<LandmarksToSave.size();i++){
         unsigned int j = LandmarksToSave[i];
         if (extractLandmarkNodePointer(j) != NULL){
-             Path::dataFileStream << "map.mean(:," << i+1 << ") = " << extractLandmarkNodePointer(j)->lhat.format(Path::OctaveFmt) << ";" << endl;
-             Path::dataFileStream << "map.cov(:,:," << i+1 << ") = " << extractLandmarkNodePointer(j)->lCov.format(Path::OctaveFmt) << ";" << endl;
-             Path::dataFileStream << "map.identifier(" << i+1 << ") = " << extractLandmarkNodePointer(j)->c << ";" << endl;
+             Path::dataFileStream << "map(" << k << ").mean(:," << i+1 << ") = " << extractLandmarkNodePointer(j)->lhat.format(Path::OctaveFmt) << ";" << endl;             
+             Path::dataFileStream << "map(" << k << ").identifier(" << i+1 << ") = " << extractLandmarkNodePointer(j)->c << ";" << endl;
         }
         else{
             cout<<"Error: NULL pointer!";
         }
     }
+
     Path::dataFileStream.flush();
     Path::dataFileStream.close();
 }
 
-void MapTree::saveDataShort(string filename, int k, std::vector<unsigned int> LandmarksToSave){
+
+
+void IndexedMapTree::saveSnapshot(ostream &out, const std::vector<unsigned int> &LandmarksToSave){
+    std::vector<landmark*> landmarks;
+    landmarks.reserve(LandmarksToSave.size());
+    for(unsigned int i = 0;i<LandmarksToSave.size();i++){
+        landmark* li = extractLandmarkNodePointer(LandmarksToSave[i]);
+        if (li != NULL){
+            landmarks.push_back(li);
+        }
+    }
+    saveLandmarkSnapshots(out, N_Landmarks, landmarks);
+}
+
+void IndexedMapTree::saveDataShort(string filename, int k, std::vector<unsigned int> LandmarksToSave){
     Path::dataFileStream.open(filename,ios::out | ios::app);
     Path::dataFileStream << "map(" << k << ") = struct('nLandmarks',[],'mean',[],'identifier',[]);" << endl;
     Path::dataFileStream << "map(" << k << ").nLandmarks = " << N_Landmarks << ";" << endl;
 
-    cout << "Size of LandmarksToSave: " << LandmarksToSave.size() << endl;
     for(unsigned int i = 0;i<LandmarksToSave.size();i++){
-        unsigned int j = LandmarksToSave[i];
-        if (extractLandmarkNodePointer(j) != NULL){
-             Path::dataFileStream << "map(" << k << ").mean(:," << i+1 << ") = " << extractLandmarkNodePointer(j)->lhat.format(Path::OctaveFmt) << ";" << endl;             
-             Path::dataFileStream << "map(" << k << ").identifier(" << i+1 << ") = " << extractLandmarkNodePointer(j)->c << ";" << endl;
+        landmark* li = extractLandmarkNodePointer(LandmarksToSave[i]);
+        if (li != NULL){
+             Path::dataFileStream << "map(" << k << ").mean(:," << i+1 << ") = " << li->lhat.format(Path::OctaveFmt) << ";" << endl;
+             Path::dataFileStream << "map(" << k << ").identifier(" << i+1 << ") = " << li->c << ";" << endl;
         }
         else{
             cout<<"Error: NULL pointer!";
@@ -1974,8 +2931,6 @@ void MapTree::saveDataShort(string filename, int k, std::vector<unsigned int> La
     Path::dataFileStream.close();
 }
 
-
-
 IIR::IIR(const float * coeff_a, int no_coeff_a, const float * coeff_b, int no_coeff_b)
 {
     int i;
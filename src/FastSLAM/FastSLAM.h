@@ -1,9 +1,4 @@
 #include <iostream>
-#include <ros/ros.h>
-#include <geometry_msgs/PoseStamped.h>
-#include <mavros_msgs/CommandBool.h>
-#include <mavros_msgs/SetMode.h>
-#include <mavros_msgs/State.h>
 
 // Boost is needed for Gaussian random number generation
 #include <boost/random/mersenne_twister.hpp>
@@ -20,6 +15,15 @@
 #include <string>
 #include <cstdlib>
 #include <random>
+#include <cstdint>
+#include <atomic>
+#include <new>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_set>
 #include <boost/filesystem.hpp>
 
 #define deg2rad(x)  (x*M_PI)/180.f
@@ -34,44 +38,82 @@ typedef Eigen::Matrix<float, 4, 1> VectorChiFastSLAMf; // state vector [x,y,z,ya
 typedef Eigen::Matrix<float, 4, 4> MatrixChiFastSLAMf; // used for covariance of state vector
 typedef Eigen::Matrix<float, 6, Eigen::Dynamic> Matrix6kf;
 
+// Landmark map backend used by the particles - (0) is the pointer based MapTree, 1 is the contiguous index based IndexedMapTree
+#define USE_INDEXED_LANDMARK_MAP 0  // (0)
 
-Eigen::MatrixXf randn(int m, int n);
+
+/* ############################## Defines RandomStream class ##############################  */
+// Counter-based random stream (Philox4x32-10). The key is (seed, streamId) and every block of 4 numbers is a pure function of
+// key and counter, so streams are independent, cheap to create and reproducible from the seed alone. Not thread-safe - use
+// one stream per thread or per particle.
+class RandomStream
+{
+public:
+    /* functions */
+    RandomStream(uint32_t seed = 0, uint32_t streamId = 0);
+    void seed(uint32_t seed, uint32_t streamId);
+    void fillUniform(float* out, int n);    // uniform variates in (0,1)
+    void fillNormal(float* out, int n);     // standard normal variates (Box-Muller)
+    float uniform();
+
+private:
+    /* variables */
+    uint32_t key[2];
+    uint32_t counter[4];
+    uint32_t block[4];          // latest generated block
+    int blockUsed;              // numbers of block already handed out
+    std::vector<float> scratch; // uniforms used by fillNormal
+
+    /* functions */
+    void nextBlock();
+};
+
+Eigen::MatrixXf randn(int m, int n); // draws from a process wide stream - not thread-safe
+Eigen::MatrixXf randn(int m, int n, RandomStream &stream);
+void seedDefaultRandomStream(uint32_t seed);
 
 /* ############################## Defines measurement class ##############################  */
-class Measurement
+/* Measurement interface templated on the measurement dimension, such that all Jacobians and covariances are fixed-size and live on the stack */
+template <int MeasDim>
+class MeasurementBase
 {
 public:
-    static Eigen::MatrixXf zCov; 	/* measurement covariance - can take different sizes! static such that only one copy is saved in memory - also why it is placed in the subclass*/
+    typedef Eigen::Matrix<float, MeasDim, 1> VectorZ;
+    typedef Eigen::Matrix<float, MeasDim, MeasDim> MatrixZ;	/* measurement covariance */
+    typedef Eigen::Matrix<float, MeasDim, 4> MatrixHs;		/* derivative with respect to the pose [x,y,z,yaw] */
+    typedef Eigen::Matrix<float, MeasDim, 3> MatrixHl;		/* derivative with respect to the landmark position */
+    static const int Dim = MeasDim;
 
     /* variables */
     unsigned int c; 	/* measurement identifier - 0 for pose measurement, 1 for GOT and 2...N for landmark identifier */
-    Eigen::VectorXf z;	/* actual measurement - can take different sizes! */
-    ros::Time timestamp;
+    VectorZ z;	/* actual measurement */
+    std::chrono::steady_clock::time_point timestamp;
 
     /* functions */
-   // Measurement();
-   // ~Measurement();
-    virtual Eigen::MatrixXf calculateHl(VectorChiFastSLAMf pose, Eigen::Vector3f l) = 0;		/* calculates derivative of measurement model with respect to landmark variable - l */
-    virtual Eigen::MatrixXf calculateHs(VectorChiFastSLAMf pose, Eigen::Vector3f l) = 0;		/* calculates derivative of measurement model with respect to pose variable - s */
-    virtual Eigen::VectorXf inverseMeasurementModel(VectorChiFastSLAMf pose) = 0;
-    virtual Eigen::VectorXf MeasurementModel(VectorChiFastSLAMf pose, Eigen::Vector3f l) = 0;
-    virtual Eigen::MatrixXf getzCov() = 0;
+    virtual ~MeasurementBase() {}
+    virtual MatrixHl calculateHl(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l) = 0;		/* calculates derivative of measurement model with respect to landmark variable - l */
+    virtual MatrixHs calculateHs(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l) = 0;		/* calculates derivative of measurement model with respect to pose variable - s */
+    virtual Eigen::Vector3f inverseMeasurementModel(const VectorChiFastSLAMf &pose) = 0;
+    virtual VectorZ MeasurementModel(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l) = 0;
+    virtual const MatrixZ& getzCov() = 0;	/* returns a reference to the static covariance of the subclass - no copy */
 private:
 };
 
+typedef MeasurementBase<3> Measurement; // both the GOT and the image measurements are 3-dimensional
+
 
 /* ############################## Defines GOTMeasurement class ##############################  */
 class GOTMeasurement : public Measurement
 {
     public:
-    static Eigen::MatrixXf zCov; 	/* measurement covariance - can take different sizes! static such that only one copy is saved in memory - also why it is placed in the subclass*/
+    static Eigen::Matrix3f zCov; 	/* measurement covariance - static such that only one copy is saved in memory - also why it is placed in the subclass*/
 
     GOTMeasurement(unsigned int i, Eigen::Vector3f GOT_meas);
-    Eigen::MatrixXf calculateHs(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::MatrixXf calculateHl(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::VectorXf inverseMeasurementModel(VectorChiFastSLAMf pose);
-    Eigen::VectorXf MeasurementModel(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::MatrixXf getzCov();
+    MatrixHs calculateHs(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    MatrixHl calculateHl(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    Eigen::Vector3f inverseMeasurementModel(const VectorChiFastSLAMf &pose);
+    VectorZ MeasurementModel(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    const MatrixZ& getzCov();
 
 private:
 };
@@ -81,7 +123,7 @@ private:
 class ImgMeasurement : public Measurement
 {
     public:
-    static Eigen::MatrixXf zCov; 	/* measurement covariance - can take different sizes! static such that only one copy is saved in memory - also why it is placed in the subclass*/
+    static Eigen::Matrix3f zCov; 	/* measurement covariance - static such that only one copy is saved in memory - also why it is placed in the subclass*/
     static Eigen::Vector3f CameraOffset; /* Camera offset of RGB frame relative to GOT/Mocap position origo */
     /* Camera coefficients */
     static float ax; // also known as fx
@@ -93,28 +135,25 @@ class ImgMeasurement : public Measurement
 
     //ImgMeasurement(unsigned int i, Eigen::Vector3f img_me);
     ImgMeasurement(unsigned int i, Eigen::Vector3f img_me,float roll_, float pitch_);
-    Eigen::VectorXf inverseMeasurementModel(VectorChiFastSLAMf pose);
-    Eigen::MatrixXf calculateHs(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::MatrixXf calculateHl(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::VectorXf MeasurementModel(VectorChiFastSLAMf pose, Eigen::Vector3f l);
-    Eigen::MatrixXf getzCov();
+    Eigen::Vector3f inverseMeasurementModel(const VectorChiFastSLAMf &pose);
+    MatrixHs calculateHs(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    MatrixHl calculateHl(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    VectorZ MeasurementModel(const VectorChiFastSLAMf &pose, const Eigen::Vector3f &l);
+    const MatrixZ& getzCov();
 
 private:
 };
 
 
 /* ############################## Defines measurement set class ##############################  */
-struct Node_MeasurementSet {
-    Measurement* meas;
-    Node_MeasurementSet *nextNode;
-    int measIdentifier;
-};
-
+/* The measurements of one step, stored contiguously and indexed from 1 to nMeas.
+   emptyMeasurementSet deletes the measurements, clear only forgets them - used by the sets that refer to the
+   measurements of another set, like the existing/new partition of ParticleSet. The storage is kept by both, so a set
+   reused every step does not allocate once it has seen the largest number of measurements. */
 class MeasurementSet
 {
 public:
     /* variables */
-    Node_MeasurementSet *firstMeasNode;
     int nMeas;
 
     /* functions */
@@ -122,23 +161,46 @@ public:
     MeasurementSet(Measurement *meas);
     ~MeasurementSet();
     void emptyMeasurementSet();
+    void clear();
     void addMeasurement(Measurement *meas);
     int countNumberOfMeasurements();
     int getNumberOfMeasurements();
-    Measurement* getMeasurement(int i);
+    Measurement* getMeasurement(int i) { return measurements[i-1]; } // i = 1..nMeas
+
+private:
+    std::vector<Measurement*> measurements;
+};
+
+
+/* Landmark IDs known to the particle set. The IDs are the marker IDs of the dictionary plus the GOT ID, so they are
+   looked up in a flat table indexed by the ID. Larger IDs, which would make the table grow without bound, go to a hash
+   set. The IDs are also kept in the order they were added, as the list of landmarks to save. */
+#define LANDMARK_REGISTRY_TABLE_SIZE 4096 // IDs below this are in the flat table - covers all predefined ArUco dictionaries
+
+class LandmarkRegistry
+{
+public:
+    /* functions */
+    bool contains(unsigned int ID) const;
+    bool insert(unsigned int ID); // returns false when the ID was known already
+    const std::vector<unsigned int>& getIDs() const { return IDs; }
 
 private:
-    void emptyMeasurementSet(Node_MeasurementSet *MeasNode);
+    /* variables */
+    std::vector<unsigned char> table; // grows up to the largest ID below LANDMARK_REGISTRY_TABLE_SIZE
+    std::unordered_set<unsigned int> largeIDs;
+    std::vector<unsigned int> IDs;
 };
 
 
 /* ############################## Defines Maps class ##############################  */
 struct landmark
 {
-  static unsigned int globalLandmarkCounter; // can be used to check if number of landmarks does not grow without bound
+  static std::atomic<unsigned int> globalLandmarkCounter; // can be used to check if number of landmarks does not grow without bound
   unsigned int c; 		/* landmark identifier */
   Eigen::Vector3f lhat;
   Eigen::Matrix3f lCov;
+  unsigned int arenaIndex;  /* slot of the landmark when allocated by an IndexedArena - not used by MapTree */
   landmark() //Constructor
   {
       globalLandmarkCounter++;
@@ -151,12 +213,12 @@ struct landmark
 
 struct mapNode
 {
-  static unsigned int globalMapNodeCounter; // can be used to check if number of MapNodes does not grow without bound
+  static std::atomic<unsigned int> globalMapNodeCounter; // can be used to check if number of MapNodes does not grow without bound
   unsigned int key_value;    /* landmark identifier */
   mapNode *left;               /* pointer for the left node */
   mapNode *right;              /* pointer for the right node */
   landmark *l;              /* pointer for a landmark; is used when *left == NULL or *right == NULL */
-  unsigned int referenced;  /* how many nodes/paticles points to this node? if zero the node should be deleted! */
+  std::atomic<unsigned int> referenced;  /* how many nodes/paticles points to this node? if zero the node should be deleted! - atomic since nodes are shared between particles updated in parallel */
 
   mapNode() //Constructor
   {
@@ -167,6 +229,213 @@ struct mapNode
   }
 };
 
+/* Slab allocator with free-list recycling, used for the mapNode and landmark objects which are created and destroyed in the hot path.
+   Every thread allocates from and releases to its own free list, which is refilled from and drained to the shared free list in
+   batches under the pool lock, so the particles updated in parallel do not serialize on the allocator. */
+#define OBJECT_POOL_THREAD_CACHES   64  // threads with their own free list - any further threads use the shared free list directly
+#define OBJECT_POOL_CACHE_BATCH     64  // objects moved between a thread free list and the shared free list at a time
+
+unsigned int objectPoolThreadIndex(); // small index of the calling thread, unique within the process
+
+template <typename T>
+class ObjectPool
+{
+public:
+    ObjectPool(unsigned int objectsPerSlab = 4096);
+    ~ObjectPool();
+    T* allocate();              // returns a default constructed object
+    void release(T* object);    // destructs the object and puts its memory back on the free list
+    unsigned int getNumberInUse();
+    unsigned int getHighWaterMark();  // objects held in the thread free lists count as in use here
+    unsigned int getCapacity();
+
+private:
+    union Slot {
+        Slot* nextFree;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    struct ThreadCache {
+        Slot* freeList;
+        unsigned int nFree;
+        std::atomic<int> nInUse;    // allocated minus released by the thread - negative when it releases objects of other threads
+        char padding[64 - sizeof(Slot*) - sizeof(unsigned int) - sizeof(std::atomic<int>)]; // one cache line per thread
+    };
+
+    std::vector<Slot*> slabs;
+    Slot* freeList;
+    unsigned int objectsPerSlab;
+    unsigned int nInUse;        // objects allocated directly from the shared free list
+    unsigned int nTaken;        // objects not on the shared free list
+    unsigned int highWaterMark;
+    std::mutex poolMutex; // protects the shared free list
+    ThreadCache caches[OBJECT_POOL_THREAD_CACHES];
+
+    void addSlab();
+    Slot* takeShared();
+    void refill(ThreadCache &cache);
+    void drain(ThreadCache &cache, unsigned int nKeep);
+};
+
+template <typename T>
+ObjectPool<T>::ObjectPool(unsigned int objectsPerSlab_)
+{
+    objectsPerSlab = objectsPerSlab_;
+    freeList = NULL;
+    nInUse = 0;
+    nTaken = 0;
+    highWaterMark = 0;
+    for(unsigned int i = 0; i < OBJECT_POOL_THREAD_CACHES; i++){
+        caches[i].freeList = NULL;
+        caches[i].nFree = 0;
+        caches[i].nInUse = 0;
+    }
+}
+
+template <typename T>
+ObjectPool<T>::~ObjectPool()
+{
+    for(unsigned int i = 0; i < slabs.size(); i++){
+        delete[] slabs[i];
+    }
+}
+
+template <typename T>
+void ObjectPool<T>::addSlab()
+{
+    Slot* slab = new Slot[objectsPerSlab];
+    for(unsigned int i = 0; i < objectsPerSlab; i++){
+        slab[i].nextFree = freeList;
+        freeList = &slab[i];
+    }
+    slabs.push_back(slab);
+}
+
+template <typename T>
+typename ObjectPool<T>::Slot* ObjectPool<T>::takeShared()
+{
+    // poolMutex must be held
+    if (freeList == NULL){
+        addSlab();
+    }
+    Slot* slot = freeList;
+    freeList = slot->nextFree;
+
+    nTaken++;
+    if (nTaken > highWaterMark){
+        highWaterMark = nTaken;
+    }
+    return slot;
+}
+
+template <typename T>
+void ObjectPool<T>::refill(ThreadCache &cache)
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    for(unsigned int i = 0; i < OBJECT_POOL_CACHE_BATCH; i++){
+        Slot* slot = takeShared();
+        slot->nextFree = cache.freeList;
+        cache.freeList = slot;
+    }
+    cache.nFree += OBJECT_POOL_CACHE_BATCH;
+}
+
+template <typename T>
+void ObjectPool<T>::drain(ThreadCache &cache, unsigned int nKeep)
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    while(cache.nFree > nKeep){
+        Slot* slot = cache.freeList;
+        cache.freeList = slot->nextFree;
+        cache.nFree--;
+
+        slot->nextFree = freeList;
+        freeList = slot;
+        nTaken--;
+    }
+}
+
+template <typename T>
+T* ObjectPool<T>::allocate()
+{
+    Slot* slot;
+    unsigned int thread = objectPoolThreadIndex();
+    if (thread < OBJECT_POOL_THREAD_CACHES){
+        ThreadCache &cache = caches[thread];
+        if (cache.nFree == 0){
+            refill(cache);
+        }
+        slot = cache.freeList;
+        cache.freeList = slot->nextFree;
+        cache.nFree--;
+        cache.nInUse.store(cache.nInUse.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    else{
+        std::lock_guard<std::mutex> lock(poolMutex);
+        slot = takeShared();
+        nInUse++;
+    }
+    return new (&slot->storage) T;
+}
+
+template <typename T>
+void ObjectPool<T>::release(T* object)
+{
+    object->~T();
+    Slot* slot = reinterpret_cast<Slot*>(object);
+
+    unsigned int thread = objectPoolThreadIndex();
+    if (thread < OBJECT_POOL_THREAD_CACHES){
+        ThreadCache &cache = caches[thread];
+        slot->nextFree = cache.freeList;
+        cache.freeList = slot;
+        cache.nFree++;
+        cache.nInUse.store(cache.nInUse.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        if (cache.nFree >= 2*OBJECT_POOL_CACHE_BATCH){
+            drain(cache, OBJECT_POOL_CACHE_BATCH);
+        }
+    }
+    else{
+        std::lock_guard<std::mutex> lock(poolMutex);
+        slot->nextFree = freeList;
+        freeList = slot;
+        nTaken--;
+        nInUse--;
+    }
+}
+
+template <typename T>
+unsigned int ObjectPool<T>::getNumberInUse()
+{
+    // exact when no other thread is allocating, e.g. between two particle set updates
+    std::lock_guard<std::mutex> lock(poolMutex);
+    int n = nInUse;
+    for(unsigned int i = 0; i < OBJECT_POOL_THREAD_CACHES; i++){
+        n += caches[i].nInUse.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+template <typename T>
+unsigned int ObjectPool<T>::getHighWaterMark()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    return highWaterMark;
+}
+
+template <typename T>
+unsigned int ObjectPool<T>::getCapacity()
+{
+    std::lock_guard<std::mutex> lock(poolMutex);
+    return slabs.size() * objectsPerSlab;
+}
+
+struct MapMemoryPool
+{
+    ObjectPool<mapNode> nodes;
+    ObjectPool<landmark> landmarks;
+};
+
 class MapTree
 {
     static int mapTreeIdentifierCounter;
@@ -177,11 +446,13 @@ class MapTree
         int N_layers;
         unsigned int N_nodes;
         mapNode* root;
+        MapMemoryPool* memoryPool; // shared by all maps of a particle set - if NULL the nodes and landmarks are allocated on the heap
 
         // functions
-        MapTree();
+        MapTree(MapMemoryPool* memoryPool_ = NULL);
         MapTree(const MapTree &MapToCopy); // copy constructer
         ~MapTree();
+        landmark* newLandmark();
         void insertLandmark(landmark* newLandmark);
         void creatNewLayers(int Needed_N_layers);
         int countNLayers();
@@ -189,21 +460,191 @@ class MapTree
         void correctLandmark(landmark* newLandmarkData);
         landmark* extractLandmarkNodePointer(unsigned int Landmark_identifier);
         void printAllLandmarkPositions();
-        void saveData(std::string filename,std::vector<unsigned int> LandmarksToSave);
+        void saveSnapshot(std::ostream &out, const std::vector<unsigned int> &LandmarksToSave);
         void saveDataShort(std::string filename, int k, std::vector<unsigned int> LandmarksToSave);
 
     private:
         mapNode* makeNewPath(landmark* newLandmarkData, mapNode* startNode);
+        mapNode* makeNodeExclusive(mapNode* node);
+        mapNode* newMapNode();
+        void deleteMapNode(mapNode* node);
+        void deleteLandmark(landmark* oldLandmark);
+};
+
+
+/* ############################## Defines IndexedMapTree class ##############################  */
+/* Chunked arena handing out 32-bit indices - chunks are never moved, so indices and pointers stay valid while the arena grows */
+template <typename T>
+class IndexedArena
+{
+public:
+    static const unsigned int CHUNK_BITS = 14;
+    static const unsigned int CHUNK_SIZE = 1 << CHUNK_BITS;
+    static const unsigned int MAX_CHUNKS = 1 << 14;
+
+    IndexedArena();
+    ~IndexedArena();
+    unsigned int allocate();                // returns the index of a default constructed object - index 0 is never used and acts as NULL, throws std::bad_alloc when all MAX_CHUNKS are used
+    void release(unsigned int index);
+    T* at(unsigned int index) { return reinterpret_cast<T*>(&chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE-1)]); }
+    unsigned int getNumberInUse();
+    unsigned int getHighWaterMark();
+    unsigned int getCapacity();
+
+private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    Slot** chunks;
+    unsigned int nChunks;
+    std::vector<unsigned int> freeIndices;
+    unsigned int nInUse;
+    unsigned int highWaterMark;
+    std::mutex arenaMutex; // particles may be updated from several threads
+};
+
+template <typename T>
+IndexedArena<T>::IndexedArena()
+{
+    chunks = new Slot*[MAX_CHUNKS];
+    nChunks = 0;
+    nInUse = 0;
+    highWaterMark = 0;
+}
+
+template <typename T>
+IndexedArena<T>::~IndexedArena()
+{
+    for(unsigned int i = 0; i < nChunks; i++){
+        delete[] chunks[i];
+    }
+    delete[] chunks;
+}
+
+template <typename T>
+unsigned int IndexedArena<T>::allocate()
+{
+    unsigned int index;
+    {
+        std::lock_guard<std::mutex> lock(arenaMutex);
+        if (freeIndices.empty()){
+            if (nChunks == MAX_CHUNKS){
+                std::cout << "IndexedArena is full!" << std::endl;
+                throw std::bad_alloc(); // index 0 would alias the NULL index
+            }
+            chunks[nChunks] = new Slot[CHUNK_SIZE];
+            for(unsigned int i = CHUNK_SIZE; i > 0; i--){
+                unsigned int newIndex = (nChunks << CHUNK_BITS) + (i-1);
+                if (newIndex != 0){
+                    freeIndices.push_back(newIndex);
+                }
+            }
+            nChunks++;
+        }
+        index = freeIndices.back();
+        freeIndices.pop_back();
+
+        nInUse++;
+        if (nInUse > highWaterMark){
+            highWaterMark = nInUse;
+        }
+    }
+    new (at(index)) T;
+    return index;
+}
+
+template <typename T>
+void IndexedArena<T>::release(unsigned int index)
+{
+    at(index)->~T();
+
+    std::lock_guard<std::mutex> lock(arenaMutex);
+    freeIndices.push_back(index);
+    nInUse--;
+}
+
+template <typename T>
+unsigned int IndexedArena<T>::getNumberInUse()
+{
+    std::lock_guard<std::mutex> lock(arenaMutex);
+    return nInUse;
+}
+
+template <typename T>
+unsigned int IndexedArena<T>::getHighWaterMark()
+{
+    std::lock_guard<std::mutex> lock(arenaMutex);
+    return highWaterMark;
+}
+
+template <typename T>
+unsigned int IndexedArena<T>::getCapacity()
+{
+    std::lock_guard<std::mutex> lock(arenaMutex);
+    return nChunks * CHUNK_SIZE;
+}
+
+struct IndexedMapNode
+{
+  unsigned int child[2];    /* index of the left/right node - in leaf nodes child[0] is the index of the landmark */
+  std::atomic<unsigned int> referenced;  /* how many nodes/particles points to this node? if zero the node should be released */
+};
+
+struct IndexedMapArena
+{
+    IndexedArena<IndexedMapNode> nodes;
+    IndexedArena<landmark> landmarks;
+};
+
+// Persistent landmark map with the same copy-on-write sharing as MapTree, but with 12 byte nodes in contiguous memory.
+// A landmark with identifier c is found by following the bits of c from the most significant of the N_layers bits.
+class IndexedMapTree
+{
+    public:
+        // variables
+        unsigned int N_Landmarks;
+        int N_layers;
+        unsigned int root;          // index of the root node - 0 for an empty map
+        IndexedMapArena* arena;     // shared by all maps of a particle set
+
+        // functions
+        IndexedMapTree(IndexedMapArena* arena_ = NULL);
+        IndexedMapTree(const IndexedMapTree &MapToCopy); // copy constructer
+        ~IndexedMapTree();
+        landmark* newLandmark();
+        void insertLandmark(landmark* newLandmark);
+        void correctLandmark(landmark* newLandmarkData);
+        landmark* extractLandmarkNodePointer(unsigned int Landmark_identifier);
+        void printAllLandmarkPositions();
+        void saveSnapshot(std::ostream &out, const std::vector<unsigned int> &LandmarksToSave);
+        void saveDataShort(std::string filename, int k, std::vector<unsigned int> LandmarksToSave);
+
+    private:
+        void creatNewLayers(int Needed_N_layers);
+        unsigned int makeNewPath(landmark* newLandmarkData, unsigned int startNode, int layer);
+        void removeReferenceToSubTree(unsigned int nodeToStartFrom, int layer);
+        unsigned int newNode(unsigned int left, unsigned int right);
 };
 
+#if USE_INDEXED_LANDMARK_MAP
+typedef IndexedMapTree ParticleMap;
+typedef IndexedMapArena ParticleMapMemory;
+#else
+typedef MapTree ParticleMap;
+typedef MapMemoryPool ParticleMapMemory;
+#endif
+
 
 /* ############################## Defines Path class ##############################  */
-struct Node_Path {
-    VectorChiFastSLAMf S;
-    unsigned int k;
-    Node_Path *nextNode;
-    float Ts;
-    unsigned int referenced;
+#define PATH_CHUNK_SIZE 64 // poses per contiguous path chunk
+
+// Block of consecutive poses. Chunks are chained from the newest to the oldest and shared between the paths of resampled particles.
+struct PathChunk {
+    VectorChiFastSLAMf S[PATH_CHUNK_SIZE];
+    unsigned int k[PATH_CHUNK_SIZE];
+    float Ts[PATH_CHUNK_SIZE];
+    std::atomic<unsigned int> nPoses;       // slots claimed so far - a path sharing the chunk may only append when it owns the last claimed slot
+    std::atomic<PathChunk*> previous;       // older chunk, NULL when the history is cut at the horizon
+    std::atomic<unsigned int> referenced;   // number of paths and newer chunks pointing to this chunk
 };
 
 class Path
@@ -212,33 +653,42 @@ public:
     static Eigen::IOFormat OctaveFmt;
     static std::ofstream dataFileStream;
     /* variables */
-    Node_Path *PathRoot;
     unsigned int PathLength;
 
     /* functions */
-    Path(VectorChiFastSLAMf S, unsigned int k);
-    Path(const Path &PathToCopy); // copy constructer
+    Path(VectorChiFastSLAMf S, unsigned int k, unsigned int horizon_ = 0);
+    Path(const Path &PathToCopy); // copy constructer - shares the history, no poses are copied
     ~Path();
     void deletePath();
     void addPose(VectorChiFastSLAMf S, unsigned int k, float Ts);
     unsigned int countLengthOfPath();
     VectorChiFastSLAMf* getPose();
     VectorChiFastSLAMf* getPose(unsigned int k);
-    void saveData(std::string filename);
+    void setHorizon(unsigned int horizon_); // number of poses that are guaranteed to be kept, 0 = unbounded
+    void saveSnapshot(std::ostream &out); // path record of Snapshot.h
 
 private:
-    void deletePath(Node_Path *PathNode);
+    /* variables */
+    PathChunk* head;        // chunk holding the latest pose
+    unsigned int headCount; // poses of head belonging to this path
+    unsigned int horizon;
+
+    /* functions */
+    void releaseChunk(PathChunk* chunk);
+    void cutHistory();
 };
 
 
 /* ############################## Defines particle class ##############################  */
+class LandmarkUpdateBatch;
+
 class Particle
 {
 public:
     /* variables */
     Path* s;
-    MapTree* map;
-    double w;
+    ParticleMap* map;
+    double logw; // log of the (non-normalized) importance weight - products of many likelihoods underflow in linear domain
     MatrixChiFastSLAMf s_k_Cov; // particle covariance
     static MatrixChiFastSLAMf sCov; // motion model covariance - does not change?
 
@@ -247,16 +697,24 @@ public:
 
 
     /* functions */
-    Particle(unsigned int GOT_ID, VectorChiFastSLAMf s0 = VectorChiFastSLAMf::Constant(0), MatrixChiFastSLAMf s_0_Cov = 0.01*MatrixChiFastSLAMf::Identity(), unsigned int k = 0); 		// Initialize a standard particle with "zero-pose" or custom pose
+    Particle(unsigned int GOT_ID, VectorChiFastSLAMf s0 = VectorChiFastSLAMf::Constant(0), MatrixChiFastSLAMf s_0_Cov = 0.01*MatrixChiFastSLAMf::Identity(), unsigned int k = 0, ParticleMapMemory* mapPool = NULL); 		// Initialize a standard particle with "zero-pose" or custom pose
     Particle(const Particle &ParticleToCopy);       // Copy constructer used in case where we need to make a copy of a Particle
     ~Particle();
-    void updateParticle(MeasurementSet* z_Ex,MeasurementSet* z_New, VectorUFastSLAMf* u, unsigned int k, float Ts);
-    double getWeigth();
-    void saveData(std::string filename,std::vector<unsigned int> LandmarksToSave);
+    void updateParticle(MeasurementSet* z_Ex,MeasurementSet* z_New, VectorUFastSLAMf* u, unsigned int k, float Ts, RandomStream* rngStream_ = NULL); // rngStream_ == NULL uses the process wide stream of randn()
+    double getWeigth(); // exp(logw)
+    void saveSnapshot(std::ostream &out, const std::vector<unsigned int> &LandmarksToSave); // particle record of Snapshot.h
     void handleNewMeas(MeasurementSet* z_New, VectorChiFastSLAMf s_proposale); // only moved up here to allow new landmarks to be added by Particle Set function
+    // the two per-particle stages of updateParticle that remain when prediction and sampling are batched by the ParticleSet
+    void conditionProposal(MeasurementSet* z_Ex, const VectorChiFastSLAMf &s_bar, VectorChiFastSLAMf &sMean_proposale, MatrixChiFastSLAMf &sCov_proposale);
+    void completeUpdate(MeasurementSet* z_Ex, MeasurementSet* z_New, const VectorChiFastSLAMf &s_proposale, VectorUFastSLAMf* u, unsigned int k, float Ts);
+    void addPoseAndWeight(MeasurementSet* z_Ex, const VectorChiFastSLAMf &s_proposale, VectorUFastSLAMf* u, unsigned int k, float Ts); // completeUpdate without the landmark updates
+    // handleExMeas of one measurement split around the batched Kalman update: load the landmark into slot i and store the corrected one
+    void loadLandmarkCorrection(Measurement* z, const VectorChiFastSLAMf &s_proposale, LandmarkUpdateBatch &landmarks, int i);
+    void storeLandmarkCorrection(Measurement* z, const LandmarkUpdateBatch &landmarks, int i);
 
 private:
     /* variables */
+    RandomStream* rngStream; // random stream used during the current update, not owned by the particle
 
     /* functions */
     VectorChiFastSLAMf drawSampleFromProposaleDistribution(VectorChiFastSLAMf* s_old, VectorUFastSLAMf* u, MeasurementSet* z_Ex, float Ts);
@@ -272,7 +730,116 @@ private:
 
 
 
+/* ############################## Defines ParticleUpdatePool class ##############################  */
+class ParticleUpdatePool
+{
+public:
+    /* functions */
+    ParticleUpdatePool(int nThreads, int nParticles); // nThreads includes the calling thread
+    ~ParticleUpdatePool();
+    void forEachParticle(const std::function<void(int)> &job); // runs job(i) for i = 1..nParticles and returns when all are done
+    int getNThreads();
+
+private:
+    /* variables */
+    int nThreads;
+    int nParticles;
+    std::vector<std::thread> workers;
+
+    std::mutex jobMutex;
+    std::condition_variable jobStart;
+    std::condition_variable jobDone;
+    unsigned int jobGeneration;
+    int workersBusy;
+    bool stopWorkers;
+
+    const std::function<void(int)>* job; // job currently being processed
+
+    /* functions */
+    void workerLoop(int threadIndex);
+    void updateRange(int threadIndex);
+};
+
+
+/* ############################## Defines ParticleStateBatch class ##############################  */
+// Structure-of-arrays copy of the proposal of all particles. The particles are grouped in blocks of PARTICLE_BATCH_LANES as
+// in LandmarkUpdateBatch, and inside a block every element of the pose and of the 4x4 matrices is a fixed-size array over
+// the particles. Prediction, Cholesky factorization and sampling are loops of constant length over these arrays, which the
+// compiler turns into SIMD code - only the cos/sin of the yaw angles are computed lane by lane.
+#define PARTICLE_BATCH_LANES 8 // a multiple of the SIMD width
+
+typedef struct ParticleStateBlock
+{
+    float s[4][PARTICLE_BATCH_LANES];      // pose before the update, later the sampled pose
+    float mean[4][PARTICLE_BATCH_LANES];   // proposal mean
+    float cov[10][PARTICLE_BATCH_LANES];   // proposal covariance - upper triangle, row by row
+    float chol[10][PARTICLE_BATCH_LANES];  // lower Cholesky factor of cov - element (r,c) is stored at the index of (c,r)
+    float noise[4][PARTICLE_BATCH_LANES];  // standard normal variates used by sample()
+} ParticleStateBlock;
+
+class ParticleStateBatch
+{
+public:
+    /* functions */
+    ParticleStateBatch(int nParticles_);
+    void predict(VectorUFastSLAMf* u, float Ts, const MatrixChiFastSLAMf &motionCov); // motion model from s and covariance prediction from the particle covariances in cov
+    void cholesky();
+    void sample(); // s = mean + chol*noise
+    VectorChiFastSLAMf getMean(int i);
+    void setMean(int i, const VectorChiFastSLAMf &m);
+    MatrixChiFastSLAMf getCov(int i);
+    void setCov(int i, const MatrixChiFastSLAMf &P);
+    VectorChiFastSLAMf getPose(int i);
+    void setPose(int i, const VectorChiFastSLAMf &pose);
+    void setNoise(int i, const float X[4]);
+
+private:
+    /* variables */
+    int nParticles;
+    std::vector<ParticleStateBlock> blocks; // particle i (1..nParticles) is lane (i-1) % PARTICLE_BATCH_LANES of block (i-1) / PARTICLE_BATCH_LANES
+};
+
+
+/* ############################## Defines LandmarkUpdateBatch class ##############################  */
+// Kalman correction of one measured landmark in all particles at once. The particles are grouped in blocks of
+// LANDMARK_BATCH_LANES, and inside a block every element is a fixed-size array over the particles, so the update of a block
+// is a loop of constant length over independent arrays, which the compiler turns into SIMD code without alias checks.
+// The 3x3 Cholesky factorization of the innovation covariance and the update are written out element by element.
+#define LANDMARK_BATCH_LANES 8 // a multiple of the SIMD width
+
+typedef struct LandmarkUpdateBlock
+{
+    float lhat[3][LANDMARK_BATCH_LANES];   // landmark mean, corrected by update()
+    float lCov[6][LANDMARK_BATCH_LANES];   // landmark covariance - upper triangle, row by row, corrected by update()
+    float H[9][LANDMARK_BATCH_LANES];      // Jacobian of the measurement with respect to the landmark, row by row
+    float v[3][LANDMARK_BATCH_LANES];      // innovation z - z_hat
+} LandmarkUpdateBlock;
+
+class LandmarkUpdateBatch
+{
+public:
+    /* functions */
+    LandmarkUpdateBatch(int nParticles_);
+    void setLandmark(int i, const Eigen::Vector3f &lhat, const Eigen::Matrix3f &lCov, const Measurement::MatrixHl &H, const Measurement::VectorZ &v);
+    void update(const Measurement::MatrixZ &R); // same measurement covariance R in all particles
+    Eigen::Vector3f getMean(int i) const;
+    Eigen::Matrix3f getCov(int i) const;
+
+private:
+    /* variables */
+    int nParticles;
+    std::vector<LandmarkUpdateBlock> blocks; // particle i (1..nParticles) is lane (i-1) % LANDMARK_BATCH_LANES of block (i-1) / LANDMARK_BATCH_LANES
+};
+
+
 /* ############################## Defines ParticleSet class ##############################  */
+enum ResamplingStrategy {
+    RESAMPLING_WHEEL = 0,       // original resampling wheel
+    RESAMPLING_SYSTEMATIC = 1,  // low variance sampler - one random offset for the whole comb
+    RESAMPLING_STRATIFIED = 2,  // one random offset per stratum
+    RESAMPLING_RESIDUAL = 3     // deterministic floor(N*w) copies, remainder drawn systematically
+};
+
 class ParticleSet
 {
 public:
@@ -280,25 +847,46 @@ public:
     std::vector<Particle*> Parray;
     MatrixChiFastSLAMf sCov;
     unsigned int k; // number of interations since time zero
-    std::vector<unsigned int> KnownMarkers;
+    LandmarkRegistry KnownMarkers;
     Path* sMean;                    // instance of path Class to keep track of the estimated mean of the Particle filter!
 
     /* functions */
     ParticleSet(int Nparticles = 10,unsigned int GOT_ID=99,VectorChiFastSLAMf s0 = VectorChiFastSLAMf::Constant(0), MatrixChiFastSLAMf s_0_Cov = 0.1*MatrixChiFastSLAMf::Identity()); 		/* Initialize a standard particle set with 100 particles */
     ~ParticleSet();
     void updateParticleSet(MeasurementSet* z, VectorUFastSLAMf u, float Ts);
+    void enableParallelUpdate(int nThreads); // nThreads = 0 uses all cores, nThreads = 1 is the serial update
+    void setRandomSeed(unsigned int seed); // seeds the random streams of resampling and of all particles
+    void setResampling(ResamplingStrategy strategy, float NeffThreshold); // resample when N_eff < NeffThreshold*nParticles, NeffThreshold >= 1 resamples every step
+    double getEffectiveSampleSize();
+    void setPathHorizon(unsigned int horizon); // number of poses kept in the particle paths, 0 = unbounded - the mean path is always kept
     VectorChiFastSLAMf* getLatestPoseEstimate();
     int getNParticles();
-    void saveData();
+    void printMapPoolUsage();
+    void saveData(); // binary snapshot Data/t_<k>.fslam, see Snapshot.h
 
     private:
     /* variables */
     int nParticles;   
     double StartTime;
+    ParticleUpdatePool* updatePool; // NULL when particles are updated serially
+    ParticleStateBatch batch; // prediction and sampling of all particles at once
+    LandmarkUpdateBatch landmarkBatch; // correction of the measured landmarks of all particles at once
+    MeasurementSet measExisting; // measurements of known landmarks - refers to the measurements of the set being processed
+    MeasurementSet measNew;      // measurements of landmarks seen for the first time
+    ParticleMapMemory* mapPool; // owns the memory of all map nodes and landmarks of the particles
+    ResamplingStrategy resamplingStrategy;
+    float resamplingNeffThreshold;
+    std::vector<RandomStream> rngStreams; // stream 0 is used for resampling, stream i by particle slot i - results do not depend on the number of threads
+    double Neff; // effective sample size of the latest weights
 
 
     /* functions */
     void resample();
+    void calculateOffspringCounts(const std::vector<double> &wNorm, std::vector<unsigned int> &counts);
+    double logSumExpWeights();
+    void forEachParticle(const std::function<void(int, RandomStream*)> &job); // uses the update pool when enabled
+    void partitionMeasurements(MeasurementSet* z); // fills measExisting and measNew, registers the new landmark IDs and drops repeated new IDs
+    void updateParticlesBatched(MeasurementSet* z_Ex, MeasurementSet* z_New, VectorUFastSLAMf* u, float Ts);
     void estimateDistribution(float Ts);
     void resampleSimple();
 };
@@ -0,0 +1,309 @@
+#include "Replay.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+/* ############################## Log loading ##############################  */
+vector<vector<double> > loadReplayCSV(const string &path){
+    ifstream indata(path.c_str());
+    string line;
+    vector<vector<double> > rowVectors;
+
+    while (getline(indata, line)) {
+        stringstream lineStream(line);
+        string cell;
+        vector<double> values;
+        while (getline(lineStream, cell, ',')) {
+            values.push_back(atof(cell.c_str()));
+        }
+        if (values.size() > 0) {
+            rowVectors.push_back(values);
+        }
+    }
+
+    return rowVectors;
+}
+
+ReplayLog::ReplayLog(){
+    hasIntrinsics = false;
+    for (int i = 0; i < 4; i++) {
+        depthIntrinsics[i] = 0;
+    }
+}
+
+static bool findLogFile(const string &directory, const string &suffix, string &path){
+    namespace fs = boost::filesystem;
+    if (!fs::is_directory(directory)) {
+        return false;
+    }
+    for (fs::directory_iterator it(directory); it != fs::directory_iterator(); ++it) {
+        string name = it->path().filename().string();
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            path = it->path().string();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReplayLog::load(const string &directory){
+    string mocapPath, cameraPath, motionModelPath, intrinsicsPath;
+
+    if (!findLogFile(directory, "_Mocap.txt", mocapPath) || !findLogFile(directory, "_MotionModel.txt", motionModelPath)) {
+        cout << "Replay: no Mocap or MotionModel log in " << directory << endl;
+        return false;
+    }
+    mocap = loadReplayCSV(mocapPath);
+    motionModel = loadReplayCSV(motionModelPath);
+
+    camera.clear();
+    if (findLogFile(directory, "_Camera.txt", cameraPath)) {
+        camera = loadReplayCSV(cameraPath);
+    }
+
+    // The Intrinsics log starts every line with the name of the stream, so it is not parsed by loadReplayCSV
+    hasIntrinsics = false;
+    if (findLogFile(directory, "_Intrinsics.txt", intrinsicsPath)) {
+        ifstream indata(intrinsicsPath.c_str());
+        string line;
+        while (getline(indata, line)) {
+            stringstream lineStream(line);
+            string cell;
+            vector<string> cells;
+            while (getline(lineStream, cell, ',')) {
+                cells.push_back(cell);
+            }
+            if (cells.size() >= 7 && cells[0] == "depth") { // depth, width, height, fx, ppx, fy, ppy, coeffs
+                for (int i = 0; i < 4; i++) {
+                    depthIntrinsics[i] = atof(cells[3+i].c_str());
+                }
+                hasIntrinsics = true;
+            }
+        }
+    }
+
+    // drop rows which are too short to be used, e.g. a truncated last line
+    mocap.erase(remove_if(mocap.begin(), mocap.end(), [](const vector<double> &row){ return row.size() < 7; }), mocap.end());
+    camera.erase(remove_if(camera.begin(), camera.end(), [](const vector<double> &row){ return row.size() < 5; }), camera.end());
+    motionModel.erase(remove_if(motionModel.begin(), motionModel.end(), [](const vector<double> &row){ return row.size() < 6; }), motionModel.end());
+
+    cout << "Replay: " << mocap.size() << " mocap samples, " << camera.size() << " marker measurements, " << motionModel.size() << " filter steps" << endl;
+    return (mocap.size() > 0 && motionModel.size() > 0);
+}
+
+/* ############################## Configuration ##############################  */
+ReplayOptions::ReplayOptions(){
+    Nparticles = 50;
+    threads = 1;
+    seed = 1495718309;
+    resamplingStrategy = RESAMPLING_WHEEL;
+    resamplingNeffThreshold = 1;
+    pathHorizon = 0;
+    GOT_ID = 49;
+    useGOT = true;
+    GOT_MinSampleTime = 0;
+    GOT_loss_time[0] = GOT_loss_time[1] = 0;
+    for (int i = 0; i < 6; i++) {
+        GOT_loss_xyz[i] = 0;
+    }
+    verbose = false;
+}
+
+bool loadReplayConfig(const string &path, ReplayOptions &options){
+    vector<vector<double> > Config = loadReplayCSV(path);
+    if (Config.size() < 8 || Config[1].size() < 4 || Config[2].size() < 3 || Config[3].size() < 3 ||
+            Config[4].size() < 3 || Config[5].size() < 6 || Config[6].size() < 2) {
+        cout << "Replay: error loading " << path << endl;
+        return false;
+    }
+
+    options.Nparticles = Config[0][0];
+
+    Particle::sCov(0,0) = pow(Config[1][0]/3,2);
+    Particle::sCov(1,1) = pow(Config[1][1]/3,2);
+    Particle::sCov(2,2) = pow(Config[1][2]/3,2);
+    Particle::sCov(3,3) = pow(Config[1][3]*(pi/180)/3,2);
+
+    GOTMeasurement::zCov(0,0) = pow(Config[2][0]/3,2);
+    GOTMeasurement::zCov(1,1) = pow(Config[2][1]/3,2);
+    GOTMeasurement::zCov(2,2) = pow(Config[2][2]/3,2);
+
+    ImgMeasurement::zCov(0,0) = pow(Config[3][0]/3,2);
+    ImgMeasurement::zCov(1,1) = pow(Config[3][1]/3,2);
+    ImgMeasurement::zCov(2,2) = pow(Config[3][2]/3,2);
+
+    ImgMeasurement::CameraOffset(0) = Config[4][0];
+    ImgMeasurement::CameraOffset(1) = Config[4][1];
+    ImgMeasurement::CameraOffset(2) = Config[4][2];
+
+    for (int i = 0; i < 6; i++) {
+        options.GOT_loss_xyz[i] = Config[5][i];
+    }
+    options.GOT_loss_time[0] = Config[6][0];
+    options.GOT_loss_time[1] = Config[6][1];
+    options.GOT_MinSampleTime = Config[7][0];
+
+    // rows added after the first logs were recorded are optional
+    if (Config.size() > 8 && Config[8].size() >= 2) {
+        options.threads = Config[8][0];
+        options.seed = Config[8][1];
+    }
+    if (Config.size() > 9 && Config[9].size() >= 2) {
+        options.resamplingStrategy = (ResamplingStrategy)(int)Config[9][0];
+        options.resamplingNeffThreshold = Config[9][1];
+    }
+    if (Config.size() > 10) {
+        options.pathHorizon = Config[10][0];
+    }
+
+    return true;
+}
+
+/* ############################## Replay ##############################  */
+// index of the latest row with a timestamp <= time, the first row if there is none
+static size_t findLatestRow(const vector<vector<double> > &rows, double time){
+    vector<vector<double> >::const_iterator it = upper_bound(rows.begin(), rows.end(), time,
+                                                             [](double t, const vector<double> &row){ return t < row[0]; });
+    return (it == rows.begin()) ? 0 : (it - rows.begin() - 1);
+}
+
+static bool GOTAvailable(const ReplayOptions &options, double time, const vector<double> &pose){
+    // same conditions as the simulated GOT loss in FastSLAM_node
+    if ((time >= options.GOT_loss_time[0]) && (time <= options.GOT_loss_time[1])) {
+        return false;
+    }
+    if (pose[1] > options.GOT_loss_xyz[0] && pose[1] < options.GOT_loss_xyz[1]) {
+        return false;
+    }
+    if (pose[2] > options.GOT_loss_xyz[2] && pose[2] < options.GOT_loss_xyz[3]) {
+        return false;
+    }
+    if (pose[3] > options.GOT_loss_xyz[4] && pose[3] < options.GOT_loss_xyz[5]) {
+        return false;
+    }
+    return true;
+}
+
+void runReplay(const ReplayLog &log, const ReplayOptions &options, ReplayResult &result){
+    result.steps = 0;
+    result.imgMeasurements = 0;
+    result.GOTMeasurements = 0;
+    result.updateTime = 0;
+    result.positionRMSE = 0;
+    result.yawRMSE = 0;
+    result.maxPositionError = 0;
+    result.droppedFrames = 0;
+    result.finalPose = VectorChiFastSLAMf::Zero();
+
+    if (log.mocap.size() == 0 || log.motionModel.size() == 0) {
+        result.totalTime = 0;
+        return;
+    }
+
+    if (log.hasIntrinsics) {
+        ImgMeasurement::ax = log.depthIntrinsics[0];
+        ImgMeasurement::x0 = log.depthIntrinsics[1];
+        ImgMeasurement::ay = log.depthIntrinsics[2];
+        ImgMeasurement::y0 = log.depthIntrinsics[3];
+    }
+
+    auto replayStart = chrono::steady_clock::now();
+
+    // the filter starts at the Mocap pose at the time of the step before the first logged step, as in FastSLAM_node
+    double startTime = log.motionModel[0][0] - log.motionModel[0][1];
+    const vector<double> &startPose = log.mocap[findLatestRow(log.mocap, startTime)];
+    VectorChiFastSLAMf s0;
+    s0 << startPose[1], startPose[2], startPose[3], startPose[6];
+
+    ParticleSet Pset(options.Nparticles, options.GOT_ID, s0, MatrixChiFastSLAMf::Zero());
+    Pset.setRandomSeed(options.seed);
+    Pset.enableParallelUpdate(options.threads);
+    Pset.setResampling(options.resamplingStrategy, options.resamplingNeffThreshold);
+    Pset.setPathHorizon(options.pathHorizon);
+
+    MeasurementSet MeasSet;
+    VectorUFastSLAMf u;
+    Eigen::Vector3f meas;
+    double previousGOTTime = -numeric_limits<double>::infinity();
+    double squaredPositionError = 0;
+    double squaredYawError = 0;
+    size_t cameraRow = 0;
+
+    for (size_t step = 0; step < log.motionModel.size(); step++) {
+        const vector<double> &row = log.motionModel[step];
+        double time = row[0];
+        float Ts = row[1];
+        if (Ts <= 0) {
+            continue;
+        }
+
+        // the markers of the newest frame since the previous step, as FastSLAM_node only applies the newest frame.
+        // Several frames in one set would add a marker seen for the first time more than once.
+        size_t frameStart = cameraRow;
+        for (; cameraRow < log.camera.size() && log.camera[cameraRow][0] <= time; cameraRow++) {
+            if (log.camera[cameraRow][0] != log.camera[frameStart][0]) {
+                frameStart = cameraRow;
+                result.droppedFrames++;
+            }
+        }
+        for (size_t r = frameStart; r < cameraRow; r++) {
+            const vector<double> &marker = log.camera[r];
+            const vector<double> &pose = log.mocap[findLatestRow(log.mocap, marker[0])];
+            meas << marker[2], marker[3], marker[4];
+            MeasSet.addMeasurement(new ImgMeasurement((unsigned int)marker[1], meas, pose[4], pose[5]));
+            result.imgMeasurements++;
+        }
+
+        const vector<double> &truePose = log.mocap[findLatestRow(log.mocap, time)];
+        if (options.useGOT && GOTAvailable(options, time, truePose) && (time - previousGOTTime) > options.GOT_MinSampleTime) {
+            previousGOTTime = time;
+            meas << truePose[1], truePose[2], truePose[3];
+            MeasSet.addMeasurement(new GOTMeasurement(options.GOT_ID, meas));
+            result.GOTMeasurements++;
+        }
+
+        u << row[2], row[3], row[4], row[5];
+
+        auto updateStart = chrono::steady_clock::now();
+        Pset.updateParticleSet(&MeasSet, u, Ts);
+        result.updateTime += chrono::duration<double>(chrono::steady_clock::now() - updateStart).count();
+
+        MeasSet.emptyMeasurementSet();
+
+        VectorChiFastSLAMf pose = *(Pset.sMean->getPose());
+        double positionError = sqrt(pow(pose(0) - truePose[1], 2) + pow(pose(1) - truePose[2], 2) + pow(pose(2) - truePose[3], 2));
+        double yawError = remainder(pose(3) - truePose[6], 2*M_PI);
+        squaredPositionError += positionError*positionError;
+        squaredYawError += yawError*yawError;
+        result.maxPositionError = max(result.maxPositionError, positionError);
+        result.steps++;
+
+        if (options.verbose) {
+            cout << "Time: " << time << " pose: " << pose.transpose() << " error: " << positionError << endl;
+        }
+    }
+
+    if (result.steps > 0) {
+        result.positionRMSE = sqrt(squaredPositionError/result.steps);
+        result.yawRMSE = sqrt(squaredYawError/result.steps);
+        result.finalPose = *(Pset.sMean->getPose());
+    }
+    result.totalTime = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+}
+
+void printReplayResult(const ReplayResult &result){
+    cout << "Replay: " << result.steps << " steps, " << result.imgMeasurements << " marker and " << result.GOTMeasurements << " GOT measurements, "
+         << result.droppedFrames << " older frames skipped" << endl;
+    cout << "Replay: update time " << result.updateTime << " s (" << (result.steps > 0 ? 1e3*result.updateTime/result.steps : 0) << " ms per step, "
+         << (result.updateTime > 0 ? result.steps/result.updateTime : 0) << " steps/s), total " << result.totalTime << " s" << endl;
+    cout << "Replay: position RMSE " << result.positionRMSE << " m (max " << result.maxPositionError << " m), yaw RMSE " << rad2deg(result.yawRMSE) << " deg" << endl;
+    cout << "Replay: final pose " << result.finalPose.transpose() << endl;
+}
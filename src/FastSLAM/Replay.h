@@ -0,0 +1,65 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "FastSLAM.h"
+
+#include <vector>
+#include <string>
+
+// Offline replay of the logs written by FastSLAM_node (see DataForPlotting). The filter is stepped at the timestamps of
+// the MotionModel log with the logged dt and motion input, the Camera log provides the marker measurements and the
+// Mocap log provides the GOT measurements, the roll/pitch of the image measurements and the ground truth.
+// No ROS, camera or wall-clock waits are involved, so a replay runs as fast as the filter can update.
+
+struct ReplayLog
+{
+    /* variables */
+    std::vector<std::vector<double> > mocap;         // time, x, y, z, roll, pitch, yaw
+    std::vector<std::vector<double> > camera;        // time, ID, x, y, depth
+    std::vector<std::vector<double> > motionModel;   // time, dt, u(4), s_k(4)
+    float depthIntrinsics[4];                        // fx, ppx, fy, ppy
+    bool hasIntrinsics;
+
+    /* functions */
+    ReplayLog();
+    bool load(const std::string &directory); // loads the *_Mocap.txt, *_Camera.txt, *_MotionModel.txt and *_Intrinsics.txt files of the directory
+};
+
+struct ReplayOptions
+{
+    int Nparticles;
+    int threads;                            // 1 = serial update, 0 = use all cores
+    unsigned int seed;
+    ResamplingStrategy resamplingStrategy;
+    float resamplingNeffThreshold;
+    unsigned int pathHorizon;
+    unsigned int GOT_ID;
+    bool useGOT;
+    float GOT_MinSampleTime;                // seconds between used GOT samples
+    float GOT_loss_time[2];                 // GOT is disabled in between these times
+    float GOT_loss_xyz[6];                  // GOT is disabled inside this box (xmin, xmax, ymin, ymax, zmin, zmax)
+    bool verbose;                           // print the pose of every step
+
+    ReplayOptions();
+};
+
+struct ReplayResult
+{
+    unsigned int steps;
+    unsigned int imgMeasurements;
+    unsigned int GOTMeasurements;
+    unsigned int droppedFrames; // camera frames replaced by a newer one before the next step
+    double updateTime;      // seconds spent in updateParticleSet
+    double totalTime;       // seconds spent for the whole replay, including the measurement assembly
+    double positionRMSE;    // compared to the Mocap pose at the time of each step
+    double yawRMSE;
+    double maxPositionError;
+    VectorChiFastSLAMf finalPose;
+};
+
+std::vector<std::vector<double> > loadReplayCSV(const std::string &path); // empty on error
+bool loadReplayConfig(const std::string &path, ReplayOptions &options); // applies config.csv the same way as FastSLAM_node
+void runReplay(const ReplayLog &log, const ReplayOptions &options, ReplayResult &result);
+void printReplayResult(const ReplayResult &result);
+
+#endif
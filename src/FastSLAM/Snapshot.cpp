@@ -0,0 +1,236 @@
+#include "Snapshot.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+/* ############################## Writing ##############################  */
+void snapshotWriteHeader(ostream &out, uint32_t k, uint32_t nParticles, const vector<unsigned int> &IDs){
+    out.write(SNAPSHOT_MAGIC, 8);
+    snapshotWrite(out, (uint32_t)SNAPSHOT_VERSION);
+    snapshotWrite(out, k);
+    snapshotWrite(out, nParticles);
+    snapshotWrite(out, (uint32_t)IDs.size());
+    for (unsigned int i = 0; i < IDs.size(); i++) {
+        snapshotWrite(out, (uint32_t)IDs[i]);
+    }
+}
+
+
+/* ############################## Reading ##############################  */
+// reads from the file loaded into memory, all counts are checked against the remaining bytes before allocating
+class SnapshotBuffer
+{
+public:
+    SnapshotBuffer(const vector<char> &data_) : data(data_), pos(0) {}
+
+    template <typename T>
+    bool read(T &value){
+        if (data.size() - pos < sizeof(T)) {
+            return false;
+        }
+        memcpy(&value, &data[pos], sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+    bool readArray(void *dst, size_t count, size_t size){
+        if (size != 0 && count > (data.size() - pos) / size) {
+            return false;
+        }
+        if (count != 0) {
+            memcpy(dst, &data[pos], count*size);
+        }
+        pos += count*size;
+        return true;
+    }
+    bool fits(size_t count, size_t size) const { return size == 0 || count <= (data.size() - pos) / size; }
+    bool atEnd() const { return pos == data.size(); }
+
+private:
+    const vector<char> &data;
+    size_t pos;
+};
+
+static bool readPath(SnapshotBuffer &buffer, SnapshotPath &path){
+    uint32_t nPoses;
+    if (!buffer.read(path.PathLength) || !buffer.read(nPoses) || !buffer.fits(nPoses, SNAPSHOT_POSE_SIZE*sizeof(float))) {
+        return false;
+    }
+    path.poses.resize((size_t)nPoses * SNAPSHOT_POSE_SIZE);
+    return buffer.readArray(path.poses.data(), path.poses.size(), sizeof(float));
+}
+
+static bool readLandmark(SnapshotBuffer &buffer, SnapshotLandmark &l){
+    return buffer.read(l.c) && buffer.readArray(l.lhat, 3, sizeof(float)) && buffer.readArray(l.lCov, 9, sizeof(float));
+}
+
+bool loadSnapshot(const string &path, Snapshot &snapshot){
+    ifstream in(path.c_str(), ios::in | ios::binary);
+    if (!in) {
+        cout << "Snapshot: cannot open " << path << endl;
+        return false;
+    }
+    vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    SnapshotBuffer buffer(data);
+    char magic[8];
+    uint32_t version, nParticles, nIDs;
+    if (!buffer.readArray(magic, 8, 1) || memcmp(magic, SNAPSHOT_MAGIC, 8) != 0) {
+        cout << "Snapshot: " << path << " is not a FastSLAM snapshot" << endl;
+        return false;
+    }
+    if (!buffer.read(version)) {
+        cout << "Snapshot: " << path << " is truncated or corrupt" << endl;
+        return false;
+    }
+    if (version != SNAPSHOT_VERSION) {
+        cout << "Snapshot: " << path << " has version " << version << ", expected " << SNAPSHOT_VERSION << endl;
+        return false;
+    }
+
+    bool ok = buffer.read(snapshot.k) && buffer.read(nParticles) && buffer.read(nIDs) && buffer.fits(nIDs, sizeof(uint32_t));
+    if (ok) {
+        snapshot.landmarkIDs.resize(nIDs);
+        ok = buffer.readArray(snapshot.landmarkIDs.data(), nIDs, sizeof(uint32_t)) && readPath(buffer, snapshot.meanPath);
+    }
+    // a particle takes at least its weight, an empty path and the map counts
+    ok = ok && buffer.fits(nParticles, sizeof(double) + 4*sizeof(uint32_t));
+    if (ok) {
+        snapshot.particles.resize(nParticles);
+    }
+    for (unsigned int i = 0; ok && i < nParticles; i++) {
+        SnapshotParticle &p = snapshot.particles[i];
+        uint32_t nSaved;
+        ok = buffer.read(p.logw) && readPath(buffer, p.path) && buffer.read(p.nLandmarks) && buffer.read(nSaved)
+             && buffer.fits(nSaved, SNAPSHOT_LANDMARK_SIZE);
+        if (ok) {
+            p.landmarks.resize(nSaved);
+        }
+        for (unsigned int j = 0; ok && j < nSaved; j++) {
+            ok = readLandmark(buffer, p.landmarks[j]);
+        }
+    }
+
+    if (!ok || !buffer.atEnd()) {
+        cout << "Snapshot: " << path << " is truncated or corrupt" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+/* ############################## Conversion ##############################  */
+// one row of an Octave matrix with the values at offset, offset + stride, ...
+static void writeOctaveRow(ostream &out, const float *values, unsigned int n, unsigned int stride){
+    for (unsigned int i = 0; i < n; i++) {
+        out << (i ? " " : "") << values[i*stride];
+    }
+}
+
+static void writeOctavePath(ostream &out, const SnapshotPath &path){
+    unsigned int n = path.getNumberOfPoses();
+    const float *poses = path.poses.data();
+    out << "Path = struct('PathLength',[],'Path',[],'Ts',[]);" << endl;
+    out << "Path.PathLength = " << path.PathLength << ";" << endl;
+    out << "Path.Path = [";
+    for (int d = 0; d < 4; d++) {
+        writeOctaveRow(out, poses + d, n, SNAPSHOT_POSE_SIZE);
+        out << (d < 3 ? ";\n" : "");
+    }
+    out << "];" << endl;
+    out << "Path.Ts = [";
+    writeOctaveRow(out, poses + 4, n, SNAPSHOT_POSE_SIZE);
+    out << "];" << endl;
+}
+
+void writeSnapshotOctave(const Snapshot &snapshot, ostream &out){
+    string t = "t" + to_string(snapshot.k);
+    out.precision(numeric_limits<float>::max_digits10);
+
+    out << t << " = struct('Particles',[],'meanPath',[]);" << endl;
+    writeOctavePath(out, snapshot.meanPath);
+    out << t << ".meanPath = Path;" << endl;
+    out << "clear Path" << endl;
+
+    for (unsigned int i = 0; i < snapshot.particles.size(); i++) {
+        const SnapshotParticle &p = snapshot.particles[i];
+        writeOctavePath(out, p.path);
+
+        unsigned int n = p.landmarks.size();
+        out << "map = struct('nLandmarks',[],'mean',[],'cov',[],'identifier',[]);" << endl;
+        out << "map.nLandmarks = " << p.nLandmarks << ";" << endl;
+        if (n > 0) {
+            out << "map.mean = [";
+            for (int d = 0; d < 3; d++) {
+                for (unsigned int j = 0; j < n; j++) {
+                    out << (j ? " " : "") << p.landmarks[j].lhat[d];
+                }
+                out << (d < 2 ? ";\n" : "");
+            }
+            out << "];" << endl;
+            out << "map.cov = reshape([";
+            for (unsigned int j = 0; j < n; j++) {
+                writeOctaveRow(out, p.landmarks[j].lCov, 9, 1);
+                out << (j + 1 < n ? " " : "");
+            }
+            out << "],3,3," << n << ");" << endl;
+            out << "map.identifier = [";
+            for (unsigned int j = 0; j < n; j++) {
+                out << (j ? " " : "") << p.landmarks[j].c;
+            }
+            out << "];" << endl;
+        }
+
+        out << "particle = struct('Path',Path,'map',map);" << endl;
+        if (i == 0) {
+            out << t << ".Particles = particle;" << endl;
+        } else {
+            out << t << ".Particles(" << i+1 << ") = particle;" << endl;
+        }
+        out << "clear particle Path map" << endl;
+    }
+}
+
+static void writeCSVPath(ostream &out, unsigned int particle, const SnapshotPath &path){
+    for (unsigned int i = 0; i < path.getNumberOfPoses(); i++) {
+        const float *pose = &path.poses[i*SNAPSHOT_POSE_SIZE];
+        out << particle << "," << i+1;
+        for (int d = 0; d < SNAPSHOT_POSE_SIZE; d++) {
+            out << "," << pose[d];
+        }
+        out << "\n";
+    }
+}
+
+bool writeSnapshotCSV(const Snapshot &snapshot, const string &prefix){
+    // no header lines, so the files load with csvread like the logs of FastSLAM_node
+    ofstream particles((prefix + "_particles.csv").c_str()); // particle, logw, PathLength, nLandmarks
+    ofstream paths((prefix + "_paths.csv").c_str());         // particle (0 = mean path), pose (1 = newest), x, y, z, yaw, Ts
+    ofstream maps((prefix + "_maps.csv").c_str());           // particle, ID, x, y, z, lCov (9 values, column major)
+    if (!particles || !paths || !maps) {
+        cout << "Snapshot: cannot write " << prefix << "_*.csv" << endl;
+        return false;
+    }
+    particles.precision(numeric_limits<double>::max_digits10);
+    paths.precision(numeric_limits<float>::max_digits10);
+    maps.precision(numeric_limits<float>::max_digits10);
+
+    writeCSVPath(paths, 0, snapshot.meanPath);
+    for (unsigned int i = 0; i < snapshot.particles.size(); i++) {
+        const SnapshotParticle &p = snapshot.particles[i];
+        particles << i+1 << "," << p.logw << "," << p.path.PathLength << "," << p.nLandmarks << "\n";
+        writeCSVPath(paths, i+1, p.path);
+        for (unsigned int j = 0; j < p.landmarks.size(); j++) {
+            const SnapshotLandmark &l = p.landmarks[j];
+            maps << i+1 << "," << l.c << "," << l.lhat[0] << "," << l.lhat[1] << "," << l.lhat[2];
+            for (int e = 0; e < 9; e++) {
+                maps << "," << l.lCov[e];
+            }
+            maps << "\n";
+        }
+    }
+    return particles.good() && paths.good() && maps.good();
+}
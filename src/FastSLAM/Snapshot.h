@@ -0,0 +1,67 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+// Binary snapshot of a particle set, written by ParticleSet::saveData in one streaming pass. Only the reader lives here,
+// so the converter does not depend on the filter. All values are in native byte order (little endian on all targets):
+//   file:     header, mean path, nParticles x particle
+//   header:   char magic[8] = "FSLAMSNP", uint32 version, uint32 k, uint32 nParticles, uint32 nIDs, uint32 IDs[nIDs]
+//   path:     uint32 PathLength, uint32 nPoses, nPoses x float[5] {x, y, z, yaw, Ts}
+//             newest to oldest, without the latest pose - the same poses as the former .m files
+//   particle: double logw, path, uint32 nLandmarks, uint32 nSaved, nSaved x landmark
+//   landmark: uint32 c, float lhat[3], float lCov[9] (column major)
+// The landmarks of a map are saved in the order of the IDs in the header.
+
+#define SNAPSHOT_MAGIC      "FSLAMSNP"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_POSE_SIZE  5 // floats per pose
+#define SNAPSHOT_LANDMARK_SIZE (4 + 3*4 + 9*4) // bytes per landmark
+
+struct SnapshotPath
+{
+    uint32_t PathLength;
+    std::vector<float> poses; // SNAPSHOT_POSE_SIZE floats per pose
+
+    unsigned int getNumberOfPoses() const { return poses.size() / SNAPSHOT_POSE_SIZE; }
+};
+
+struct SnapshotLandmark
+{
+    uint32_t c;
+    float lhat[3];
+    float lCov[9];
+};
+
+struct SnapshotParticle
+{
+    double logw;
+    SnapshotPath path;
+    uint32_t nLandmarks; // size of the map, may include landmarks not listed in the header IDs
+    std::vector<SnapshotLandmark> landmarks;
+};
+
+struct Snapshot
+{
+    uint32_t k;
+    std::vector<uint32_t> landmarkIDs;
+    SnapshotPath meanPath;
+    std::vector<SnapshotParticle> particles;
+};
+
+// raw writes used by the filter, so both sides agree on the layout
+template <typename T>
+inline void snapshotWrite(std::ostream &out, const T &value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+void snapshotWriteHeader(std::ostream &out, uint32_t k, uint32_t nParticles, const std::vector<unsigned int> &IDs);
+
+bool loadSnapshot(const std::string &path, Snapshot &snapshot); // prints the reason and returns false on error
+void writeSnapshotOctave(const Snapshot &snapshot, std::ostream &out); // same variables as the former t_<k>.m files
+bool writeSnapshotCSV(const Snapshot &snapshot, const std::string &prefix); // <prefix>_particles.csv, <prefix>_paths.csv and <prefix>_maps.csv
+
+#endif
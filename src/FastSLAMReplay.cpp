@@ -0,0 +1,43 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "Replay.h"
+
+using namespace std;
+
+// Replays the logs of a FastSLAM_node run without ROS and reports filter throughput and accuracy against Mocap.
+// Usage: FastSLAMReplay <log directory> [config.csv] [Nparticles] [threads] [resampling strategy] [Neff threshold]
+// Values not given on the command line are taken from config.csv, e.g.
+//   FastSLAMReplay src/FastSLAM/DataForPlotting/ManualFlight/GOTenabledAlways src/FastSLAM/config.csv 200 0 1 0.5
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <log directory> [config.csv] [Nparticles] [threads] [resampling strategy] [Neff threshold]" << endl;
+        return -1;
+    }
+
+    ReplayOptions options;
+    string configPath = (argc > 2) ? argv[2] : "src/FastSLAM/config.csv";
+    if (!loadReplayConfig(configPath, options)) {
+        return -1;
+    }
+    if (argc > 3) options.Nparticles = atoi(argv[3]);
+    if (argc > 4) options.threads = atoi(argv[4]);
+    if (argc > 5) options.resamplingStrategy = (ResamplingStrategy)atoi(argv[5]);
+    if (argc > 6) options.resamplingNeffThreshold = atof(argv[6]);
+
+    ReplayLog log;
+    if (!log.load(argv[1])) {
+        return -1;
+    }
+
+    cout << "Replay: " << options.Nparticles << " particles, resampling strategy " << options.resamplingStrategy
+         << ", N_eff threshold " << options.resamplingNeffThreshold << endl;
+
+    ReplayResult result;
+    runReplay(log, options, result);
+    printReplayResult(result);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "Snapshot.h"
+
+using namespace std;
+
+// Converts a binary snapshot written by ParticleSet::saveData for plotting.
+// Usage: FastSLAMSnapshot <snapshot.fslam> [m|csv|info] [output]
+//   m    (default) Octave script with the same variables as the former t_<k>.m files, output defaults to t_<k>.m
+//   csv  <output>_particles.csv, <output>_paths.csv and <output>_maps.csv, output defaults to t_<k>
+//   info prints the size of the snapshot
+//   FastSLAMSnapshot Data/t_2105.fslam m src/FastSLAM/DataForPlotting/t_2105.m
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <snapshot.fslam> [m|csv|info] [output]" << endl;
+        return -1;
+    }
+    string format = (argc > 2) ? argv[2] : "m";
+
+    Snapshot snapshot;
+    if (!loadSnapshot(argv[1], snapshot)) {
+        return -1;
+    }
+
+    if (format == "info") {
+        size_t poses = snapshot.meanPath.getNumberOfPoses(), landmarks = 0;
+        for (unsigned int i = 0; i < snapshot.particles.size(); i++) {
+            poses += snapshot.particles[i].path.getNumberOfPoses();
+            landmarks += snapshot.particles[i].landmarks.size();
+        }
+        cout << "k = " << snapshot.k << ", " << snapshot.particles.size() << " particles, " << snapshot.landmarkIDs.size()
+             << " landmark IDs, " << poses << " poses and " << landmarks << " landmarks in total" << endl;
+    } else if (format == "m") {
+        string output = (argc > 3) ? argv[3] : "t_" + to_string(snapshot.k) + ".m";
+        ofstream out(output.c_str());
+        if (!out) {
+            cout << "Cannot write " << output << endl;
+            return -1;
+        }
+        writeSnapshotOctave(snapshot, out);
+        cout << "Wrote " << output << endl;
+    } else if (format == "csv") {
+        string output = (argc > 3) ? argv[3] : "t_" + to_string(snapshot.k);
+        if (!writeSnapshotCSV(snapshot, output)) {
+            return -1;
+        }
+        cout << "Wrote " << output << "_particles.csv, " << output << "_paths.csv and " << output << "_maps.csv" << endl;
+    } else {
+        cout << "Unknown format " << format << ", use m, csv or info" << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include <sensor_msgs/CameraInfo.h>
 #include <std_msgs/Float32.h>
 #include <std_msgs/Float64.h>
+#include <std_msgs/Bool.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/features2d/features2d.hpp>
@@ -32,12 +33,16 @@
 
 #include "FastSLAM.h"
 #include "utils.h"
+#include "spsc_queue.h"
+#include "marker_detection.h"
 
 #include <tf/transform_datatypes.h> // for Quaternion transformation
 
 // To be able to use cout
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <algorithm>
 
 using namespace std;
 using namespace Eigen;
@@ -52,6 +57,8 @@ using namespace Eigen;
 #define VISUALIZE_WORLD_MEASUREMENT 0
 
 #define DEPTH_SCALING   1000.f    // R200 camera on drone
+#define MARKER_DEPTH_MIN    0.1f    // [m] depth pixels closer than this are not found by the marker-local depth sampling
+#define MARKER_DEPTH_MAX    1000.f  // [m] practically infinity - the registered position converges with the depth
 //#define DEPTH_SCALING   1.f       // Gazebo depth camera
 
 #define ADDED_VELOCITY_X_BIAS               0.02
@@ -95,8 +102,8 @@ static struct rs_extrinsics depth_to_color;
 ros::Subscriber camerainfo1_sub;
 ros::Subscriber camerainfo2_sub;
 
-cv::Mat RGB_Image;
-cv::Mat Depth_Image;
+cv_bridge::CvImageConstPtr RGB_Image;     // latest images, these share the buffers of the ROS messages
+cv_bridge::CvImageConstPtr Depth_Image;
 bool RGB_Image_New = false;
 bool Depth_Image_New = false;
 bool RGBD_Image_Ready = false;
@@ -104,6 +111,7 @@ ros::Time PoseTimestamp(0);
 ros::Duration RGBD_Timestamp;
 ros::Time Time0(0);
 ros::Duration DepthToPose_TimeOffset(0);
+bool FullFrameDepthRegistration = false;
 
 cv::aruco::Dictionary markerDictionary = cv::aruco::getPredefinedDictionary(cv::aruco::DICT_4X4_50);
 Eigen::IOFormat OctaveFmt(Eigen::FullPrecision, 0, ", ", ";\n", "", "", "[", "]"); // see https://eigen.tuxfamily.org/dox/structEigen_1_1IOFormat.html#a840cac6401adc4de421260d63dc3d861
@@ -118,6 +126,29 @@ ofstream IntrinsicsLog;
 ofstream MocapVelocityLog;
 ofstream MotionModelLog;
 
+// The log files are written by the logging thread (see LoggingStage), the other threads queue their lines
+#define PIPELINE_LOG_QUEUE_LENGTH   4096    // lines waiting to be written, per producing thread
+
+typedef struct log_line
+{
+    ofstream * file;
+    string text;
+} log_line;
+
+SPSCQueue<log_line> MainLogQueue(PIPELINE_LOG_QUEUE_LENGTH);     // lines from the main thread and the ROS callbacks
+SPSCQueue<log_line> CameraLogQueue(PIPELINE_LOG_QUEUE_LENGTH);   // lines from the detection stage
+std::atomic<bool> LoggingRunning(false);
+
+void queueLogLine(SPSCQueue<log_line> & queue, ofstream * file, const ostringstream & text)
+{
+    log_line line;
+    line.file = file;
+    line.text = text.str();
+    while (!queue.push(line)) { // log lines are not dropped, the logging thread is only this far behind if the disk stalls
+        std::this_thread::yield();
+    }
+}
+
 // ==== FastSLAM variables ====
 int Nparticles;
 unsigned int GOT_MeasurementID;
@@ -129,9 +160,9 @@ VectorUFastSLAMf u;
 
 
 // ==== Function definitions ====
-static void rs_deproject_pixel_to_point(float point[3], const struct rs_intrinsics * intrin, const float pixel[2], float depth);
-static void rs_project_point_to_pixel(float pixel[2], const struct rs_intrinsics * intrin, const float point[3], bool undistort);
-static void rs_transform_point_to_point(float to_point[3], const struct rs_extrinsics * extrin, const float from_point[3]);
+void InitDepthRegistration(int width, int height);
+void RegisterDepthImage(const cv::Mat & Depth, cv::Mat & registered_depth, cv::Mat & registered_depth2);
+void RegisterDepthWindow(const cv::Mat & Depth, int u0, int v0, cv::Vec3f window[3][3]);
 
 void MocapPose_Callback(const geometry_msgs::PoseStamped::ConstPtr& pose);
 void Depth_Image_Callback(const sensor_msgs::ImageConstPtr& image);
@@ -141,66 +172,200 @@ void CameraInfo_RGB_Callback(const sensor_msgs::CameraInfoConstPtr& cameraInfo);
 void CameraInfo_Depth_Callback(const sensor_msgs::CameraInfoConstPtr& cameraInfo);
 void ConfigureCamera(bool autoExposure);
 void InitHardcodedExtrinsics(void);
-void ProcessRGBDimage(MeasurementSet * MeasSet);
+void IngestRGBDimage(void);
 
 
 
 // Taken from: https://github.com/IntelRealSense/librealsense/blob/master/include/librealsense/rsutil.h
 // Demo with conversion is found here: https://github.com/IntelRealSense/librealsense/blob/master/examples/c-tutorial-3-pointcloud.c#L148-L150
 
-/* Given pixel coordinates and depth in an image with no distortion or inverse distortion coefficients, compute the corresponding point in 3D space relative to the same camera */
-static void rs_deproject_pixel_to_point(float point[3], const struct rs_intrinsics * intrin, const float pixel[2], float depth)
+/* Registration of the depth image into the color image.
+   The intrinsics and extrinsics are fixed once the CameraInfo callbacks have been received, so the deprojection rays
+   (pixel - pp) / f of rs_deproject_pixel_to_point are tabulated once per column and row. A depth pixel is then registered
+   with a few multiply-adds and the projection, using the same operations as the rsutil.h functions. */
+typedef struct depth_to_color_projection
 {
-    //assert(intrin->model != RS_DISTORTION_MODIFIED_BROWN_CONRADY); // Cannot deproject from a forward-distorted image
-    //assert(intrin->model != RS_DISTORTION_FTHETA); // Cannot deproject to an ftheta image
+    float R[9];     // depth to color extrinsics, column-major
+    float t[3];
+    float k[5];     // color distortion coefficients
+    float fx, fy, ppx, ppy;
+} depth_to_color_projection;
 
-    float x = (pixel[0] - intrin->ppx) / intrin->fx;
-    float y = (pixel[1] - intrin->ppy) / intrin->fy;
-    /* Only non R200 cameras can do this
-    if(intrin->model == RS_DISTORTION_INVERSE_BROWN_CONRADY)
-    {
-        float r2  = x*x + y*y;
-        float f = 1 + intrin->coeffs[0]*r2 + intrin->coeffs[1]*r2*r2 + intrin->coeffs[4]*r2*r2*r2;
-        float ux = x*f + 2*intrin->coeffs[2]*x*y + intrin->coeffs[3]*(r2 + 2*x*x);
-        float uy = y*f + 2*intrin->coeffs[3]*x*y + intrin->coeffs[2]*(r2 + 2*y*y);
-        x = ux;
-        y = uy;
+typedef struct depth_registration
+{
+    bool initialized = false;
+    depth_to_color_projection projection;
+    std::vector<float> rayX;      // (x - ppx) / fx of the depth intrinsics
+    std::vector<float> rayY;      // (y - ppy) / fy of the depth intrinsics
+    std::vector<float> colorX;    // row buffers with the distorted color pixel of each depth pixel
+    std::vector<float> colorY;
+} depth_registration;
+
+static struct depth_registration depthRegistration;
+
+// rs_deproject_pixel_to_point, rs_transform_point_to_point and rs_project_point_to_pixel with the color distortion of rsutil.h in one step
+static inline void ProjectDepthToColor(const depth_to_color_projection & p, float depth_in_meters, float rayX, float rayY, float & colorX, float & colorY)
+{
+    float px = depth_in_meters * rayX;
+    float py = depth_in_meters * rayY;
+    float pz = depth_in_meters;
+
+    float cx = p.R[0] * px + p.R[3] * py + p.R[6] * pz + p.t[0];
+    float cy = p.R[1] * px + p.R[4] * py + p.R[7] * pz + p.t[1];
+    float cz = p.R[2] * px + p.R[5] * py + p.R[8] * pz + p.t[2];
+
+    float u = cx / cz, v = cy / cz;
+    float r2  = u*u + v*v;
+    float f = 1 + p.k[0]*r2 + p.k[1]*r2*r2 + p.k[4]*r2*r2*r2;
+    u *= f;
+    v *= f;
+    float du = u + 2*p.k[2]*u*v + p.k[3]*(r2 + 2*u*u);
+    float dv = v + 2*p.k[3]*u*v + p.k[2]*(r2 + 2*v*v);
+    colorX = du * p.fx + p.ppx;
+    colorY = dv * p.fy + p.ppy;
+}
+
+void InitDepthRegistration(int width, int height)
+{
+    depth_to_color_projection & p = depthRegistration.projection;
+    memcpy(p.R, depth_to_color.rotation, sizeof(p.R));
+    memcpy(p.t, depth_to_color.translation, sizeof(p.t));
+    memcpy(p.k, rgb_intrin.coeffs, sizeof(p.k));
+    p.fx = rgb_intrin.fx;
+    p.fy = rgb_intrin.fy;
+    p.ppx = rgb_intrin.ppx;
+    p.ppy = rgb_intrin.ppy;
+
+    depthRegistration.rayX.resize(width);
+    depthRegistration.rayY.resize(height);
+    depthRegistration.colorX.resize(width);
+    depthRegistration.colorY.resize(width);
+
+    for (int x = 0; x < width; x++) {
+        depthRegistration.rayX[x] = ((float)x - depth_intrin.ppx) / depth_intrin.fx;
+    }
+    for (int y = 0; y < height; y++) {
+        depthRegistration.rayY[y] = ((float)y - depth_intrin.ppy) / depth_intrin.fy;
+    }
+    depthRegistration.initialized = true;
+}
+
+static void CheckDepthRegistration(const cv::Mat & Depth)
+{
+    if (!depthRegistration.initialized || (int)depthRegistration.rayX.size() != Depth.cols || (int)depthRegistration.rayY.size() != Depth.rows) {
+        InitDepthRegistration(Depth.cols, Depth.rows); // the depth frame does not match the received intrinsics
     }
-    */
-    point[0] = depth * x;
-    point[1] = depth * y;
-    point[2] = depth;
 }
 
-/* Given a point in 3D space, compute the corresponding pixel coordinates in an image with no distortion or forward distortion coefficients produced by the same camera */
-static void rs_project_point_to_pixel(float pixel[2], const struct rs_intrinsics * intrin, const float point[3], bool undistort) // only undistort if R200 color image
+void RegisterDepthImage(const cv::Mat & Depth, cv::Mat & registered_depth, cv::Mat & registered_depth2)
 {
-    //assert(intrin->model != RS_DISTORTION_INVERSE_BROWN_CONRADY); // Cannot project to an inverse-distorted image
-    //assert(intrin->model != RS_DISTORTION_FTHETA); // Cannot project to an ftheta image
+    CheckDepthRegistration(Depth);
+
+    const depth_to_color_projection projection = depthRegistration.projection; // local copy, so the stores below can not alias it
+    const float * rayX = depthRegistration.rayX.data();
+    float * colorX = depthRegistration.colorX.data();
+    float * colorY = depthRegistration.colorY.data();
+
+    for (int y = 0; y < Depth.rows; y++) {
+        const float * depthRow = Depth.ptr<float>(y);
+        const float rayY = depthRegistration.rayY[y];
 
-    float x = point[0] / point[2], y = point[1] / point[2];
-    //if(intrin->model == RS_DISTORTION_MODIFIED_BROWN_CONRADY)
-    //{
-    if (undistort) {
+        // branch free over the row, so the compiler can vectorize it
+        for (int x = 0; x < Depth.cols; x++) {
+            ProjectDepthToColor(projection, depthRow[x] / DEPTH_SCALING, rayX[x], rayY, colorX[x], colorY[x]);
+        }
+
+        for (int x = 0; x < Depth.cols; x++) {
+            float depth_in_meters = depthRow[x] / DEPTH_SCALING;
+            // pixels without depth project to wherever the translation alone ends up and carry no information
+            if (depth_in_meters > 0 && colorX[x] >= 0 && colorX[x] < registered_depth.cols && colorY[x] >= 0 && colorY[x] < registered_depth.rows) {
+                registered_depth.at<float>(colorY[x],colorX[x]) = depth_in_meters * DEPTH_SCALING;
+                registered_depth2.at<cv::Vec3f>(colorY[x],colorX[x]) = cv::Vec3f(x, y, depth_in_meters); // store undistorted X/Y depth pixel coordinate + depth (in meters)
+            }
+        }
+    }
+}
+
+/* Back-projects the distorted color pixel (u,v) at the given depth into the depth image - inverse of ProjectDepthToColor */
+static void ProjectColorToDepth(const depth_to_color_projection & p, float u, float v, float depth_in_meters, float & depthX, float & depthY)
+{
+    float xd = (u - p.ppx) / p.fx, yd = (v - p.ppy) / p.fy;
+
+    // The distortion is small, so the fixed point iteration x = x + (xd - distort(x)) converges within a few steps
+    float x = xd, y = yd;
+    for (int i = 0; i < 10; i++) {
         float r2  = x*x + y*y;
-        float f = 1 + intrin->coeffs[0]*r2 + intrin->coeffs[1]*r2*r2 + intrin->coeffs[4]*r2*r2*r2;
-        x *= f;
-        y *= f;
-        float dx = x + 2*intrin->coeffs[2]*x*y + intrin->coeffs[3]*(r2 + 2*x*x);
-        float dy = y + 2*intrin->coeffs[3]*x*y + intrin->coeffs[2]*(r2 + 2*y*y);
-        x = dx;
-        y = dy;
+        float f = 1 + p.k[0]*r2 + p.k[1]*r2*r2 + p.k[4]*r2*r2*r2;
+        float sx = x*f, sy = y*f;
+        x += xd - (sx + 2*p.k[2]*sx*sy + p.k[3]*(r2 + 2*sx*sx));
+        y += yd - (sy + 2*p.k[3]*sx*sy + p.k[2]*(r2 + 2*sy*sy));
     }
-    pixel[0] = x * intrin->fx + intrin->ppx;
-    pixel[1] = y * intrin->fy + intrin->ppy;
+
+    float c[3] = {depth_in_meters * x - p.t[0], depth_in_meters * y - p.t[1], depth_in_meters - p.t[2]};
+    float px = p.R[0] * c[0] + p.R[1] * c[1] + p.R[2] * c[2]; // transposed rotation
+    float py = p.R[3] * c[0] + p.R[4] * c[1] + p.R[5] * c[2];
+    float pz = p.R[6] * c[0] + p.R[7] * c[1] + p.R[8] * c[2];
+
+    depthX = px / pz * depth_intrin.fx + depth_intrin.ppx;
+    depthY = py / pz * depth_intrin.fy + depth_intrin.ppy;
 }
 
-/* Transform 3D coordinates relative to one sensor to 3D coordinates relative to another viewpoint */
-static void rs_transform_point_to_point(float to_point[3], const struct rs_extrinsics * extrin, const float from_point[3])
+/* Registers only the depth pixels landing in the 3x3 color pixels around (u0,v0), window[dy+1][dx+1] holds the value of
+   registered_depth2 at (v0+dy, u0+dx). The color pixel of a depth pixel moves along the epipolar line with the depth, so
+   the depth pixels are searched within the box spanned by the window back-projected at MARKER_DEPTH_MIN and
+   MARKER_DEPTH_MAX. The box is scanned in the same order as the full frame, so the window gets the same values as the
+   full-frame registration, while the cost only depends on the number of markers. */
+void RegisterDepthWindow(const cv::Mat & Depth, int u0, int v0, cv::Vec3f window[3][3])
 {
-    to_point[0] = extrin->rotation[0] * from_point[0] + extrin->rotation[3] * from_point[1] + extrin->rotation[6] * from_point[2] + extrin->translation[0];
-    to_point[1] = extrin->rotation[1] * from_point[0] + extrin->rotation[4] * from_point[1] + extrin->rotation[7] * from_point[2] + extrin->translation[1];
-    to_point[2] = extrin->rotation[2] * from_point[0] + extrin->rotation[5] * from_point[1] + extrin->rotation[8] * from_point[2] + extrin->translation[2];
+    CheckDepthRegistration(Depth);
+    const depth_to_color_projection & projection = depthRegistration.projection;
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            window[i][j] = cv::Vec3f(0, 0, 0);
+        }
+    }
+
+    float xmin = Depth.cols, xmax = -1, ymin = Depth.rows, ymax = -1;
+    const float corners[2][2] = {{(float)(u0-1), (float)(u0+2)}, {(float)(v0-1), (float)(v0+2)}};
+    const float depths[2] = {MARKER_DEPTH_MIN, MARKER_DEPTH_MAX};
+    float depthX, depthY;
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int d = 0; d < 2; d++) {
+                ProjectColorToDepth(projection, corners[0][i], corners[1][j], depths[d], depthX, depthY);
+                xmin = min(xmin, depthX);
+                xmax = max(xmax, depthX);
+                ymin = min(ymin, depthY);
+                ymax = max(ymax, depthY);
+            }
+        }
+    }
+
+    // 2 pixels margin for the truncation to pixels and the inexact inverse distortion
+    int x0 = max((int)floor(xmin) - 2, 0), x1 = min((int)ceil(xmax) + 2, Depth.cols - 1);
+    int y0 = max((int)floor(ymin) - 2, 0), y1 = min((int)ceil(ymax) + 2, Depth.rows - 1);
+
+    float colorX, colorY;
+    int cellX, cellY;
+    for (int y = y0; y <= y1; y++) {
+        const float * depthRow = Depth.ptr<float>(y);
+        const float rayY = depthRegistration.rayY[y];
+        for (int x = x0; x <= x1; x++) {
+            float depth_in_meters = depthRow[x] / DEPTH_SCALING;
+            if (depth_in_meters <= 0) {
+                continue;
+            }
+            ProjectDepthToColor(projection, depth_in_meters, depthRegistration.rayX[x], rayY, colorX, colorY);
+            if (colorX >= 0 && colorX < rgb_intrin.width && colorY >= 0 && colorY < rgb_intrin.height) {
+                cellX = (int)colorX - (u0-1);
+                cellY = (int)colorY - (v0-1);
+                if (cellX >= 0 && cellX < 3 && cellY >= 0 && cellY < 3) {
+                    window[cellY][cellX] = cv::Vec3f(x, y, depth_in_meters);
+                }
+            }
+        }
+    }
 }
 
 /* 2nd order IIR filter
@@ -304,9 +469,10 @@ void MocapVelocityFilter()
         PreviousTimestamp = PoseTimestamp;
 
         if (!Time0.isZero()) { // only log if time is synchronized
-            logAppendTimestamp(MocapVelocityLog, (PoseTimestamp - Time0));
-            MocapVelocityLog << MocapVelocity.format(CSVFmt) << ", " << DroneVelocity.format(CSVFmt) << endl;
-            MocapVelocityLog.flush();
+            ostringstream line;
+            logAppendTimestamp(line, (PoseTimestamp - Time0));
+            line << MocapVelocity.format(CSVFmt) << ", " << DroneVelocity.format(CSVFmt) << endl;
+            queueLogLine(MainLogQueue, &MocapVelocityLog, line);
         }
     } else {
         SkipMeasurement = false;
@@ -354,18 +520,17 @@ void MocapPose_Callback(const geometry_msgs::PoseStamped::ConstPtr& pose) {
 
 
     if (!Time0.isZero()) { // only log if time is synchronized
-        logAppendTimestamp(MocapLog, (pose->header.stamp - Time0));
-        MocapLog << MocapPose.format(CSVFmt) << endl;
-        MocapLog.flush();
+        ostringstream line;
+        logAppendTimestamp(line, (pose->header.stamp - Time0));
+        line << MocapPose.format(CSVFmt) << endl;
+        queueLogLine(MainLogQueue, &MocapLog, line);
     }
 }
 
 // Image Callback
 void Depth_Image_Callback(const sensor_msgs::ImageConstPtr& image) {
     try {
-        cv_bridge::CvImageConstPtr cv_ptr;
-        cv_ptr = cv_bridge::toCvShare(image);
-        cv_ptr->image.convertTo(Depth_Image, CV_32FC1);
+        Depth_Image = cv_bridge::toCvShare(image); // converted to float in the registration stage
         Depth_Image_New = true;
 
         if (!PoseTimestamp.isZero() && Time0.isZero()) { // timestamp synchronization hack
@@ -395,9 +560,7 @@ void Depth_Image_Callback(const sensor_msgs::ImageConstPtr& image) {
 
 void RGB_Image_Callback(const sensor_msgs::ImageConstPtr& image) { // rgb image
     try {
-        cv_bridge::CvImageConstPtr cv_ptr;
-        cv_ptr = cv_bridge::toCvShare(image);
-        cv_ptr->image.copyTo(RGB_Image);
+        RGB_Image = cv_bridge::toCvShare(image);
         RGB_Image_New = true;
 
         if (depth_to_color.initialized && rgb_intrin.initialized && depth_intrin.initialized && RGB_Image_New && Depth_Image_New) {
@@ -413,13 +576,8 @@ void RGB_Image_Callback(const sensor_msgs::ImageConstPtr& image) { // rgb image
 
 void RGBD_Image_Callback(const sensor_msgs::ImageConstPtr& depth_image, const sensor_msgs::ImageConstPtr& rgb_image) {
     try {
-        cv_bridge::CvImageConstPtr cv_ptr;
-        cv_ptr = cv_bridge::toCvShare(rgb_image);
-        cv_ptr->image.copyTo(RGB_Image);
-
-        cv_bridge::CvImageConstPtr cv_ptr2;
-        cv_ptr2 = cv_bridge::toCvShare(depth_image);
-        cv_ptr2->image.convertTo(Depth_Image, CV_32FC1);
+        RGB_Image = cv_bridge::toCvShare(rgb_image);
+        Depth_Image = cv_bridge::toCvShare(depth_image); // converted to float in the registration stage
 
         if (!PoseTimestamp.isZero() && Time0.isZero()) { // timestamp synchronization hack
             ros::Time depthTime = depth_image->header.stamp;
@@ -663,169 +821,553 @@ VectorChiFastSLAMf motionModel(VectorChiFastSLAMf sold, VectorUFastSLAMf* u, flo
 }
 
 
-void ProcessRGBDimage(MeasurementSet * MeasSet)
+/* Visualization of the marker detections, decoupled from the estimation.
+   The detection stage only hands over the data needed for drawing - the color image is shared with the ROS message.
+   The handoff is a single slot which is exchanged atomically: a frame which has not been drawn yet is replaced by the
+   newer one, so the estimation never waits for the drawing, the GUI or a slow display. */
+typedef struct visualization_marker
 {
-    int x, y;
-    char str[200];
-
-    if (RGBD_Image_Ready) {
-//        cout << "Processing RGB data" << endl;
-        cv::Mat RGB;
-        cv::Mat Depth;
-        RGB_Image.copyTo(RGB);
-        Depth_Image.copyTo(Depth);
-
-        RGBD_Image_Ready = false;
-        cv::Mat registered_depth(rgb_intrin.height, rgb_intrin.width, CV_32FC1, cv::Scalar::all(0));
-        cv::Mat registered_depth2(rgb_intrin.height, rgb_intrin.width, CV_32FC3, cv::Scalar::all(0));
-
-        float depth_in_meters;
-        float depth_pixel[2];
-        float depth_point[3], color_point[3], color_pixel[2], registered_pixel[2];
-        cv::Vec3f depthPx;
-
-        for (y = 0; y < Depth.rows; y++) {
-            float* pixel = Depth.ptr<float>(y);  // point to first color in row
-            for (x = 0; x < Depth.cols; x++) {
-                //depth_in_meters = Depth.at<float>(y,x) / 1000.0;  // see http://stackoverflow.com/questions/8932893/accessing-certain-pixel-rgb-value-in-opencv
-                depth_in_meters = *pixel++ / DEPTH_SCALING;
-                depth_pixel[0] = x;
-                depth_pixel[1] = y;
-
-                rs_deproject_pixel_to_point(depth_point, &depth_intrin, depth_pixel, depth_in_meters);
-                rs_transform_point_to_point(color_point, &depth_to_color, depth_point);
-                rs_project_point_to_pixel(color_pixel, &rgb_intrin, color_point, true);
-                rs_project_point_to_pixel(registered_pixel, &rgb_intrin, color_point, false);
-
-                if (color_pixel[0] >= 0 && color_pixel[0] < registered_depth.cols && color_pixel[1] >= 0 && color_pixel[1] < registered_depth.rows) {
-                    registered_depth.at<float>(color_pixel[1],color_pixel[0]) = depth_in_meters * DEPTH_SCALING;
-                    depthPx = cv::Vec3f(depth_pixel[0], depth_pixel[1], depth_in_meters); // store undistorted X/Y depth pixel coordinate + depth (in meters)
-                    registered_depth2.at<cv::Vec3f>(color_pixel[1],color_pixel[0]) = depthPx;
-                }
-            }
+    cv::Point2f point;      // first corner of the marker in the color image
+    cv::Vec3f MarkerMeas;   // cameraX, cameraY, worldZ (depth)
+} visualization_marker;
+
+typedef struct visualization_frame
+{
+    cv_bridge::CvImageConstPtr RGB_Image; // keeps the ROS message of RGB alive
+    cv::Mat RGB;
+    cv::Mat registered_depth;   // empty unless the full frame is registered
+    vector<vector<cv::Point2f> > markerCorners;
+    vector<int> markerIds;
+    vector<visualization_marker> markers;
+} visualization_frame;
+
+class VisualizationThread
+{
+public:
+    VisualizationThread() : slot(NULL), enabled(false), running(false), rate(0) {}
+    ~VisualizationThread() { stop(); }
+
+    void start(float rateHz) // rateHz <= 0 never starts the thread, e.g. on the headless drone
+    {
+        rate = rateHz;
+        if (rate > 0 && !running) {
+            running = true;
+            worker = std::thread(&VisualizationThread::run, this);
+        }
+    }
+
+    void stop()
+    {
+        if (running) {
+            running = false;
+            worker.join();
         }
+        delete slot.exchange(NULL);
+    }
+
+    void setEnabled(bool enable) { enabled = enable; }
+    bool isEnabled() { return enabled && running; }
 
-        // Prepare for display
-        cv::Mat grayBGR;
-        cv::cvtColor(registered_depth, grayBGR, cv::COLOR_GRAY2BGR);
+    void submit(visualization_frame * frame) // takes ownership
+    {
+        delete slot.exchange(frame); // drop the previous frame if it has not been drawn yet
+    }
 
-        cv::Mat normalized;
-        grayBGR.convertTo(normalized, CV_8UC3, 255.0/5000, 0);  // see http://docs.ros.org/diamondback/api/cv_bridge/html/c++/classsensor__msgs_1_1CvBridge.html
+private:
+    std::atomic<visualization_frame*> slot;
+    std::atomic<bool> enabled;
+    std::atomic<bool> running;
+    float rate;
+    std::thread worker;
 
-        if (RGB.cols == normalized.cols) {
-            cv::Mat blended;
+    void run()
+    {
+        // all GUI calls are made from this thread
+        cv::namedWindow("view", CV_WINDOW_KEEPRATIO);
+        std::chrono::duration<double> period(1.0 / rate);
+        while (running) {
+            std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(period);
+            visualization_frame * frame = slot.exchange(NULL);
+            if (frame != NULL) {
+                cv::imshow("view", draw(frame));
+                delete frame;
+            }
+            cv::waitKey(1); // this is necessary to show the image in the view from OpenCV 3
+            std::this_thread::sleep_until(next);
+        }
+        cv::destroyWindow("view");
+    }
+
+    cv::Mat draw(visualization_frame * frame)
+    {
+        char str[200];
+        cv::Mat blended;
 #if OVERLAY_DEPTH
-            cv::addWeighted( normalized, 0.5, RGB_Image, 0.5, 0.0, blended);
+        if (!frame->registered_depth.empty()) {
+            // Prepare for display
+            cv::Mat grayBGR;
+            cv::cvtColor(frame->registered_depth, grayBGR, cv::COLOR_GRAY2BGR);
+
+            cv::Mat normalized;
+            grayBGR.convertTo(normalized, CV_8UC3, 255.0/5000, 0);  // see http://docs.ros.org/diamondback/api/cv_bridge/html/c++/classsensor__msgs_1_1CvBridge.html
+
+            cv::addWeighted( normalized, 0.5, frame->RGB, 0.5, 0.0, blended);
+        } else {
+            frame->RGB.copyTo(blended);
+        }
 #else
-            RGB_Image.copyTo(blended);
+        frame->RGB.copyTo(blended);
 #endif
+        cv::aruco::drawDetectedMarkers(blended, frame->markerCorners, frame->markerIds);
 
-            // Perform Aruco detection
-            vector<int> markerIds;
-            vector<vector<cv::Point2f> > markerCorners, rejectedCandidates;
-            cv::aruco::detectMarkers(RGB, markerDictionary, markerCorners, markerIds);
-            cv::aruco::drawDetectedMarkers(blended, markerCorners, markerIds);
-
-            // Resize image to larger resolution for better text visualization
-            //cv::Size size(4*blended.cols, 4*blended.rows);
-            //cv::resize(blended, blended, size);
-
-//            cout << "Detected markers: " << markerCorners.size() << endl;
-
-            unsigned int ID;
-            int dispX,dispY;
-            vector<cv::Point2f> MarkerPoints;
-            cv::Vec3f MarkerMeas; // cameraX, cameraY, worldZ (depth)
-            float Xmean, Ymean, DepthMean;
-            int ValuesAddedToMeanCount;
-            signed int meanX, meanY;
-            Eigen::Vector3f MarkerMeas_;
-            ImgMeasurement* z_img;
-
-            for (int i = 0; i < markerCorners.size(); i++) {
-                ValuesAddedToMeanCount = 0;
-                Xmean = 0.f;
-                Ymean = 0.f;
-                DepthMean = 0.f;
-                MarkerPoints = markerCorners[i];
-                cv::Point2f point = MarkerPoints[0];                
-                // Get mean depth
-                for (meanY = -1; meanY <= 1; meanY++) {
-                    for (meanX = -1; meanX <= 1; meanX++) {
-                        if ((point.x+meanX >= 0 && point.x+meanX < rgb_intrin.width) && (point.y+meanY >= 0 && point.y+meanY < rgb_intrin.height)) {
-                            MarkerMeas = registered_depth2.at<cv::Vec3f>(point.y+meanY, point.x+meanX);
-                            //cout << MarkerMeas[2] << " ";
-                            if (MarkerMeas[2] > 0) {
-                                Xmean += MarkerMeas[0];
-                                Ymean += MarkerMeas[1];
-                                DepthMean += MarkerMeas[2];
-                                ValuesAddedToMeanCount++;
-                            }
-                        }
-                    }
-                }                
+        // Resize image to larger resolution for better text visualization
+        //cv::Size size(4*blended.cols, 4*blended.rows);
+        //cv::resize(blended, blended, size);
 
-                if (ValuesAddedToMeanCount > 0) {
-                    Xmean = Xmean / (float)ValuesAddedToMeanCount;
-                    Ymean = Ymean / (float)ValuesAddedToMeanCount;
-                    DepthMean = DepthMean / (float)ValuesAddedToMeanCount;
-                }
+        for (int i = 0; i < frame->markers.size(); i++) {
+            int dispX = frame->markers[i].point.x;
+            int dispY = frame->markers[i].point.y;
+            cv::Vec3f MarkerMeas = frame->markers[i].MarkerMeas;
+            cv::Vec3f World = GetWorldCoordinateFromMeasurement(MarkerMeas);
+
+#if VISUALIZE_MEASUREMENT_VECTOR
+            sprintf(str, "X=%1.0f", MarkerMeas[0]);
+            cv::putText(blended, str, cv::Point(dispX+4-10, dispY-12+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255)); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
+            sprintf(str, "Y=%1.0f", MarkerMeas[1]);
+            cv::putText(blended, str, cv::Point(dispX+4-10, dispY+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
+            sprintf(str, "d=%1.3f", MarkerMeas[2]);
+            cv::putText(blended, str, cv::Point(dispX+4-10, dispY+12+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
+
+                /*sprintf(str, "X=%1.0f", MarkerMeas[0]);
+                cv::putText(blended, str, cv::Point(dispX-17, dispY-105), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
+                sprintf(str, "Y=%1.0f", MarkerMeas[1]);
+                cv::putText(blended, str, cv::Point(dispX-17, dispY-60), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3);
+                sprintf(str, "d=%1.3f", MarkerMeas[2]);
+                cv::putText(blended, str, cv::Point(dispX-17, dispY-15), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3);*/
+#elif VISUALIZE_WORLD_MEASUREMENT
+            sprintf(str, "X=%1.3f", World[0]);
+            cv::putText(blended, str, cv::Point(dispX+4, dispY-12+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255)); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
+            sprintf(str, "Y=%1.3f", World[1]);
+            cv::putText(blended, str, cv::Point(dispX+4, dispY+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
+            sprintf(str, "Z=%1.3f", World[2]);
+            cv::putText(blended, str, cv::Point(dispX+4, dispY+12+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
+#endif
+        }
 
-                if (DepthMean > 0) {
-                    MarkerMeas[0] = Xmean;
-                    MarkerMeas[1] = Ymean;
-                    MarkerMeas[2] = DepthMean;
-                    /*MarkerMeas = registered_depth2.at<cv::Vec3f>(point.y, point.x);
-                    if (MarkerMeas[2] > 0) {*/
+        return blended;
+    }
+};
 
-                    MarkerMeas_(0) = MarkerMeas[0];
-                    MarkerMeas_(1) = MarkerMeas[1];
-                    MarkerMeas_(2) = MarkerMeas[2];
+VisualizationThread Visualization;
 
-                    ID = (unsigned int)markerIds[i] + 1; // make sure ID go from 1 and up
+void Visualization_Callback(const std_msgs::Bool::ConstPtr& enable) {
+    Visualization.setEnabled(enable->data);
+    ROS_INFO("Visualization %s", enable->data ? "enabled" : "disabled");
+}
 
-//                    ROS_INFO("Marker ID %u at (%f, %f, %f)", ID, MarkerMeas_(0), MarkerMeas_(1), MarkerMeas_(2));
+MarkerTracker Markers(markerDictionary); // used by the detection stage only, see marker_detection.h
+
+/* Pipelined processing of the RGB-D frames.
+   The stages run on their own threads and are connected by bounded single producer/single consumer queues:
+     ingest (main thread, ROS callbacks) -> registration -> marker detection and measurement build -> filter update (main thread)
+   and all stages hand their log lines to the logging thread. While the filter updates with the measurements of one frame,
+   the next frames are registered and searched for markers, so the frame rate is set by the slowest stage instead of the
+   sum of all stages. A frame is dropped when the queue to the next stage is full, so no stage ever waits for a slower one.
+   Every stage reports its processing time and the latency since the frame was ingested.
+   The frames are taken from a fixed pool and passed on by pointer. A frame shares the ROS messages of its images, so
+   nothing is copied from the callbacks to the detector, and the depth conversion and registration write into buffers
+   which are allocated once and recycled with the frame. */
+#define PIPELINE_FRAME_QUEUE_LENGTH         2       // frames waiting for registration and for detection
+#define PIPELINE_MEASUREMENT_QUEUE_LENGTH   16      // measurement batches waiting for the filter
+#define PIPELINE_REPORT_INTERVAL            5.0     // [s] between the latency reports of every stage
+#define PIPELINE_FRAME_POOL_SIZE            (2*PIPELINE_FRAME_QUEUE_LENGTH + 3) // both queues full and one frame in each stage
+
+typedef struct rgbd_frame
+{
+    cv_bridge::CvImageConstPtr RGB_Image;   // keeps the ROS messages alive while the frame is in the pipeline
+    cv_bridge::CvImageConstPtr Depth_Image;
+    cv::Mat RGB;                // header of RGB_Image
+    cv::Mat Depth;              // depth in CV_32FC1, either the header of Depth_Image or depthBuffer
+    cv::Mat depthBuffer;        // conversion target if the depth does not arrive as CV_32FC1
+    cv::Mat registered_depth;   // only with full-frame registration
+    cv::Mat registered_depth2;
+    ros::Duration timestamp;    // RGBD_Timestamp of the frame
+    float roll, pitch;          // Mocap attitude when the frame was ingested
+    std::chrono::steady_clock::time_point ingestTime;
+} rgbd_frame;
+
+/* Fixed set of frames, acquired by the ingest stage only and released by whichever stage finishes or drops the frame */
+class FramePool
+{
+public:
+    FramePool() { for (int i = 0; i < PIPELINE_FRAME_POOL_SIZE; i++) inUse[i] = false; }
 
-                    z_img = new ImgMeasurement(ID, MarkerMeas_, MocapPose(3), MocapPose(4)); // ID, Marker measurements and include current/latest raw Roll and Pitch measurement (in this case directly from Mocap instead of from the estimator)
-                    MeasSet->addMeasurement(z_img);
+    void allocate(int colorWidth, int colorHeight, int depthWidth, int depthHeight) // before the pipeline is started
+    {
+        for (int i = 0; i < PIPELINE_FRAME_POOL_SIZE; i++) {
+            frames[i].depthBuffer.create(depthHeight, depthWidth, CV_32FC1);
+            if (FullFrameDepthRegistration) {
+                frames[i].registered_depth.create(colorHeight, colorWidth, CV_32FC1);
+                frames[i].registered_depth2.create(colorHeight, colorWidth, CV_32FC3);
+            }
+        }
+    }
 
-                    dispX = point.x;
-                    dispY = point.y;
-                    cv::Vec3f World = GetWorldCoordinateFromMeasurement(MarkerMeas);
+    rgbd_frame * acquire() // NULL if all frames are in the pipeline
+    {
+        for (int i = 0; i < PIPELINE_FRAME_POOL_SIZE; i++) {
+            if (!inUse[i].load(std::memory_order_acquire)) {
+                inUse[i].store(true, std::memory_order_relaxed);
+                return &frames[i];
+            }
+        }
+        return NULL;
+    }
 
-#if VISUALIZE_MEASUREMENT_VECTOR
-                    sprintf(str, "X=%1.0f", MarkerMeas[0]);
-                    cv::putText(blended, str, cv::Point(dispX+4-10, dispY-12+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255)); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
-                    sprintf(str, "Y=%1.0f", MarkerMeas[1]);
-                    cv::putText(blended, str, cv::Point(dispX+4-10, dispY+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
-                    sprintf(str, "d=%1.3f", MarkerMeas[2]);
-                    cv::putText(blended, str, cv::Point(dispX+4-10, dispY+12+4-22), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
-
-                        /*sprintf(str, "X=%1.0f", MarkerMeas[0]);
-                        cv::putText(blended, str, cv::Point(dispX-17, dispY-105), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
-                        sprintf(str, "Y=%1.0f", MarkerMeas[1]);
-                        cv::putText(blended, str, cv::Point(dispX-17, dispY-60), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3);
-                        sprintf(str, "d=%1.3f", MarkerMeas[2]);
-                        cv::putText(blended, str, cv::Point(dispX-17, dispY-15), cv::FONT_HERSHEY_PLAIN, 4, cv::Scalar(0,0,255,255),3);*/
-#elif VISUALIZE_WORLD_MEASUREMENT
-                    sprintf(str, "X=%1.3f", World[0]);
-                    cv::putText(blended, str, cv::Point(dispX+4, dispY-12+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255)); // see http://answers.opencv.org/question/6544/how-can-i-display-timer-results-with-a-c-puttext-command/
-                    sprintf(str, "Y=%1.3f", World[1]);
-                    cv::putText(blended, str, cv::Point(dispX+4, dispY+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
-                    sprintf(str, "Z=%1.3f", World[2]);
-                    cv::putText(blended, str, cv::Point(dispX+4, dispY+12+4), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0,0,255,255));
+    void release(rgbd_frame * frame)
+    {
+        frame->RGB_Image.reset(); // hand the messages back to ROS
+        frame->Depth_Image.reset();
+        frame->RGB = cv::Mat();
+        frame->Depth = cv::Mat();
+        inUse[frame - frames].store(false, std::memory_order_release);
+    }
+
+private:
+    rgbd_frame frames[PIPELINE_FRAME_POOL_SIZE];
+    std::atomic<bool> inUse[PIPELINE_FRAME_POOL_SIZE];
+};
+
+typedef struct marker_measurement
+{
+    unsigned int ID;
+    Eigen::Vector3f z;
+} marker_measurement;
+
+typedef struct measurement_batch
+{
+    vector<marker_measurement> markers;
+    float roll, pitch;
+    std::chrono::steady_clock::time_point ingestTime;
+} measurement_batch;
+
+class StageLatency
+{
+public:
+    StageLatency(const char * name_) : name(name_) { reset(std::chrono::steady_clock::now()); }
+
+    // processing time of one item and its latency since ingest, latency < 0 if the item is not a frame
+    void add(double processing, double latency)
+    {
+        count++;
+        processingSum += processing;
+        processingMax = max(processingMax, processing);
+        if (latency >= 0) {
+            latencyCount++;
+            latencySum += latency;
+            latencyMax = max(latencyMax, latency);
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - reportTime).count() > PIPELINE_REPORT_INTERVAL) {
+            ROS_INFO("Stage %s: %u items, processing %.2f ms mean %.2f ms max, latency %.2f ms mean %.2f ms max, %u dropped",
+                     name, count, 1e3*processingSum/count, 1e3*processingMax,
+                     latencyCount ? 1e3*latencySum/latencyCount : 0.0, 1e3*latencyMax, dropped);
+            reset(now);
+        }
+    }
+
+    void drop() { dropped++; }
+
+private:
+    const char * name;
+    unsigned int count, latencyCount, dropped;
+    double processingSum, processingMax, latencySum, latencyMax;
+    std::chrono::steady_clock::time_point reportTime;
+
+    void reset(std::chrono::steady_clock::time_point now)
+    {
+        count = latencyCount = dropped = 0;
+        processingSum = processingMax = latencySum = latencyMax = 0;
+        reportTime = now;
+    }
+};
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+FramePool Frames;
+SPSCQueue<rgbd_frame*> RegistrationQueue(PIPELINE_FRAME_QUEUE_LENGTH);
+SPSCQueue<rgbd_frame*> DetectionQueue(PIPELINE_FRAME_QUEUE_LENGTH);
+SPSCQueue<measurement_batch> MeasurementQueue(PIPELINE_MEASUREMENT_QUEUE_LENGTH);
+std::atomic<bool> PipelineRunning(false);
+StageLatency IngestLatency("ingest");
+StageLatency FilterLatency("filter");
+
+static void waitForWork()
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+// Ingest stage, called from the main loop after the callbacks have delivered a new RGB-D pair
+void IngestRGBDimage(void)
+{
+    if (!RGBD_Image_Ready) {
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    RGBD_Image_Ready = false;
+
+    rgbd_frame * frame = Frames.acquire();
+    if (frame == NULL) {
+        IngestLatency.drop();
+        IngestLatency.add(secondsSince(start), -1);
+        return;
+    }
+    frame->RGB_Image = RGB_Image; // only the references are taken over
+    frame->Depth_Image = Depth_Image;
+    frame->RGB = RGB_Image->image;
+    frame->timestamp = RGBD_Timestamp;
+    frame->roll = MocapPose(3); // include current/latest raw Roll and Pitch measurement (in this case directly from Mocap instead of from the estimator)
+    frame->pitch = MocapPose(4);
+    frame->ingestTime = start;
+
+    if (!RegistrationQueue.push(frame)) {
+        Frames.release(frame);
+        IngestLatency.drop();
+    }
+    IngestLatency.add(secondsSince(start), -1);
+}
+
+void RegistrationStage(void)
+{
+    StageLatency latency("registration");
+    rgbd_frame * frame;
+
+    while (PipelineRunning) {
+        if (!RegistrationQueue.pop(frame)) {
+            waitForWork();
+            continue;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // the registration tables are only initialized once, before the pipeline is started
+        const cv::Mat & depth = frame->Depth_Image->image;
+        if (depth.cols != (int)depthRegistration.rayX.size() || depth.rows != (int)depthRegistration.rayY.size()) {
+            ROS_WARN_THROTTLE(1, "Depth frame of %dx%d does not match the depth intrinsics - dropped", depth.cols, depth.rows);
+            Frames.release(frame);
+            latency.drop();
+            continue;
+        }
+
+        if (depth.type() == CV_32FC1) {
+            frame->Depth = depth;
+        } else {
+            depth.convertTo(frame->depthBuffer, CV_32FC1); // same size as allocated, so the buffer is reused
+            frame->Depth = frame->depthBuffer;
+        }
+
+        // Otherwise only the depth around the detected markers is registered, see RegisterDepthWindow
+        if (FullFrameDepthRegistration) {
+            frame->registered_depth.setTo(cv::Scalar::all(0));
+            frame->registered_depth2.setTo(cv::Scalar::all(0));
+
+            RegisterDepthImage(frame->Depth, frame->registered_depth, frame->registered_depth2);
+        }
+
+        std::chrono::steady_clock::time_point ingestTime = frame->ingestTime;
+        if (!DetectionQueue.push(frame)) {
+            Frames.release(frame);
+            latency.drop();
+        }
+        latency.add(secondsSince(start), secondsSince(ingestTime));
+    }
+}
+
+void DetectionStage(void)
+{
+    StageLatency latency("detection");
+    rgbd_frame * frame;
+
+    while (PipelineRunning) {
+        if (!DetectionQueue.pop(frame)) {
+            waitForWork();
+            continue;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        if (frame->RGB.cols != rgb_intrin.width) {
+            Frames.release(frame);
+            latency.drop();
+            continue;
+        }
+
+        // Perform Aruco detection
+        vector<int> markerIds;
+        vector<vector<cv::Point2f> > markerCorners, rejectedCandidates;
+        Markers.detect(frame->RGB, markerCorners, markerIds);
+
+//        cout << "Detected markers: " << markerCorners.size() << endl;
+
+        visualization_frame * visualization = NULL;
+        if (Visualization.isEnabled()) {
+            visualization = new visualization_frame;
+            visualization->RGB_Image = frame->RGB_Image;
+            visualization->RGB = frame->RGB;
+#if OVERLAY_DEPTH
+            if (FullFrameDepthRegistration) {
+                visualization->registered_depth = frame->registered_depth.clone(); // the frame buffer is recycled
+            }
 #endif
+            visualization->markerCorners = markerCorners;
+            visualization->markerIds = markerIds;
+        }
+
+        measurement_batch batch;
+        batch.roll = frame->roll;
+        batch.pitch = frame->pitch;
+        batch.ingestTime = frame->ingestTime;
+
+        unsigned int ID;
+        vector<cv::Point2f> MarkerPoints;
+        cv::Vec3f MarkerMeas; // cameraX, cameraY, worldZ (depth)
+        float Xmean, Ymean, DepthMean;
+        int ValuesAddedToMeanCount;
+        signed int meanX, meanY;
+        Eigen::Vector3f MarkerMeas_;
+        cv::Vec3f DepthWindow[3][3];
+
+        for (int i = 0; i < markerCorners.size(); i++) {
+            ValuesAddedToMeanCount = 0;
+            Xmean = 0.f;
+            Ymean = 0.f;
+            DepthMean = 0.f;
+            MarkerPoints = markerCorners[i];
+            cv::Point2f point = MarkerPoints[0];                
+            if (!FullFrameDepthRegistration) {
+                RegisterDepthWindow(frame->Depth, point.x, point.y, DepthWindow);
+            }
+            // Get mean depth
+            for (meanY = -1; meanY <= 1; meanY++) {
+                for (meanX = -1; meanX <= 1; meanX++) {
+                    if ((point.x+meanX >= 0 && point.x+meanX < rgb_intrin.width) && (point.y+meanY >= 0 && point.y+meanY < rgb_intrin.height)) {
+                        if (FullFrameDepthRegistration) {
+                            MarkerMeas = frame->registered_depth2.at<cv::Vec3f>(point.y+meanY, point.x+meanX);
+                        } else {
+                            MarkerMeas = DepthWindow[meanY+1][meanX+1];
+                        }
+                        //cout << MarkerMeas[2] << " ";
+                        if (MarkerMeas[2] > 0) {
+                            Xmean += MarkerMeas[0];
+                            Ymean += MarkerMeas[1];
+                            DepthMean += MarkerMeas[2];
+                            ValuesAddedToMeanCount++;
+                        }
+                    }
+                }
+            }                
+
+            if (ValuesAddedToMeanCount > 0) {
+                Xmean = Xmean / (float)ValuesAddedToMeanCount;
+                Ymean = Ymean / (float)ValuesAddedToMeanCount;
+                DepthMean = DepthMean / (float)ValuesAddedToMeanCount;
+            }
+
+            if (DepthMean > 0) {
+                MarkerMeas[0] = Xmean;
+                MarkerMeas[1] = Ymean;
+                MarkerMeas[2] = DepthMean;
+                /*MarkerMeas = registered_depth2.at<cv::Vec3f>(point.y, point.x);
+                if (MarkerMeas[2] > 0) {*/
 
-                    logAppendTimestamp(CameraLog, RGBD_Timestamp);
-                    CameraLog << ID << ", " << MarkerMeas_.format(CSVFmt) << endl;
+                MarkerMeas_(0) = MarkerMeas[0];
+                MarkerMeas_(1) = MarkerMeas[1];
+                MarkerMeas_(2) = MarkerMeas[2];
+
+                ID = (unsigned int)markerIds[i] + 1; // make sure ID go from 1 and up
+
+//                    ROS_INFO("Marker ID %u at (%f, %f, %f)", ID, MarkerMeas_(0), MarkerMeas_(1), MarkerMeas_(2));
+
+                marker_measurement z_marker;
+                z_marker.ID = ID;
+                z_marker.z = MarkerMeas_;
+                batch.markers.push_back(z_marker);
+
+                if (visualization != NULL) {
+                    visualization_marker marker;
+                    marker.point = point;
+                    marker.MarkerMeas = MarkerMeas;
+                    visualization->markers.push_back(marker);
                 }
+
+                ostringstream line;
+                logAppendTimestamp(line, frame->timestamp);
+                line << ID << ", " << MarkerMeas_.format(CSVFmt) << endl;
+                queueLogLine(CameraLogQueue, &CameraLog, line);
             }
+        }
 
-            CameraLog.flush();
+        if (visualization != NULL) {
+            Visualization.submit(visualization);
+        }
 
-            cv::imshow("view", blended);
+        std::chrono::steady_clock::time_point ingestTime = frame->ingestTime;
+        Frames.release(frame);
 
-            cv::waitKey(1); // this is necessary to show the image in the view from OpenCV 3
+        if (batch.markers.size() > 0 && !MeasurementQueue.push(batch)) {
+            latency.drop();
+        }
+        latency.add(secondsSince(start), secondsSince(ingestTime));
+    }
+}
+
+// Filter stage input, called from the main loop - keeps the newest processed frame for the next filter update. Only one
+// frame is applied per update, a marker seen for the first time in two frames would be added twice to the same set. The
+// older frames are counted as dropped by the filter stage
+void TakeMarkerMeasurements(measurement_batch & pendingBatch, bool & framePending)
+{
+    measurement_batch batch;
+
+    while (MeasurementQueue.pop(batch)) {
+        if (framePending) {
+            FilterLatency.drop();
+        }
+        pendingBatch = std::move(batch);
+        framePending = true;
+    }
+}
+
+void AddMarkerMeasurements(MeasurementSet * MeasSet, const measurement_batch & batch)
+{
+    for (int i = 0; i < batch.markers.size(); i++) {
+        MeasSet->addMeasurement(new ImgMeasurement(batch.markers[i].ID, batch.markers[i].z, batch.roll, batch.pitch));
+    }
+}
+
+void LoggingStage(void)
+{
+    log_line line;
+    bool written;
+
+    while (LoggingRunning || MainLogQueue.size() > 0 || CameraLogQueue.size() > 0) {
+        written = false;
+        while (MainLogQueue.pop(line)) {
+            *line.file << line.text;
+            written = true;
+        }
+        while (CameraLogQueue.pop(line)) {
+            *line.file << line.text;
+            written = true;
+        }
+        if (written) {
+            MocapLog.flush();
+            MocapVelocityLog.flush();
+            MotionModelLog.flush();
+            CameraLog.flush();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
     }
 }
@@ -834,8 +1376,6 @@ void ProcessRGBDimage(MeasurementSet * MeasSet)
 //*** Main ***//
 int main(int argc, char **argv)
 {
-    //std::srand(std::time(0));
-    std::srand(1495718309);
     ros::init(argc, argv, "FastSLAM_node");
     ros::NodeHandle n;
     printf("READY to get image\n");
@@ -923,6 +1463,66 @@ int main(int argc, char **argv)
     GOT_MinSampleTime = Config[7][0];
     cout << "Config.GOT.MinSampleTime = " << GOT_MinSampleTime << endl;
 
+    // rows added after the first configs were written are optional, without them the node behaves as it used to
+    int ParticleUpdateThreads = 1;
+    unsigned int RandomSeed = 1495718309;
+    if (Config.size() > 8 && Config[8].size() >= 2) {
+        ParticleUpdateThreads = Config[8][0]; // 1 = serial update, 0 = use all cores
+        RandomSeed = Config[8][1]; // seeds the particle streams as well as the simulated measurement noise
+    }
+    cout << "Config.ParticleUpdateThreads = " << ParticleUpdateThreads << endl;
+    cout << "Config.RandomSeed = " << RandomSeed << endl;
+    seedDefaultRandomStream(RandomSeed);
+
+    int ResamplingStrategyConfig = 0;
+    float ResamplingNeffThreshold = 1;
+    if (Config.size() > 9 && Config[9].size() >= 2) {
+        ResamplingStrategyConfig = Config[9][0]; // 0 = wheel, 1 = systematic, 2 = stratified, 3 = residual
+        ResamplingNeffThreshold = Config[9][1]; // resample when N_eff < threshold*Nparticles, 1 = resample every step
+    }
+    cout << "Config.ResamplingStrategy = " << ResamplingStrategyConfig << endl;
+    cout << "Config.ResamplingNeffThreshold = " << ResamplingNeffThreshold << endl;
+
+    unsigned int ParticlePathHorizon = 0;
+    if (Config.size() > 10 && Config[10].size() >= 1) {
+        ParticlePathHorizon = Config[10][0]; // number of poses kept per particle path, 0 = unbounded
+    }
+    cout << "Config.ParticlePathHorizon = " << ParticlePathHorizon << endl;
+
+    FullFrameDepthRegistration = true;
+    if (Config.size() > 11 && Config[11].size() >= 1) {
+        FullFrameDepthRegistration = Config[11][0]; // 1 = register the whole depth frame (needed for the depth overlay), 0 = only around the markers
+    }
+    cout << "Config.FullFrameDepthRegistration = " << FullFrameDepthRegistration << endl;
+
+    float VisualizationRate = 30; // the camera frame rate, the window used to show every frame
+    bool VisualizationEnabled = true;
+    if (Config.size() > 12 && Config[12].size() >= 2) {
+        VisualizationRate = Config[12][0]; // [Hz] maximum rate of the view window, 0 = no window at all
+        VisualizationEnabled = Config[12][1]; // can be toggled at runtime on the FastSLAM/visualization topic
+    }
+    cout << "Config.VisualizationRate = " << VisualizationRate << endl;
+    cout << "Config.VisualizationEnabled = " << VisualizationEnabled << endl;
+
+    unsigned int MarkerFullScanInterval = 1;
+    float MarkerSearchMargin = 0.5;
+    if (Config.size() > 13 && Config[13].size() >= 2) {
+        MarkerFullScanInterval = Config[13][0]; // [frames] between full-frame marker scans, 1 = always scan the full frame
+        MarkerSearchMargin = Config[13][1]; // margin of the search region around a tracked marker, relative to its size
+    }
+    cout << "Config.MarkerFullScanInterval = " << MarkerFullScanInterval << endl;
+    cout << "Config.MarkerSearchMargin = " << MarkerSearchMargin << endl;
+    Markers.configure(MarkerFullScanInterval, MarkerSearchMargin);
+
+    int MarkerDetectionDecimation = 1, MarkerCornerRefinementWindow = 0;
+    if (Config.size() > 14 && Config[14].size() >= 2) {
+        MarkerDetectionDecimation = Config[14][0]; // markers are searched in the image downsampled by this factor, 1 = full resolution
+        MarkerCornerRefinementWindow = Config[14][1]; // [px] half size of the sub-pixel corner refinement window, 0 = no refinement
+    }
+    cout << "Config.MarkerDetectionDecimation = " << MarkerDetectionDecimation << endl;
+    cout << "Config.MarkerCornerRefinementWindow = " << MarkerCornerRefinementWindow << endl;
+    Markers.configureDetector(MarkerDetectionDecimation, MarkerCornerRefinementWindow);
+
     // ==== End configuration of FastSLAM ====
 
 
@@ -958,10 +1558,15 @@ int main(int argc, char **argv)
     ConfigureCamera(true); // use auto exposure
     InitHardcodedExtrinsics(); // Hardcoded initialization of Extrinsics, taken from the R200 camera on our Intel Aero drone
 
+    LoggingRunning = true;
+    std::thread loggingThread(LoggingStage); // the Mocap callback logs already while waiting for the intrinsics
+
     // Wait for intrinsics to arrive
     while(ros::ok() && (!depth_to_color.initialized || !rgb_intrin.initialized || !depth_intrin.initialized || Time0.isZero() || ((PoseTimestamp - Time0).toSec() <= 0))) {
         ros::spinOnce();
     }
+    InitDepthRegistration(depth_intrin.width, depth_intrin.height);
+    Frames.allocate(rgb_intrin.width, rgb_intrin.height, depth_intrin.width, depth_intrin.height);
 
     ImgMeasurement::ax = depth_intrin.fx;
     ImgMeasurement::ay = depth_intrin.fy;
@@ -973,6 +1578,10 @@ int main(int argc, char **argv)
     s0 << MocapPose(0), MocapPose(1), MocapPose(2), MocapPose(5); // take starting Mocap Pose as initial particle location
     s_0_Cov = MatrixChiFastSLAMf::Zero(); // motion model covariance is initialized below
     ParticleSet Pset(Nparticles,GOT_MeasurementID,s0,s_0_Cov);
+    Pset.setRandomSeed(RandomSeed);
+    Pset.enableParallelUpdate(ParticleUpdateThreads);
+    Pset.setResampling((ResamplingStrategy)ResamplingStrategyConfig, ResamplingNeffThreshold);
+    Pset.setPathHorizon(ParticlePathHorizon);
     VectorUFastSLAMf u = VectorUFastSLAMf::Zero();
     cout << "Initial particle location: " << endl << s0 << endl;
     // ==== End configuration of FastSLAM ====
@@ -981,8 +1590,14 @@ int main(int argc, char **argv)
     Depth_Image_New = false;
     RGBD_Image_Ready = false;
 
-    cv::namedWindow("view", CV_WINDOW_KEEPRATIO);
-    cv::startWindowThread();
+    Visualization.setEnabled(VisualizationEnabled);
+    Visualization.start(VisualizationRate);
+    ros::Subscriber visualization_sub = n.subscribe<std_msgs::Bool>
+            ("FastSLAM/visualization", 1, Visualization_Callback); // e.g. rostopic pub /FastSLAM/visualization std_msgs/Bool false
+
+    PipelineRunning = true;
+    std::thread registrationThread(RegistrationStage);
+    std::thread detectionThread(DetectionStage);
 
     MeasurementSet MeasSet;
     ros::Duration dt;
@@ -995,11 +1610,14 @@ int main(int argc, char **argv)
     Eigen::MatrixXf noise;
 
     VectorChiFastSLAMf s_k = VectorChiFastSLAMf::Zero();
+    bool FramePending = false; // PendingBatch holds the newest frame not applied yet
+    measurement_batch PendingBatch;
 
     while(ros::ok()){
         ros::spinOnce(); // process the latest measurements in the queue (subscribers) and move these into the RGB_Image and Depth_Image objects
 
-        ProcessRGBDimage(&MeasSet);
+        IngestRGBDimage();
+        TakeMarkerMeasurements(PendingBatch, FramePending);
 
         noise = randn(1,1);
         YawDifference = MocapPose(5) - PreviousYaw + ADDED_YAW_DIFFERENCE_NOISE_SIGMA*noise(0);
@@ -1007,6 +1625,9 @@ int main(int argc, char **argv)
 
         //if (MeasSet.getNumberOfMeasurements() > 0 && dt.toSec() > 0) {
         if (dt.toSec() > 0) {
+           if (FramePending) {
+               AddMarkerMeasurements(&MeasSet, PendingBatch);
+           }
            cout << "Time: " << (PoseTimestamp-Time0).toSec() << endl;
            if ( ((PoseTimestamp-Time0).toSec() < GOT_loss_time[0]) || ((PoseTimestamp-Time0).toSec() > (GOT_loss_time[1])) ) { // simulate time loss of GOT
                 if(!(MocapPose(0)>GOT_loss_xyz[0] && MocapPose(0)<GOT_loss_xyz[1])){  // simulate position loss of GOT
@@ -1040,11 +1661,15 @@ int main(int argc, char **argv)
 
             s_k = motionModel(s_k, &u, dt.toSec());
 
-            logAppendTimestamp(MotionModelLog, (PoseTimestamp - Time0));
-            MotionModelLog << dt.toSec() << ", " << u.format(CSVFmt) << ", " << s_k.format(CSVFmt) << endl;
-            MotionModelLog.flush();
+            ostringstream line;
+            logAppendTimestamp(line, (PoseTimestamp - Time0));
+            line << dt.toSec() << ", " << u.format(CSVFmt) << ", " << s_k.format(CSVFmt) << endl;
+            queueLogLine(MainLogQueue, &MotionModelLog, line);
 
+            std::chrono::steady_clock::time_point updateStart = std::chrono::steady_clock::now();
             Pset.updateParticleSet(&MeasSet, u, dt.toSec());
+            FilterLatency.add(secondsSince(updateStart), FramePending ? secondsSince(PendingBatch.ingestTime) : -1);
+            FramePending = false;
 
             cout << "Pose: " << endl << *(Pset.sMean->getPose()) << endl;
 
@@ -1055,14 +1680,21 @@ int main(int argc, char **argv)
         }
     }
 
+    PipelineRunning = false;
+    registrationThread.join();
+    detectionThread.join();
+
     Pset.saveData();
 
+    LoggingRunning = false;
+    loggingThread.join(); // writes the remaining lines
+
     MocapLog.close();
     CameraLog.close();
     IntrinsicsLog.close();
     MocapVelocityLog.close();
     MotionModelLog.close();
 
-    cv::destroyWindow("view");
+    Visualization.stop(); // joins the visualization thread, which closes the view window
     return 0;
 }
@@ -0,0 +1,89 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "FastSLAM.h"
+
+using namespace std;
+
+// Compares the landmark lookup and correction cost of the pointer based MapTree and the index based IndexedMapTree.
+// Usage: MapBenchmark [Nlandmarks] [Nparticles] [Nlookups]
+
+template<typename MapType, typename MemoryType>
+void benchmarkMap(const char * name, unsigned int Nlandmarks, unsigned int Nparticles, unsigned int Nlookups)
+{
+    MemoryType memory;
+    vector<MapType*> maps;
+    std::mt19937 generator(1);
+    std::uniform_int_distribution<unsigned int> randomID(1, Nlandmarks);
+
+    MapType* firstMap = new MapType(&memory);
+    for (unsigned int c = 1; c <= Nlandmarks; c++) {
+        landmark* li = firstMap->newLandmark();
+        li->c = c;
+        li->lhat = Eigen::Vector3f::Constant(c);
+        li->lCov = Eigen::Matrix3f::Identity();
+        firstMap->insertLandmark(li);
+    }
+    maps.push_back(firstMap);
+
+    // Particles after resampling share most of their map - each copy corrects a few landmarks to break the sharing
+    for (unsigned int i = 1; i < Nparticles; i++) {
+        MapType* copy = new MapType(*maps[generator() % maps.size()]);
+        for (int j = 0; j < 5; j++) {
+            landmark* li = copy->newLandmark();
+            li->c = randomID(generator);
+            li->lhat = Eigen::Vector3f::Constant(li->c + 0.1f*i);
+            li->lCov = Eigen::Matrix3f::Identity();
+            copy->correctLandmark(li);
+        }
+        maps.push_back(copy);
+    }
+
+    vector<unsigned int> IDs(Nlookups);
+    for (unsigned int i = 0; i < Nlookups; i++) {
+        IDs[i] = randomID(generator);
+    }
+
+    float checksum = 0;
+    auto start = chrono::steady_clock::now();
+    for (unsigned int i = 0; i < Nlookups; i++) {
+        checksum += maps[i % Nparticles]->extractLandmarkNodePointer(IDs[i])->lhat(0);
+    }
+    auto lookupEnd = chrono::steady_clock::now();
+
+    for (unsigned int i = 0; i < Nlookups; i++) {
+        MapType* map = maps[i % Nparticles];
+        landmark* li_old = map->extractLandmarkNodePointer(IDs[i]);
+        landmark* li = map->newLandmark();
+        li->c = li_old->c;
+        li->lhat = li_old->lhat;
+        li->lCov = li_old->lCov;
+        map->correctLandmark(li);
+    }
+    auto correctEnd = chrono::steady_clock::now();
+
+    double lookupTime = chrono::duration<double, nano>(lookupEnd - start).count() / Nlookups;
+    double correctTime = chrono::duration<double, nano>(correctEnd - lookupEnd).count() / Nlookups;
+    cout << name << ": lookup " << lookupTime << " ns, correction " << correctTime << " ns (checksum " << checksum << ")" << endl;
+    cout << name << ": nodes in use " << memory.nodes.getNumberInUse() << ", landmarks in use " << memory.landmarks.getNumberInUse() << endl;
+
+    for (unsigned int i = 0; i < maps.size(); i++) {
+        delete maps[i];
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int Nlandmarks = (argc > 1) ? atoi(argv[1]) : 50;
+    unsigned int Nparticles = (argc > 2) ? atoi(argv[2]) : 200;
+    unsigned int Nlookups = (argc > 3) ? atoi(argv[3]) : 1000000;
+
+    cout << "Nlandmarks: " << Nlandmarks << ", Nparticles: " << Nparticles << ", Nlookups: " << Nlookups << endl;
+
+    benchmarkMap<MapTree, MapMemoryPool>("MapTree", Nlandmarks, Nparticles, Nlookups);
+    benchmarkMap<IndexedMapTree, IndexedMapArena>("IndexedMapTree", Nlandmarks, Nparticles, Nlookups);
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <ctime>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "marker_detection.h"
+
+using namespace std;
+
+// Compares the full resolution marker detection of FastSLAM_node with the decimated search + sub-pixel refinement on
+// recorded color frames, e.g. extracted from a bag with: rosrun image_view extract_images image:=/camera/rgb/image_raw
+// The reference are the markers found at full resolution with sub-pixel refinement. For every mode the detection rate
+// and the corner error are reported against the reference, together with the CPU time per frame on one core.
+// Usage: MarkerBenchmark <image directory> [refine window] [decimation factors...]
+//   MarkerBenchmark frames 5 2 3 4
+
+typedef struct benchmark_result
+{
+    unsigned int detected;      // markers with an ID of the reference
+    unsigned int falsePositive; // markers with an ID not in the reference
+    double cornerErrorSum;      // squared corner errors [px^2]
+    double cornerErrorMax;
+    double cpuTime;             // [s]
+} benchmark_result;
+
+void detectAll(MarkerDetector & detector, const vector<cv::Mat> & images,
+               vector<vector<vector<cv::Point2f> > > & corners, vector<vector<int> > & ids, double & cpuTime)
+{
+    corners.resize(images.size());
+    ids.resize(images.size());
+    clock_t start = clock();
+    for (int f = 0; f < images.size(); f++) {
+        detector.detect(images[f], corners[f], ids[f]);
+    }
+    cpuTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+void compare(const vector<vector<vector<cv::Point2f> > > & refCorners, const vector<vector<int> > & refIds,
+             const vector<vector<vector<cv::Point2f> > > & corners, const vector<vector<int> > & ids, benchmark_result & result)
+{
+    result.detected = result.falsePositive = 0;
+    result.cornerErrorSum = result.cornerErrorMax = 0;
+    for (int f = 0; f < ids.size(); f++) {
+        for (int k = 0; k < ids[f].size(); k++) {
+            int r;
+            for (r = 0; r < refIds[f].size() && refIds[f][r] != ids[f][k]; r++);
+            if (r == refIds[f].size()) {
+                result.falsePositive++;
+                continue;
+            }
+            result.detected++;
+            for (int j = 0; j < 4; j++) {
+                cv::Point2f d = corners[f][k][j] - refCorners[f][r][j];
+                double e2 = d.x*d.x + d.y*d.y;
+                result.cornerErrorSum += e2;
+                result.cornerErrorMax = max(result.cornerErrorMax, sqrt(e2));
+            }
+        }
+    }
+}
+
+void printResult(const string & name, const benchmark_result & result, unsigned int refMarkers, unsigned int frames)
+{
+    cout << name
+         << ": detected " << result.detected << "/" << refMarkers
+         << " (" << (refMarkers ? 100.0 * result.detected / refMarkers : 0.0) << " %)"
+         << ", false positives " << result.falsePositive
+         << ", corner RMS " << (result.detected ? sqrt(result.cornerErrorSum / (4 * result.detected)) : 0.0) << " px"
+         << ", max " << result.cornerErrorMax << " px"
+         << ", CPU " << 1e3 * result.cpuTime / frames << " ms/frame" << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        cout << "Usage: " << argv[0] << " <image directory> [refine window] [decimation factors...]" << endl;
+        return -1;
+    }
+    int refineWindow = (argc > 2) ? atoi(argv[2]) : 5;
+    vector<int> decimations;
+    for (int i = 3; i < argc; i++) {
+        decimations.push_back(atoi(argv[i]));
+    }
+    if (decimations.empty()) {
+        decimations.push_back(2);
+        decimations.push_back(3);
+    }
+
+    vector<cv::String> files, jpgFiles;
+    cv::glob(string(argv[1]) + "/*.png", files);
+    cv::glob(string(argv[1]) + "/*.jpg", jpgFiles);
+    files.insert(files.end(), jpgFiles.begin(), jpgFiles.end());
+
+    vector<cv::Mat> images;
+    for (int i = 0; i < files.size(); i++) {
+        cv::Mat image = cv::imread(files[i], CV_LOAD_IMAGE_COLOR);
+        if (!image.empty()) {
+            images.push_back(image);
+        }
+    }
+    if (images.empty()) {
+        cout << "No images found in " << argv[1] << endl;
+        return -1;
+    }
+    cv::setNumThreads(1); // CPU time per core, independent of the OpenCV thread pool
+
+    MarkerDetector detector(cv::aruco::getPredefinedDictionary(cv::aruco::DICT_4X4_50)); // same dictionary as FastSLAM_node
+    vector<vector<vector<cv::Point2f> > > refCorners, corners;
+    vector<vector<int> > refIds, ids;
+    benchmark_result result;
+
+    detector.configure(1, refineWindow);
+    detectAll(detector, images, refCorners, refIds, result.cpuTime);
+    unsigned int refMarkers = 0;
+    for (int f = 0; f < refIds.size(); f++) {
+        refMarkers += refIds[f].size();
+    }
+    cout << images.size() << " frames " << images[0].cols << "x" << images[0].rows << ", " << refMarkers
+         << " markers in the reference, refine window " << refineWindow << " px" << endl;
+    compare(refCorners, refIds, refCorners, refIds, result);
+    printResult("full resolution + refinement (reference)", result, refMarkers, images.size());
+
+    detector.configure(1, 0);
+    detectAll(detector, images, corners, ids, result.cpuTime);
+    compare(refCorners, refIds, corners, ids, result);
+    printResult("full resolution (FastSLAM_node default)", result, refMarkers, images.size());
+
+    for (int i = 0; i < decimations.size(); i++) {
+        detector.configure(decimations[i], refineWindow);
+        detectAll(detector, images, corners, ids, result.cpuTime);
+        compare(refCorners, refIds, corners, ids, result);
+        printResult("decimation " + to_string(decimations[i]) + " + refinement", result, refMarkers, images.size());
+    }
+
+    return 0;
+}
@@ -188,6 +188,7 @@ int main(int argc, char **argv)
 
     cout << "globalLandmarkCounter: " << landmark::globalLandmarkCounter << endl;
     cout << "globalMapNodeCounter: " << mapNode::globalMapNodeCounter << endl;
+    Pset->printMapPoolUsage();
 
     k++;
     }
@@ -21,6 +21,7 @@
 
 
 #include "utils.h"
+#include "state_feedback.h"
 
 /* Include Files */
 #include <stddef.h>
@@ -100,189 +101,87 @@ std::vector<double> vectorAdd(std::vector<double> a,std::vector<double> b)
     return tmp;
 }
 
-class Matrix{
- public:
-    std::vector<std::vector<double> > data;
-    Matrix(uint8_T cols,uint8_T rows);
-    void setEntry(double value,uint8_T col,uint8_T row);
-    double getEntry(uint8_T col,uint8_T row);
-    void printMatrix();
-    std::vector<double> multiplyVector(std::vector<double> input);
-    uint8_T cols,rows;
-};
-Matrix::Matrix(uint8_T cols, uint8_T rows)
-{
-    std::vector<std::vector<double> > tmp(cols, std::vector<double>(rows));
-    this->data = tmp;
-    this->cols = cols;
-    this->rows = rows;
-}
-void Matrix::setEntry(double value,uint8_T col, uint8_T row)
-{
-    if(col<this->cols && row < this->rows)
-    {
-        data[col][row] = value;
-    }
-    else
-    {
-        ROS_ERROR("Assigning values to a non existing entry Matrix::setEntry()");
-    }
-}
-double Matrix::getEntry(uint8_T col, uint8_T row)
-{
-    if(col<this->cols && row < this->rows)
-    {
-        return data[col][row];
-    }
-    else
-    {
-        ROS_ERROR("Assigning values to a non existing entry Matrix::setEntry()");
-        return -1;
-    }
-}
-void Matrix::printMatrix()
-{
-    uint16_T i = 0;
-    uint16_T k = 0;
-    for(i=0;i<this->cols;i++)
-    {
-        for(k=0;k<this->rows;k++)
-        {
-            std::cout << this->data[i][k] << " ";
-        }
-        std::cout << "\n";
-    }
-}
-std::vector<double> Matrix::multiplyVector(std::vector<double> input)
-{
-    uint16_T i = 0;
-    uint16_T k = 0;
-    std::vector<double> output;
-    output.assign(this->data.size(),0); // create output vector with the samme number of rows as the matrix
-    if(input.size() == this->data[0].size())
-    {
-        for(i=0;i<this->cols;i++)
-        {
-            for(k=0;k<this->rows;k++)
-            {
-                output[i] += this->data[i][k]*input[k];
-                //std::cout << i << " " << this->data[i][k] << "*" << input[k] << " " << output[i] << "\n";
-            }
-        }
-    }
-    return output;
-}
+// LQR designs, the gains and the EKF states they act on (see state_feedback.h)
+static constexpr StateFeedback<3> zDesign = { {{ -1*0.2335, -1*0.1838, -1*0.1367 }},
+                                              {{ 13, 14, 15 }} };
+static constexpr StateFeedback<6> xDesign = { {{ -1*0.1910, -1*0.2438, -1*0.0912, -1*-0.0358, -1*-0.0315, -1*-0.0092 }},
+                                              {{ 0, 2, 3, 4, 5, 6 }} };
+static constexpr StateFeedback<6> yDesign = { {{ -1*-0.1908, -1*-0.2412, -1*0.0929, -1*-0.0246, -1*0.0004, -1*0.0058 }},
+                                              {{ 1, 7, 8, 9, 10, 11 }} };
 
+template<std::size_t N>
 class Zcontroller{
     public:
-        double update(double setpoint,double *estimatedZStates);
+        double update(double setpoint,const double *estimatedZStates);
         void reset();
-        Zcontroller(); //constructor
-        std::vector<double> thrust;
-        Matrix gainZcontroller;
+        explicit Zcontroller(const StateFeedback<N> &design); //constructor
+        double thrust;
 
     private:
-        std::vector<double> zStates;
-
-
+        const StateFeedback<N> design;
 };
-Zcontroller::Zcontroller() :
-    // Member initializer list //    
-    gainZcontroller(1,3)
-
-{   // Contructor decleration //            
-    gainZcontroller.setEntry(-1*0.2335*1,0,0);
-    gainZcontroller.setEntry(-1*0.1838*1,0,1);
-    gainZcontroller.setEntry(-1*0.1367*1,0,2);    
-    thrust.assign(1,0);
-    zStates.assign(3,0);
+template<std::size_t N>
+Zcontroller<N>::Zcontroller(const StateFeedback<N> &design) :
+    // Member initializer list //
+    thrust(0),
+    design(design)
+{
 }
 
-double Zcontroller::update(double setpoint,double *estimatedZStates)
+template<std::size_t N>
+double Zcontroller<N>::update(double setpoint,const double *estimatedZStates)
 {
-    zStates[0] = estimatedZStates[13]-setpoint;
-    zStates[1] = estimatedZStates[14];
-    zStates[2] = estimatedZStates[15];
-
-    //Saturate the tracking error to 1 meter.
-    if(zStates[0]> 1){zStates[0] = 1;}
-    if(zStates[0]< -1){zStates[0] = -1;}
-
-    thrust = gainZcontroller.multiplyVector(zStates);
-    thrust[0] = thrust[0] - estimatedZStates[16] + 0.587;
+    thrust = design.feedback(estimatedZStates, setpoint);
+    thrust = thrust - estimatedZStates[16] + 0.587;
     
-    if(thrust[0]>0.7)
+    if(thrust>0.7)
     {
-        thrust[0] = 0.7;
+        thrust = 0.7;
     }
-    else if(thrust[0]<0.3)
+    else if(thrust<0.3)
     {
-        thrust[0] = 0.3;
+        thrust = 0.3;
     }
-    return thrust[0];
+    return thrust;
 }
-void Zcontroller::reset(void)
+template<std::size_t N>
+void Zcontroller<N>::reset(void)
 {
-    this->thrust[0] = 0.587;
+    this->thrust = 0.587;
 }
+template<std::size_t N>
 class stateFeedbackController{
     public:
-        void update(double setpoint[],double *meas);
+        void update(double setpoint[],const double *meas);
         void reset();
-        std::vector<double> output;
-        Matrix Kx;
-        Matrix Ky;
-        stateFeedbackController(); //constructor
+        std::array<double, 2> output;
+        stateFeedbackController(const StateFeedback<N> &xDesign,const StateFeedback<N> &yDesign); //constructor
     private:
-        std::vector<double> Xstates;
-        std::vector<double> Ystates;
+        const StateFeedback<N> Kx;
+        const StateFeedback<N> Ky;
 };
-stateFeedbackController::stateFeedbackController() :
-    // Member initializer list //        
-    Kx(1,6),
-    Ky(1,6)
-
-{   // Contructor decleration //
-    output.assign(2,0);
-    Xstates.assign(6,0);
-    Ystates.assign(6,0);
+template<std::size_t N>
+stateFeedbackController<N>::stateFeedbackController(const StateFeedback<N> &xDesign,const StateFeedback<N> &yDesign) :
+    // Member initializer list //
+    output(),
+    Kx(xDesign),
+    Ky(yDesign)
+{
 }
 
-void stateFeedbackController::reset()
+template<std::size_t N>
+void stateFeedbackController<N>::reset()
 {
     output[0] = 0;
     output[1] = 0;
 }
 
-void stateFeedbackController::update(double setpoint[],double *meas)
+template<std::size_t N>
+void stateFeedbackController<N>::update(double setpoint[],const double *meas)
 {
-    Xstates[0] = meas[0]-(cos(meas[12])*setpoint[0] + sin(meas[12])*setpoint[1]);
-    Xstates[1] = meas[2];
-    Xstates[2] = meas[3];
-    Xstates[3] = meas[4];
-    Xstates[4] = meas[5];
-    Xstates[5] = meas[6];
-    Ystates[0] = meas[1] - (-sin(meas[12])*setpoint[0] + cos(meas[12])*setpoint[1]);
-    Ystates[1] = meas[7];
-    Ystates[2] = meas[8];
-    Ystates[3] = meas[9];
-    Ystates[4] = meas[10];
-    Ystates[5] = meas[11];
-
-    //Saturate the tracking error to 1 meter.
-    if(Xstates[0]> 1){Xstates[0] = 1;}
-    if(Xstates[0]< -1){Xstates[0] = -1;}
-    if(Ystates[0]> 1){Ystates[0] = 1;}
-    if(Ystates[0]< -1){Ystates[0] = -1;}
-
-
-    std::vector<double>tmp;
-
-    tmp = Kx.multiplyVector(Xstates);
-    output[0] = tmp[0] +meas[17];
-
-    tmp = Ky.multiplyVector(Ystates);
-    output[1] =tmp[0]+meas[18];
+    // setpoint in the body frame
+    output[0] = Kx.feedback(meas, cos(meas[12])*setpoint[0] + sin(meas[12])*setpoint[1]) +meas[17];
+    output[1] = Ky.feedback(meas, -sin(meas[12])*setpoint[0] + cos(meas[12])*setpoint[1]) +meas[18];
 
     if(std::isnan(output[0]) == 1){output[0] = 0;}
     if(std::isnan(output[1]) == 1){output[1] = 0;}
@@ -329,26 +228,10 @@ struct waypoint
 
 int main(int argc, char **argv)
 {    
-    Zcontroller zcontroller;
+    Zcontroller<zDesign.K.size()> zcontroller(zDesign);
 
     /////////////////  xy CONTROLLER ///////////////
-    stateFeedbackController xyController;
-
-    xyController.Kx.setEntry(-1*0.1910*1.0,0,0);
-    xyController.Kx.setEntry(-1*0.2438*1.0,0,1);
-    xyController.Kx.setEntry(-1*0.0912,0,2);
-    xyController.Kx.setEntry(-1*-0.0358,0,3);
-    xyController.Kx.setEntry(-1*-0.0315,0,4);
-    xyController.Kx.setEntry(-1*-0.0092,0,5);
-
-    xyController.Ky.setEntry(-1*-0.1908*1.0,0,0);
-    xyController.Ky.setEntry(-1*-0.2412*1.0,0,1);
-    xyController.Ky.setEntry(-1*0.0929,0,2);
-    xyController.Ky.setEntry(-1*-0.0246,0,3);
-    xyController.Ky.setEntry(-1*0.0004,0,4);
-    xyController.Ky.setEntry(-1*0.0058,0,5);
-
-   
+    stateFeedbackController<xDesign.K.size()> xyController(xDesign, yDesign);
     ////////////////////////////////////////////////
 
     double estimatedStates[19];
@@ -521,7 +404,7 @@ int main(int argc, char **argv)
 		
         if(current_state.mode == "OFFBOARD" && current_state.armed)
         {
-            ekf(1,fastslamMeas,covariansfastslam,PX4Meas,xyController.output[1]-estimatedStates[18]*1,xyController.output[0]-estimatedStates[17]*1,yawRef,zcontroller.thrust[0],estimatedStates,covariansVelocities,&VarYaw);
+            ekf(1,fastslamMeas,covariansfastslam,PX4Meas,xyController.output[1]-estimatedStates[18]*1,xyController.output[0]-estimatedStates[17]*1,yawRef,zcontroller.thrust,estimatedStates,covariansVelocities,&VarYaw);
             
             xyController.update(setpoints,estimatedStates);
 
@@ -580,7 +463,7 @@ int main(int argc, char **argv)
             //ekf(1,fastslamMeas,covariansfastslam,PX4Meas,0,0,yaw,0.587,estimatedStates,covariansVelocities,&VarYaw);
 
             zcontroller.reset();
-            thrustInput.data = zcontroller.thrust[0];
+            thrustInput.data = zcontroller.thrust;
             xyController.reset();
             setpoints[0] = position.pose.position.x;
             setpoints[1] = position.pose.position.y;
@@ -639,8 +522,8 @@ int main(int argc, char **argv)
 
         thrust_pub.publish(thrustInput);
 
-        //logToFile("/home/joan/flightlog.txt","%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",estimatedStates[0],estimatedStates[1],estimatedStates[2],estimatedStates[3],estimatedStates[4],estimatedStates[5],estimatedStates[6],estimatedStates[7],estimatedStates[8],estimatedStates[9],estimatedStates[10],estimatedStates[11],estimatedStates[12],estimatedStates[13],estimatedStates[14],estimatedStates[15],position.pose.position.x,position.pose.position.y,position.pose.position.z,pitch,roll,yaw,xyController.output[0],xyController.output[1],zcontroller.thrust[0],setpoints[0],setpoints[1],setpoints[2],twist.linear.x,twist.linear.y,twist.linear.z,imuPitch,imuRoll,yawRef,estimatedStates[16],estimatedStates[17],estimatedStates[18]);
-        //logToFile("/home/chris/Dropbox/P8 (CA2)/Controller/logs/reportxylog15.txt","%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",estimatedStates[0],estimatedStates[1],estimatedStates[2],estimatedStates[3],estimatedStates[4],estimatedStates[5],estimatedStates[6],estimatedStates[7],estimatedStates[8],estimatedStates[9],estimatedStates[10],estimatedStates[11],estimatedStates[12],estimatedStates[13],estimatedStates[14],estimatedStates[15],position.pose.position.x,position.pose.position.y,position.pose.position.z,pitch,roll,yaw,xyController.output[0],xyController.output[1],zcontroller.thrust[0],setpoints[0],setpoints[1],setpoints[2],twist.linear.x,twist.linear.y,twist.linear.z,imuPitch,imuRoll,yawRef,estimatedStates[16],estimatedStates[17],estimatedStates[18]);
+        //logToFile("/home/joan/flightlog.txt","%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",estimatedStates[0],estimatedStates[1],estimatedStates[2],estimatedStates[3],estimatedStates[4],estimatedStates[5],estimatedStates[6],estimatedStates[7],estimatedStates[8],estimatedStates[9],estimatedStates[10],estimatedStates[11],estimatedStates[12],estimatedStates[13],estimatedStates[14],estimatedStates[15],position.pose.position.x,position.pose.position.y,position.pose.position.z,pitch,roll,yaw,xyController.output[0],xyController.output[1],zcontroller.thrust,setpoints[0],setpoints[1],setpoints[2],twist.linear.x,twist.linear.y,twist.linear.z,imuPitch,imuRoll,yawRef,estimatedStates[16],estimatedStates[17],estimatedStates[18]);
+        //logToFile("/home/chris/Dropbox/P8 (CA2)/Controller/logs/reportxylog15.txt","%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",estimatedStates[0],estimatedStates[1],estimatedStates[2],estimatedStates[3],estimatedStates[4],estimatedStates[5],estimatedStates[6],estimatedStates[7],estimatedStates[8],estimatedStates[9],estimatedStates[10],estimatedStates[11],estimatedStates[12],estimatedStates[13],estimatedStates[14],estimatedStates[15],position.pose.position.x,position.pose.position.y,position.pose.position.z,pitch,roll,yaw,xyController.output[0],xyController.output[1],zcontroller.thrust,setpoints[0],setpoints[1],setpoints[2],twist.linear.x,twist.linear.y,twist.linear.z,imuPitch,imuRoll,yawRef,estimatedStates[16],estimatedStates[17],estimatedStates[18]);
         last_request1 = ros::Time::now();
         ros::spinOnce();
         rate.sleep();
@@ -0,0 +1,147 @@
+#include "marker_detection.h"
+
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace std;
+
+void MarkerDetector::configure(int decimation_, int refineWindow_)
+{
+    decimation = max(decimation_, 1);
+    refineWindow = max(refineWindow_, 0);
+}
+
+void MarkerDetector::detect(const cv::Mat & image, vector<vector<cv::Point2f> > & markerCorners, vector<int> & markerIds)
+{
+    if (decimation <= 1) {
+        cv::aruco::detectMarkers(image, dictionary, markerCorners, markerIds);
+    } else {
+        cv::resize(image, decimated, cv::Size(image.cols / decimation, image.rows / decimation), 0, 0, cv::INTER_AREA);
+        cv::aruco::detectMarkers(decimated, dictionary, markerCorners, markerIds);
+
+        // pixel centers of the decimated image lie in the middle of decimation x decimation blocks
+        const float scale = (float)decimation, offset = 0.5f * (decimation - 1);
+        for (int i = 0; i < markerCorners.size(); i++) {
+            for (int j = 0; j < markerCorners[i].size(); j++) {
+                markerCorners[i][j] = markerCorners[i][j] * scale + cv::Point2f(offset, offset);
+            }
+        }
+    }
+
+    if (refineWindow > 0) {
+        for (int i = 0; i < markerCorners.size(); i++) {
+            refineCorners(image, markerCorners[i]);
+        }
+    }
+}
+
+void MarkerDetector::refineCorners(const cv::Mat & image, vector<cv::Point2f> & corners)
+{
+    // cornerSubPix needs the window plus one pixel for the gradients around every corner
+    int margin = refineWindow + 2;
+    cv::Rect box = cv::boundingRect(corners);
+    box = cv::Rect(box.x - margin, box.y - margin, box.width + 2*margin, box.height + 2*margin) & cv::Rect(0, 0, image.cols, image.rows);
+    if (box.area() == 0) {
+        return;
+    }
+
+    if (image.channels() == 3) {
+        cv::cvtColor(image(box), gray, cv::COLOR_BGR2GRAY);
+    } else {
+        image(box).copyTo(gray);
+    }
+
+    cv::Point2f origin(box.x, box.y);
+    for (int j = 0; j < corners.size(); j++) {
+        corners[j] -= origin;
+    }
+    cv::cornerSubPix(gray, corners, cv::Size(refineWindow, refineWindow), cv::Size(-1, -1),
+                     cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01));
+    for (int j = 0; j < corners.size(); j++) {
+        corners[j] += origin;
+    }
+}
+
+void MarkerTracker::configure(unsigned int fullScanInterval_, float marginScale_)
+{
+    fullScanInterval = fullScanInterval_;
+    marginScale = marginScale_;
+}
+
+void MarkerTracker::detect(const cv::Mat & image, vector<vector<cv::Point2f> > & markerCorners, vector<int> & markerIds)
+{
+    markerCorners.clear();
+    markerIds.clear();
+    frameCount++;
+
+    bool fullScan = tracks.empty() || trackLost || fullScanInterval <= 1 || (frameCount - lastFullScan) >= fullScanInterval;
+    if (fullScan) {
+        detector.detect(image, markerCorners, markerIds);
+        lastFullScan = frameCount;
+    } else {
+        cv::Rect imageRect(0, 0, image.cols, image.rows);
+        vector<cv::Point2f> predicted(4);
+        vector<vector<cv::Point2f> > roiCorners;
+        vector<int> roiIds;
+
+        for (int i = 0; i < tracks.size(); i++) {
+            for (int j = 0; j < 4; j++) {
+                predicted[j] = tracks[i].corners[j] + tracks[i].velocity;
+            }
+            cv::Rect box = cv::boundingRect(predicted);
+            int margin = max(MARKER_TRACK_MIN_MARGIN, (int)(marginScale * max(box.width, box.height) + cv::norm(tracks[i].velocity)));
+            cv::Rect roi = cv::Rect(box.x - margin, box.y - margin, box.width + 2*margin, box.height + 2*margin) & imageRect;
+            if (roi.area() == 0) {
+                continue;
+            }
+
+            detector.detect(image(roi), roiCorners, roiIds); // image(roi) is a header, nothing is copied
+            for (int k = 0; k < roiIds.size(); k++) {
+                if (find(markerIds.begin(), markerIds.end(), roiIds[k]) != markerIds.end()) {
+                    continue; // found in an overlapping region already
+                }
+                for (int j = 0; j < 4; j++) {
+                    roiCorners[k][j] += cv::Point2f(roi.x, roi.y);
+                }
+                markerIds.push_back(roiIds[k]);
+                markerCorners.push_back(roiCorners[k]);
+            }
+        }
+    }
+
+    updateTracks(markerCorners, markerIds, fullScan);
+}
+
+static cv::Point2f markerCenter(const vector<cv::Point2f> & corners)
+{
+    return 0.25f * (corners[0] + corners[1] + corners[2] + corners[3]);
+}
+
+void MarkerTracker::updateTracks(const vector<vector<cv::Point2f> > & markerCorners, const vector<int> & markerIds, bool fullScan)
+{
+    for (int k = 0; k < markerIds.size(); k++) {
+        int i;
+        for (i = 0; i < tracks.size() && tracks[i].ID != markerIds[k]; i++);
+        if (i == tracks.size()) {
+            marker_track track;
+            track.ID = markerIds[k];
+            track.velocity = cv::Point2f(0, 0);
+            tracks.push_back(track);
+        } else if (tracks[i].lastSeen + 1 == frameCount) {
+            tracks[i].velocity = markerCenter(markerCorners[k]) - markerCenter(tracks[i].corners);
+        } else {
+            tracks[i].velocity = cv::Point2f(0, 0);
+        }
+        tracks[i].corners = markerCorners[k];
+        tracks[i].lastSeen = frameCount;
+    }
+
+    // a marker missing from its region may have moved further than predicted, so it is searched in the full frame
+    trackLost = false;
+    for (int i = tracks.size() - 1; i >= 0; i--) {
+        if (tracks[i].lastSeen != frameCount) {
+            trackLost = trackLost || !fullScan;
+            tracks.erase(tracks.begin() + i);
+        }
+    }
+}
@@ -18,16 +18,286 @@
 #include "uunwrap.h"
 
 // Variable Definitions
-static double refState;
-static double refOldinput;
-static double states[19];
-static double P[361];
+// the filter behind ekf() and ekf_init(), further filters are created with
+// ekf_create() and only share the read-only model below
+static ekf_state_t defaultState;
+
+// state transition matrix A of the linear model (column major)
+static const double c_a[361] = { 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0477,
+  0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0907, 1.1869, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.091, -0.3037, 0.0, 1.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  -0.1452, 0.1289, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, -0.1045, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0477, 0.0, 0.0, 0.0, 0.0, 0.0,
+  1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, -0.4027, 0.261, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.197, 0.2374, 0.0, 1.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0828,
+  0.1581, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0646, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.944, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0473, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.7913, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+  0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 };
+
+// Sparse covariance propagation
+// The state transition matrix A has at most four nonzeros per row (the x, y,
+// z and yaw subsystems and the biases), and I - K*H only differs from the
+// identity in the columns measured by H. The products below visit only the
+// nonzero entries, in the same order as the dense MATLAB Coder loops, which
+// only add exact zeros in between - the results are bit-identical.
+// EKF_DENSE_PROPAGATION 1 selects the generated dense loops (see EKFCheck).
+#ifndef EKF_DENSE_PROPAGATION
+#define EKF_DENSE_PROPAGATION 0
+#endif
+
+typedef struct {
+  int nnz[19];        // nonzeros of every row
+  int col[19][19];    // their columns in increasing order
+  double val[19][19]; // and their values
+} SparseRows;
+
+// constants of the model, the same for all filters
+typedef struct {
+  double H_fs0[76];
+  double H_PX40[57];
+  SparseRows A_rows;
+} EkfModel;
+
+//
+// Arguments    : const double M[361] (column major)
+//                SparseRows *rows
+// Return Type  : void
+//
+static void findRowNonzeros(const double M[361], SparseRows *rows)
+{
+  int i;
+  int k;
+  for (i = 0; i < 19; i++) {
+    rows->nnz[i] = 0;
+    for (k = 0; k < 19; k++) {
+      if (M[i + 19 * k] != 0.0) {
+        rows->col[i][rows->nnz[i]] = k;
+        rows->val[i][rows->nnz[i]] = M[i + 19 * k];
+        rows->nnz[i]++;
+      }
+    }
+  }
+}
+
+//
+// Also initializes the non-finite values used by rtIsNaN and rtIsInf.
+// Arguments    : void
+// Return Type  : EkfModel
+//
+static EkfModel makeEkfModel()
+{
+  EkfModel model;
+  rt_InitInfAndNaN(8U);
+  findRowNonzeros(c_a, &model.A_rows);
+  measurementModel(model.H_fs0, model.H_PX40);
+  return model;
+}
+
+//
+// The model is computed on the first call, thread-safe as a local static.
+// Arguments    : void
+// Return Type  : const EkfModel *
+//
+static const EkfModel *ekfModel()
+{
+  static const EkfModel model = makeEkfModel();
+  return &model;
+}
+
+#if !EKF_DENSE_PROPAGATION
+//
+// C = S*D with S sparse
+// Arguments    : const SparseRows *S
+//                const double D[361]
+//                double C[361]
+// Return Type  : void
+//
+static void sparseTimesDense(const SparseRows *S, const double D[361], double C
+  [361])
+{
+  int i;
+  int c;
+  int n;
+  double sum;
+  for (c = 0; c < 19; c++) {
+    for (i = 0; i < 19; i++) {
+      sum = 0.0;
+      for (n = 0; n < S->nnz[i]; n++) {
+        sum += S->val[i][n] * D[S->col[i][n] + 19 * c];
+      }
+
+      C[i + 19 * c] = sum;
+    }
+  }
+}
+
+//
+// C = D*S' + Q with S sparse
+// Arguments    : const double D[361]
+//                const SparseRows *S
+//                const double Q[361]
+//                double C[361]
+// Return Type  : void
+//
+static void denseTimesSparseTransposed(const double D[361], const SparseRows *S,
+  const double Q[361], double C[361])
+{
+  int i;
+  int c;
+  int n;
+  double sum;
+  for (c = 0; c < 19; c++) {
+    for (i = 0; i < 19; i++) {
+      sum = 0.0;
+      for (n = 0; n < S->nnz[c]; n++) {
+        sum += D[i + 19 * S->col[c][n]] * S->val[c][n];
+      }
+
+      C[i + 19 * c] = sum + Q[i + 19 * c];
+    }
+  }
+}
+#endif
+
+// Sequential measurement update
+// Instead of inverting the 7x7 innovation covariance with the generic inv(),
+// the measurements are processed one scalar at a time. The FastSLAM block has
+// a full covariance C_fs, so its rows are first decorrelated with the 4x4
+// Cholesky factor L of C_fs (L^-1 H, L^-1 residual, unit variance); the PX4
+// block already has a diagonal covariance. Every scalar update linearizes
+// around the prediction, which makes the result that of the batch update.
+// The covariance is updated in Joseph form and kept exactly symmetric, so it
+// stays positive semi-definite over long hovers where most of the states are
+// barely observed. EKF_SEQUENTIAL_UPDATE 0 selects the generated inv() update.
+#ifndef EKF_SEQUENTIAL_UPDATE
+#define EKF_SEQUENTIAL_UPDATE 1
+#endif
+
+#if EKF_SEQUENTIAL_UPDATE
+//
+// Lower Cholesky factor of a 4x4 covariance (column major)
+// Arguments    : const double A[16]
+//                double L[16]
+// Return Type  : bool, false if A is not positive definite
+//
+static bool cholesky4(const double A[16], double L[16])
+{
+  int i;
+  int j;
+  int k;
+  double sum;
+  memset(&L[0], 0, 16U * sizeof(double));
+  for (j = 0; j < 4; j++) {
+    sum = A[j + 4 * j];
+    for (k = 0; k < j; k++) {
+      sum -= L[j + 4 * k] * L[j + 4 * k];
+    }
+
+    if (!(sum > 0.0)) {
+      return false;
+    }
+
+    L[j + 4 * j] = std::sqrt(sum);
+    for (i = j + 1; i < 4; i++) {
+      sum = A[i + 4 * j];
+      for (k = 0; k < j; k++) {
+        sum -= L[i + 4 * k] * L[j + 4 * k];
+      }
+
+      L[i + 4 * j] = sum / L[j + 4 * j];
+    }
+  }
+
+  return true;
+}
+
+//
+// Update with the scalar measurement e = h*(x - x_p) + noise of variance r
+// Arguments    : const double h[19]
+//                double e, residual to the prediction
+//                double r
+//                const double x_p[19]
+//                double x[19]
+//                double Pk[361] (column major)
+// Return Type  : void
+//
+static void scalarUpdate(const double h[19], double e, double r, const double
+  x_p[19], double x[19], double Pk[361])
+{
+  int idx[19];
+  int n;
+  int i;
+  int j;
+  int m;
+  double ph[19];
+  double kg[19];
+  double s;
+  double y;
+  n = 0;
+  for (j = 0; j < 19; j++) {
+    if (h[j] != 0.0) {
+      idx[n++] = j;
+    }
+  }
+
+  // innovation against the current estimate and P*h'
+  y = e;
+  s = r;
+  for (m = 0; m < n; m++) {
+    y -= h[idx[m]] * (x[idx[m]] - x_p[idx[m]]);
+  }
+
+  for (i = 0; i < 19; i++) {
+    ph[i] = 0.0;
+    for (m = 0; m < n; m++) {
+      ph[i] += Pk[i + 19 * idx[m]] * h[idx[m]];
+    }
+  }
+
+  for (m = 0; m < n; m++) {
+    s += h[idx[m]] * ph[idx[m]];
+  }
+
+  if (!(s > 0.0)) {
+    return;
+  }
+
+  for (i = 0; i < 19; i++) {
+    kg[i] = ph[i] / s;
+    x[i] += kg[i] * y;
+  }
+
+  // Joseph form (I - k*h)*P*(I - k*h)' + k*r*k' = P - k*ph' - ph*k' + s*k*k'
+  for (j = 0; j < 19; j++) {
+    for (i = 0; i <= j; i++) {
+      Pk[i + 19 * j] += (s * kg[i] * kg[j] - kg[i] * ph[j]) - ph[i] * kg[j];
+      Pk[j + 19 * i] = Pk[i + 19 * j];
+    }
+  }
+}
+#endif
 
 // Function Definitions
 
 //
 // function est = ekf(fastslam_on, fastslam, C_fs, PX4, roll_ref, pitch_ref, yaw_ref, thrust_ref)
-// Arguments    : unsigned char fastslam_on
+// Arguments    : ekf_state_t *state
+//                unsigned char fastslam_on
 //                const double fastslam[4]
 //                const double C_fs[16]
 //                const double PX4[3]
@@ -40,38 +310,25 @@ static double P[361];
 //                double *VarYaw
 // Return Type  : void
 //
-void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
-         [16], const double PX4[3], double roll_ref, double pitch_ref, double
-         yaw_ref, double thrust_ref, double est[19], double Pout[9], double
-         *VarYaw)
+void ekf_step(ekf_state_t *state, unsigned char fastslam_on, const double
+              fastslam[4], const double C_fs[16], const double PX4[3], double
+              roll_ref, double pitch_ref, double yaw_ref, double thrust_ref,
+              double est[19], double Pout[9], double *VarYaw)
 {
+  const EkfModel *model = ekfModel();
+  double *states = state->states;
+  double *P = state->P;
   double b_refState;
   double b_refOldinput;
   double H_fs[76];
   double H_PX4[57];
   int i0;
   double cov[361];
-  static const signed char iv0[361] = { 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 1 };
 
   int meas_size_idx_0;
   double h_fs[76];
   double R_data[49];
-  static const double C_PX4[9] = { 0.01, 0.0, 0.0, 0.0, 0.01, 0.0, 0.0, 0.0,
-    0.01 };
+  double C_PX4[9];
 
   double meas_data[7];
   int H_size_idx_0;
@@ -84,32 +341,6 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   int c;
   double b_C_fs[49];
   double b_a[19];
-  static const double c_a[361] = { 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0477,
-    0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0907, 1.1869, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.091, -0.3037, 0.0, 1.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    -0.1452, 0.1289, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, -0.1045, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0477, 0.0, 0.0, 0.0, 0.0, 0.0,
-    1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, -0.4027, 0.261, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.197, 0.2374, 0.0, 1.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0828,
-    0.1581, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0646, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.944, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0473, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.7913, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 };
-
   int cr;
   double states_p[19];
   static const double d_a[76] = { 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0,
@@ -119,8 +350,7 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
     0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
     0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0 };
 
-  static const double dv0[21] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
-    0.0, 0.0, 0.0, 0.01, 0.0, 0.0, 0.0, 0.01, 0.0, 0.0, 0.0, 0.01 };
+  double dv0[21];
 
   int br;
   int ic;
@@ -130,6 +360,7 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   int ar;
   int ib;
   double P_p[361];
+#if EKF_DENSE_PROPAGATION
   static const double b[361] = { 1.0, 0.0, 0.0477, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
     0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0,
     0.0, 0.0, 0.0477, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
@@ -156,56 +387,53 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
     0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0,
     0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
     1.0 };
+#endif
 
   int ia;
   double b_h_fs[133];
+  static const signed char iv1[3] = { 2, 7, 14 };
+#if EKF_SEQUENTIAL_UPDATE
+  double L_fs[16];
+  double H_w[76];
+  double e_w[4];
+  double h_row[19];
+  double e_row;
+  bool decorrelated;
+#else
   double L_data[133];
   int C_size[2];
   double C_data[49];
   int R_size[2];
   double dv1[361];
-  static const signed char iv1[3] = { 2, 7, 14 };
+#if !EKF_DENSE_PROPAGATION
+  SparseRows dv1_rows;
+#endif
+#endif
 
   // Initialize constant matrices
-  uunwrap(yaw_ref, refState, refOldinput, &b_refState, &b_refOldinput);
-  refState = b_refState;
-  refOldinput = b_refOldinput;
-  if (rtIsNaN(refState)) {
-    refState = 0.0;
+  uunwrap(yaw_ref, state->refState, state->refOldinput, &b_refState,
+          &b_refOldinput);
+  state->refState = b_refState;
+  state->refOldinput = b_refOldinput;
+  if (rtIsNaN(state->refState)) {
+    state->refState = 0.0;
   }
 
-  if (rtIsNaN(refOldinput)) {
-    refOldinput = 0.0;
+  if (rtIsNaN(state->refOldinput)) {
+    state->refOldinput = 0.0;
   }
 
-  measurementModel(H_fs, H_PX4);
+  // the measurement models are constant, see makeEkfModel
+  memcpy(&H_fs[0], &model->H_fs0[0], 76U * sizeof(double));
+  memcpy(&H_PX4[0], &model->H_PX40[0], 57U * sizeof(double));
 
   //  Number of states
-  // weight matrix for states noise
-  for (i0 = 0; i0 < 361; i0++) {
-    cov[i0] = iv0[i0];
+  // weight matrix for states noise, see ekf_reset
+  memset(&cov[0], 0, 361U * sizeof(double));
+  for (i0 = 0; i0 < 19; i0++) {
+    cov[20 * i0] = state->Q[i0];
   }
 
-  cov[0] = 2.0;
-  cov[20] = 2.0;
-  cov[40] = 10.0;
-
-  // 2*10;
-  cov[140] = 10.0;
-  cov[240] = 1.0;
-  cov[280] = 1.0;
-
-  //  z dot
-  cov[300] = 10.0;
-  cov[320] = 0.01;
-
-  //  z bias
-  cov[340] = 1.0E-4;
-
-  //  pitch bias
-  cov[360] = 1.0E-4;
-
-  // roll bias
   //
   //  cov = 2*eye(n);
   //
@@ -217,7 +445,14 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   //  cov(17,17) = 0.01; % z bias
   //  cov(18,18) = 0.000001; % pitch bias
   //  cov(19,19) = 0.000001; %roll bias
-  // constant covariance noise matrix PX4
+  // constant covariance noise matrix PX4, see ekf_reset
+  memset(&C_PX4[0], 0, 9U * sizeof(double));
+  memset(&dv0[0], 0, 21U * sizeof(double));
+  for (i0 = 0; i0 < 3; i0++) {
+    C_PX4[i0 << 2] = state->R_PX4[i0];
+    dv0[12 + (i0 << 2)] = state->R_PX4[i0];
+  }
+
   // C_PX4(3,3) = 1;
   // C_fs(1,1) = 1;
   // input vector
@@ -319,12 +554,13 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   // predicted states with linear model
   b_pitch_ref[0] = pitch_ref;
   b_pitch_ref[1] = roll_ref;
-  b_pitch_ref[2] = refState;
+  b_pitch_ref[2] = state->refState;
   b_pitch_ref[3] = thrust_ref - 0.587;
 
   // states_p(13) = mod(states_p(13)+pi,2*pi)-pi;
   //
   // predicted covariance estimate with linearised model
+#if EKF_DENSE_PROPAGATION
   for (i0 = 0; i0 < 19; i0++) {
     a[i0] = 0.0;
     for (c = 0; c < 19; c++) {
@@ -353,6 +589,24 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
       P_p[i0 + 19 * c] = b_refState + cov[i0 + 19 * c];
     }
   }
+#else
+  for (i0 = 0; i0 < 19; i0++) {
+    a[i0] = 0.0;
+    for (c = 0; c < model->A_rows.nnz[i0]; c++) {
+      a[i0] += model->A_rows.val[i0][c] * states[model->A_rows.col[i0][c]];
+    }
+
+    b_a[i0] = 0.0;
+    for (c = 0; c < 4; c++) {
+      b_a[i0] += d_a[i0 + 19 * c] * b_pitch_ref[c];
+    }
+
+    states_p[i0] = a[i0] + b_a[i0];
+  }
+
+  sparseTimesDense(&model->A_rows, P, e_a);
+  denseTimesSparseTransposed(e_a, &model->A_rows, cov, P_p);
+#endif
 
   // Update step
   // measurement residual with linear model (H is always linear here)
@@ -400,6 +654,60 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   meas_data[meas_size_idx_0 - 1] = b_mod(meas_data[meas_size_idx_0 - 1] +
     3.1415926535897931) - 3.1415926535897931;
 
+#if EKF_SEQUENTIAL_UPDATE
+  memcpy(&states[0], &states_p[0], 19U * sizeof(double));
+  memcpy(&P[0], &P_p[0], 361U * sizeof(double));
+  i0 = 0;
+  if (fastslam_on == 1) {
+    // FastSLAM rows decorrelated with the Cholesky factor of C_fs, only the
+    // variances are used if C_fs is not positive definite
+    decorrelated = cholesky4(C_fs, L_fs);
+    for (i0 = 0; i0 < 4; i0++) {
+      if (decorrelated) {
+        for (c = 0; c < 19; c++) {
+          h_row[c] = H_data[i0 + 7 * c];
+          for (k = 0; k < i0; k++) {
+            h_row[c] -= L_fs[i0 + 4 * k] * H_w[k + (c << 2)];
+          }
+
+          h_row[c] /= L_fs[5 * i0];
+          H_w[i0 + (c << 2)] = h_row[c]; // row i0 of L^-1 H
+        }
+
+        e_row = meas_data[i0];
+        for (k = 0; k < i0; k++) {
+          e_row -= L_fs[i0 + 4 * k] * e_w[k];
+        }
+
+        e_row /= L_fs[5 * i0];
+        e_w[i0] = e_row; // element i0 of L^-1 residual
+        scalarUpdate(h_row, e_row, 1.0, states_p, states, P);
+      } else if (C_fs[5 * i0] > 0.0) {
+        for (c = 0; c < 19; c++) {
+          h_row[c] = H_data[i0 + 7 * c];
+        }
+
+        scalarUpdate(h_row, meas_data[i0], C_fs[5 * i0], states_p, states,
+                     P);
+      }
+    }
+  }
+
+  // PX4 rows, R is diagonal
+  for (; i0 < meas_size_idx_0; i0++) {
+    for (c = 0; c < 19; c++) {
+      h_row[c] = H_data[i0 + H_size_idx_0 * c];
+    }
+
+    scalarUpdate(h_row, meas_data[i0], R_data[i0 + meas_size_idx_0 * i0],
+                 states_p, states, P);
+  }
+
+  // Output of the function (for state feedback)
+  for (k = 0; k < 19; k++) {
+    est[k] = states[k];
+  }
+#else
   // residual covariance with linear model
   for (i0 = 0; i0 < 19; i0++) {
     for (c = 0; c < H_size_idx_0; c++) {
@@ -605,6 +913,7 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
   // Output of the function (for state feedback)
   // states(13) = mod(states(13)+pi,2*pi)-pi;
   // refState = mod(refState+pi,2*pi)-pi;
+#if EKF_DENSE_PROPAGATION
   for (k = 0; k < 19; k++) {
     for (i0 = 0; i0 < 19; i0++) {
       P[k + 19 * i0] = 0.0;
@@ -615,6 +924,14 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
 
     est[k] = states[k];
   }
+#else
+  findRowNonzeros(dv1, &dv1_rows);
+  sparseTimesDense(&dv1_rows, P_p, P);
+  for (k = 0; k < 19; k++) {
+    est[k] = states[k];
+  }
+#endif
+#endif
 
   est[12] = b_mod(states[12] + 3.1415926535897931) - 3.1415926535897931;
 
@@ -630,26 +947,96 @@ void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
 }
 
 //
-// Arguments    : void
+// Arguments    : unsigned char fastslam_on
+//                const double fastslam[4]
+//                const double C_fs[16]
+//                const double PX4[3]
+//                double roll_ref
+//                double pitch_ref
+//                double yaw_ref
+//                double thrust_ref
+//                double est[19]
+//                double Pout[9]
+//                double *VarYaw
 // Return Type  : void
 //
-void ekf_init()
+void ekf(unsigned char fastslam_on, const double fastslam[4], const double C_fs
+         [16], const double PX4[3], double roll_ref, double pitch_ref, double
+         yaw_ref, double thrust_ref, double est[19], double Pout[9], double
+         *VarYaw)
+{
+  ekf_step(&defaultState, fastslam_on, fastslam, C_fs, PX4, roll_ref, pitch_ref,
+           yaw_ref, thrust_ref, est, Pout, VarYaw);
+}
+
+//
+// Arguments    : ekf_state_t *state
+// Return Type  : void
+//
+void ekf_reset(ekf_state_t *state)
 {
   int k;
-  refState = 0.0;
-  refOldinput = 0.0;
+  static const double Q0[19] = { 2.0, 2.0, 10.0, 1.0, 1.0, 1.0, 1.0, 10.0, 1.0,
+    1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10.0, 0.01, 1.0E-4, 1.0E-4 };
+
+  //  noise of the flight configuration
+  memcpy(&state->Q[0], &Q0[0], 19U * sizeof(double));
+  for (k = 0; k < 3; k++) {
+    state->R_PX4[k] = 0.01;
+  }
+
+  state->refState = 0.0;
+  state->refOldinput = 0.0;
 
   //  Initialize the state vector the first time the function is used
-  memset(&states[0], 0, 19U * sizeof(double));
+  memset(&state->states[0], 0, 19U * sizeof(double));
 
   // [meas(1);meas(2);0;0;0;0;0;0;0;0;0;0;0;meas(6);0;0];
   //  Initialize the covariance vector the first time the function is used
-  memset(&P[0], 0, 361U * sizeof(double));
+  memset(&state->P[0], 0, 361U * sizeof(double));
   for (k = 0; k < 19; k++) {
-    P[k + 19 * k] = 1.0;
+    state->P[k + 19 * k] = 1.0;
   }
 }
 
+//
+// Arguments    : void
+// Return Type  : ekf_state_t *
+//
+ekf_state_t *ekf_create()
+{
+  ekf_state_t *state = new ekf_state_t;
+  ekf_reset(state);
+  return state;
+}
+
+//
+// Arguments    : const ekf_state_t *state
+// Return Type  : ekf_state_t *
+//
+ekf_state_t *ekf_clone(const ekf_state_t *state)
+{
+  return new ekf_state_t(*state);
+}
+
+//
+// Arguments    : ekf_state_t *state
+// Return Type  : void
+//
+void ekf_destroy(ekf_state_t *state)
+{
+  delete state;
+}
+
+//
+// Arguments    : void
+// Return Type  : void
+//
+void ekf_init()
+{
+  ekf_reset(&defaultState);
+}
+
 //
 // File trailer for ekf.cpp
 //
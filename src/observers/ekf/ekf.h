@@ -25,6 +25,15 @@ extern void ekf(unsigned char fastslam_on, const double fastslam[4], const
                 pitch_ref, double yaw_ref, double thrust_ref, double est[19],
                 double Pout[9], double *VarYaw);
 extern void ekf_init();
+extern void ekf_step(ekf_state_t *state, unsigned char fastslam_on, const
+                     double fastslam[4], const double C_fs[16], const double
+                     PX4[3], double roll_ref, double pitch_ref, double yaw_ref,
+                     double thrust_ref, double est[19], double Pout[9], double
+                     *VarYaw);
+extern void ekf_reset(ekf_state_t *state);
+extern ekf_state_t *ekf_create();
+extern ekf_state_t *ekf_clone(const ekf_state_t *state);
+extern void ekf_destroy(ekf_state_t *state);
 
 #endif
 
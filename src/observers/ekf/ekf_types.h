@@ -12,6 +12,22 @@
 
 // Include Files
 #include "rtwtypes.h"
+
+// Type Definitions
+// State of one filter. ekf() and ekf_init() work on a default instance, every
+// instance created with ekf_create() or declared and set with ekf_reset() runs
+// independently of the others, on any thread. A state is copied like a struct.
+// Q and R_PX4 are the noise parameters of the filter, ekf_reset sets the values
+// used in flight and they may be changed before any step (see EKFTuning).
+typedef struct {
+  double refState;
+  double refOldinput;
+  double states[19];
+  double P[361];
+  double Q[19];     // diagonal of the process noise covariance
+  double R_PX4[3];  // variances of the PX4 pitch, roll and yaw
+} ekf_state_t;
+
 #endif
 
 //
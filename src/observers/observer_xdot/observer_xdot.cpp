@@ -13,19 +13,23 @@
 #include "observer_xdot.h"
 
 // Variable Definitions
-static double states[5];
+// the observer behind observer_xdot() and observer_xdot_init()
+static observer_xdot_state_t defaultState;
 
 // Function Definitions
 
 //
 // Initialize State Transition Matrix
-// Arguments    : const double meas[2]
+// Arguments    : observer_xdot_state_t *state
+//                const double meas[2]
 //                double u
 //                double y[5]
 // Return Type  : void
 //
-void observer_xdot(const double meas[2], double u, double y[5])
+void observer_xdot_step(observer_xdot_state_t *state, const double meas[2],
+  double u, double y[5])
 {
+  double *states = state->states;
   double a[5];
   double b_a[5];
   int i0;
@@ -88,19 +92,68 @@ void observer_xdot(const double meas[2], double u, double y[5])
 }
 
 //
-// Arguments    : void
+// Arguments    : const double meas[2]
+//                double u
+//                double y[5]
 // Return Type  : void
 //
-void observer_xdot_init()
+void observer_xdot(const double meas[2], double u, double y[5])
+{
+  observer_xdot_step(&defaultState, meas, u, y);
+}
+
+//
+// Arguments    : observer_xdot_state_t *state
+// Return Type  : void
+//
+void observer_xdot_reset(observer_xdot_state_t *state)
 {
   int i;
 
   //  Initialize the state vector the first time the function is used
   for (i = 0; i < 5; i++) {
-    states[i] = 0.0;
+    state->states[i] = 0.0;
   }
 }
 
+//
+// Arguments    : void
+// Return Type  : observer_xdot_state_t *
+//
+observer_xdot_state_t *observer_xdot_create()
+{
+  observer_xdot_state_t *state = new observer_xdot_state_t;
+  observer_xdot_reset(state);
+  return state;
+}
+
+//
+// Arguments    : const observer_xdot_state_t *state
+// Return Type  : observer_xdot_state_t *
+//
+observer_xdot_state_t *observer_xdot_clone(const observer_xdot_state_t *state)
+{
+  return new observer_xdot_state_t(*state);
+}
+
+//
+// Arguments    : observer_xdot_state_t *state
+// Return Type  : void
+//
+void observer_xdot_destroy(observer_xdot_state_t *state)
+{
+  delete state;
+}
+
+//
+// Arguments    : void
+// Return Type  : void
+//
+void observer_xdot_init()
+{
+  observer_xdot_reset(&defaultState);
+}
+
 //
 // File trailer for observer_xdot.cpp
 //
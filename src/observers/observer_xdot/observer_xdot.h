@@ -19,6 +19,13 @@
 // Function Declarations
 extern void observer_xdot(const double meas[2], double u, double y[5]);
 extern void observer_xdot_init();
+extern void observer_xdot_step(observer_xdot_state_t *state, const double
+                               meas[2], double u, double y[5]);
+extern void observer_xdot_reset(observer_xdot_state_t *state);
+extern observer_xdot_state_t *observer_xdot_create();
+extern observer_xdot_state_t *observer_xdot_clone(const observer_xdot_state_t
+  *state);
+extern void observer_xdot_destroy(observer_xdot_state_t *state);
 
 #endif
 
@@ -12,6 +12,15 @@
 
 // Include Files
 #include "rtwtypes.h"
+
+// Type Definitions
+// State of one observer. observer_xdot() and observer_xdot_init() work on a
+// default instance, further instances are created with observer_xdot_create()
+// or declared and set with observer_xdot_reset().
+typedef struct {
+  double states[5];
+} observer_xdot_state_t;
+
 #endif
 
 //
@@ -13,19 +13,23 @@
 #include "observer_ydot.h"
 
 // Variable Definitions
-static double states[5];
+// the observer behind observer_ydot() and observer_ydot_init()
+static observer_ydot_state_t defaultState;
 
 // Function Definitions
 
 //
 // Initialize State Transition Matrix
-// Arguments    : const double meas[2]
+// Arguments    : observer_ydot_state_t *state
+//                const double meas[2]
 //                double u
 //                double y[5]
 // Return Type  : void
 //
-void observer_ydot(const double meas[2], double u, double y[5])
+void observer_ydot_step(observer_ydot_state_t *state, const double meas[2],
+  double u, double y[5])
 {
+  double *states = state->states;
   double a[5];
   double b_a[5];
   int i0;
@@ -89,19 +93,68 @@ void observer_ydot(const double meas[2], double u, double y[5])
 }
 
 //
-// Arguments    : void
+// Arguments    : const double meas[2]
+//                double u
+//                double y[5]
 // Return Type  : void
 //
-void observer_ydot_init()
+void observer_ydot(const double meas[2], double u, double y[5])
+{
+  observer_ydot_step(&defaultState, meas, u, y);
+}
+
+//
+// Arguments    : observer_ydot_state_t *state
+// Return Type  : void
+//
+void observer_ydot_reset(observer_ydot_state_t *state)
 {
   int i;
 
   //  Initialize the state vector the first time the function is used
   for (i = 0; i < 5; i++) {
-    states[i] = 0.0;
+    state->states[i] = 0.0;
   }
 }
 
+//
+// Arguments    : void
+// Return Type  : observer_ydot_state_t *
+//
+observer_ydot_state_t *observer_ydot_create()
+{
+  observer_ydot_state_t *state = new observer_ydot_state_t;
+  observer_ydot_reset(state);
+  return state;
+}
+
+//
+// Arguments    : const observer_ydot_state_t *state
+// Return Type  : observer_ydot_state_t *
+//
+observer_ydot_state_t *observer_ydot_clone(const observer_ydot_state_t *state)
+{
+  return new observer_ydot_state_t(*state);
+}
+
+//
+// Arguments    : observer_ydot_state_t *state
+// Return Type  : void
+//
+void observer_ydot_destroy(observer_ydot_state_t *state)
+{
+  delete state;
+}
+
+//
+// Arguments    : void
+// Return Type  : void
+//
+void observer_ydot_init()
+{
+  observer_ydot_reset(&defaultState);
+}
+
 //
 // File trailer for observer_ydot.cpp
 //
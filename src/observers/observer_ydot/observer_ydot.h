@@ -19,6 +19,13 @@
 // Function Declarations
 extern void observer_ydot(const double meas[2], double u, double y[5]);
 extern void observer_ydot_init();
+extern void observer_ydot_step(observer_ydot_state_t *state, const double
+                               meas[2], double u, double y[5]);
+extern void observer_ydot_reset(observer_ydot_state_t *state);
+extern observer_ydot_state_t *observer_ydot_create();
+extern observer_ydot_state_t *observer_ydot_clone(const observer_ydot_state_t
+  *state);
+extern void observer_ydot_destroy(observer_ydot_state_t *state);
 
 #endif
 
@@ -12,6 +12,15 @@
 
 // Include Files
 #include "rtwtypes.h"
+
+// Type Definitions
+// State of one observer. observer_ydot() and observer_ydot_init() work on a
+// default instance, further instances are created with observer_ydot_create()
+// or declared and set with observer_ydot_reset().
+typedef struct {
+  double states[5];
+} observer_ydot_state_t;
+
 #endif
 
 //
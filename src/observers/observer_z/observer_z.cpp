@@ -13,19 +13,23 @@
 #include "observer_z.h"
 
 // Variable Definitions
-static double states[3];
+// the observer behind observer_z() and observer_z_init()
+static observer_z_state_t defaultState;
 
 // Function Definitions
 
 //
 // Initialize State Transition Matrix
-// Arguments    : double meas
+// Arguments    : observer_z_state_t *state
+//                double meas
 //                double u
 //                double y[4]
 // Return Type  : void
 //
-void observer_z(double meas, double u, double y[4])
+void observer_z_step(observer_z_state_t *state, double meas, double u,
+  double y[4])
 {
+  double *states = state->states;
   double a[3];
   double b_a[3];
   int i0;
@@ -92,19 +96,68 @@ void observer_z(double meas, double u, double y[4])
 }
 
 //
-// Arguments    : void
+// Arguments    : double meas
+//                double u
+//                double y[4]
 // Return Type  : void
 //
-void observer_z_init()
+void observer_z(double meas, double u, double y[4])
+{
+  observer_z_step(&defaultState, meas, u, y);
+}
+
+//
+// Arguments    : observer_z_state_t *state
+// Return Type  : void
+//
+void observer_z_reset(observer_z_state_t *state)
 {
   int i;
 
   //  Initialize the state vector the first time the function is used
   for (i = 0; i < 3; i++) {
-    states[i] = 0.0;
+    state->states[i] = 0.0;
   }
 }
 
+//
+// Arguments    : void
+// Return Type  : observer_z_state_t *
+//
+observer_z_state_t *observer_z_create()
+{
+  observer_z_state_t *state = new observer_z_state_t;
+  observer_z_reset(state);
+  return state;
+}
+
+//
+// Arguments    : const observer_z_state_t *state
+// Return Type  : observer_z_state_t *
+//
+observer_z_state_t *observer_z_clone(const observer_z_state_t *state)
+{
+  return new observer_z_state_t(*state);
+}
+
+//
+// Arguments    : observer_z_state_t *state
+// Return Type  : void
+//
+void observer_z_destroy(observer_z_state_t *state)
+{
+  delete state;
+}
+
+//
+// Arguments    : void
+// Return Type  : void
+//
+void observer_z_init()
+{
+  observer_z_reset(&defaultState);
+}
+
 //
 // File trailer for observer_z.cpp
 //
@@ -19,6 +19,13 @@
 // Function Declarations
 extern void observer_z(double meas, double u, double y[4]);
 extern void observer_z_init();
+extern void observer_z_step(observer_z_state_t *state, double meas, double u,
+                            double y[4]);
+extern void observer_z_reset(observer_z_state_t *state);
+extern observer_z_state_t *observer_z_create();
+extern observer_z_state_t *observer_z_clone(const observer_z_state_t
+  *state);
+extern void observer_z_destroy(observer_z_state_t *state);
 
 #endif
 
@@ -12,6 +12,15 @@
 
 // Include Files
 #include "rtwtypes.h"
+
+// Type Definitions
+// State of one observer. observer_z() and observer_z_init() work on a
+// default instance, further instances are created with observer_z_create()
+// or declared and set with observer_z_reset().
+typedef struct {
+  double states[3];
+} observer_z_state_t;
+
 #endif
 
 //
@@ -90,12 +90,12 @@ void prepareLogFile(ofstream * fileObject, const char * filePrefix)
     fileObject->open(pathBuffer, ios::out | ios::ate);
 }
 
-void logAppendTimestamp(ofstream &fileObject, ros::Duration time)
+void logAppendTimestamp(ostream &fileObject, ros::Duration time)
 {
     fileObject << time.sec << "." << setfill('0') << setw(3) << time.nsec / 1000000 << ", ";
 }
 
-void logAppendTimestampNow(ofstream &fileObject)
+void logAppendTimestampNow(ostream &fileObject)
 {
     ros::Time now = ros::Time::now();
     fileObject << now.sec << "." << setfill('0') << setw(3) << now.nsec / 1000000 << ", ";